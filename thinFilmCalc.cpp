@@ -10,14 +10,292 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cctype>
 #include <cmath>
 #include <vector>
+#include <algorithm>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <charconv>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <complex>
+#include <shared_mutex>
+#include <string_view>
+#include <type_traits>
+#include <cerrno>
+#include <exception>
+#include <stdexcept>
+//the functions of thinFilmCalc.h are defined here, not imported
+#define THINFILMCALC_SOURCE 1
+#include "thinFilmCalc.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <poll.h>
+#define THIN_FILM_POSIX 1
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define THIN_FILM_INOTIFY 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define THIN_FILM_X86_DISPATCH 1
+#endif
 
 using namespace std;
 
+class Dispersion;
+
+/**
+    ends the program after an error it cannot go on from. The library
+    build of thinFilmCalc.h must not end its host, so there the error is
+    thrown as a runtime_error, which the C interface returns as an error
+    @param out The stream the message is printed on
+    @param message The message, without a newline
+    @param status The exit status
+*/
+[[noreturn]] void fail(ostream& out, const string& message, int status);
+
+/**
+    returns the stream warnings about the input are printed on: standard
+    error, or a stream that discards them in the library build, whose host
+    has its own way of reporting
+*/
+ostream& warnings();
+
+/**
+    Block_arena stores objects in fixed size blocks that are never moved or
+    freed until the arena is destroyed, so an object keeps its id and its
+    address while more are added. Adding must be serialised by the caller;
+    get() may run on any thread that received the id through something that
+    synchronises, such as a mutex or the start of a thread.
+*/
+template <class T>
+class Block_arena  {
+public:
+    Block_arena();
+
+    //frees every block
+    ~Block_arena();
+
+    /**
+        stores a copy of a value
+        @param value The value to store
+        @return the id of the copy
+    */
+    uint32_t add(const T& value);
+
+    //returns the object with an id
+    const T& get(uint32_t id) const;
+
+    //returns the number of objects stored
+    uint32_t size() const;
+
+private:
+    Block_arena(const Block_arena&);
+    Block_arena& operator=(const Block_arena&);
+
+    static const uint32_t BLOCK_BITS = 12;
+    static const uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+    static const uint32_t MAX_BLOCKS = 4096;
+    T* blocks[MAX_BLOCKS];
+    uint32_t count;
+};
+
+template <class T>
+Block_arena<T>::Block_arena() : blocks(), count(0)  {
+}
+
+template <class T>
+Block_arena<T>::~Block_arena()  {
+    for (uint32_t i = 0; i < MAX_BLOCKS && blocks[i] != 0; i++) {
+        delete[] blocks[i];
+    }
+}
+
+template <class T>
+uint32_t Block_arena<T>::add(const T& value)  {
+    uint32_t block = count >> BLOCK_BITS;
+    if (block >= MAX_BLOCKS)  {
+        fail(cerr, "Too many entries for the arena.", -1);
+    }
+    if (blocks[block] == 0)  {
+        blocks[block] = new T[BLOCK_SIZE];
+    }
+    blocks[block][count & (BLOCK_SIZE - 1)] = value;
+    return count++;
+}
+
+template <class T>
+const T& Block_arena<T>::get(uint32_t id) const  {
+    return blocks[id >> BLOCK_BITS][id & (BLOCK_SIZE - 1)];
+}
+
+template <class T>
+uint32_t Block_arena<T>::size() const  {
+    return count;
+}
+
+/**
+    Spsc_ring is a bounded lock-free queue between exactly one producer
+    thread and one consumer thread. The storage is allocated once; the
+    producer only writes the tail and the consumer only writes the head,
+    each on its own cache line, so a push or a pop is an acquire load of
+    the other side's counter and a release store of its own.
+*/
+template <class T>
+class Spsc_ring  {
+public:
+    /**
+        allocates the ring
+        @param capacity The least number of items it must hold
+    */
+    explicit Spsc_ring(size_t capacity);
+
+    //appends an item, returns false if the ring is full; producer only
+    bool push(const T& item);
+
+    //removes the oldest item, returns false if the ring is empty; consumer only
+    bool pop(T& item);
+
+private:
+    Spsc_ring(const Spsc_ring&);
+    Spsc_ring& operator=(const Spsc_ring&);
+
+    vector<T> items;
+    size_t mask;
+    //the next item to pop, written by the consumer
+    alignas(64) atomic<size_t> head;
+    //the next free place, written by the producer
+    alignas(64) atomic<size_t> tail;
+};
+
+template <class T>
+Spsc_ring<T>::Spsc_ring(size_t capacity) : head(0), tail(0)  {
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    items.resize(size);
+    mask = size - 1;
+}
+
+template <class T>
+bool Spsc_ring<T>::push(const T& item)  {
+    size_t end = tail.load(memory_order_relaxed);
+    if (end - head.load(memory_order_acquire) > mask)  {
+        return false;
+    }
+    items[end & mask] = item;
+    tail.store(end + 1, memory_order_release);
+    return true;
+}
+
+template <class T>
+bool Spsc_ring<T>::pop(T& item)  {
+    size_t start = head.load(memory_order_relaxed);
+    if (start == tail.load(memory_order_acquire))  {
+        return false;
+    }
+    item = items[start & mask];
+    head.store(start + 1, memory_order_release);
+    return true;
+}
+
+/**
+    String_pool interns strings: every distinct string is stored once and
+    named by a small integer id, so records can hold a 4 byte id instead of
+    their own string and compare names by id. Id 0 is the empty string.
+    The strings live in a Block_arena and are found through an open
+    addressing table of (hash, id) slots, so a lookup usually touches one
+    slot and one string. Interning and lookups may run on any thread.
+*/
+class String_pool  {
+public:
+    String_pool();
+
+    /**
+        returns the id of a string, adding it to the pool if it is new
+        @param begin The first character of the string
+        @param end One past the last character
+    */
+    uint32_t intern(const char* begin, const char* end);
+
+    //returns the id of a string, adding it to the pool if it is new
+    uint32_t intern(const string& text);
+
+    /**
+        looks a string up without adding it
+        @param text The string
+        @param id Receives the id of the string
+        @return false if the string is not in the pool
+    */
+    bool find(string_view text, uint32_t& id) const;
+
+    //returns the string with an id
+    const string& get(uint32_t id) const;
+
+    //returns the number of strings in the pool
+    size_t size() const;
+
+    //makes room for n more strings without rehashing
+    void reserve(size_t n);
+
+private:
+    struct Slot  {
+        uint32_t hash;
+        //id + 1, 0 for an empty slot
+        uint32_t id;
+    };
+
+    /**
+        returns the slot holding a string, or the empty slot where it
+        belongs
+        @param text The string
+        @param hash The hash of the string
+    */
+    size_t probe(string_view text, uint32_t hash) const;
+
+    //rebuilds the table with room for at least n strings
+    void grow(size_t n);
+
+    mutable shared_mutex lock;
+    Block_arena<string> strings;
+    //power of two sized, at most half full
+    vector<Slot> slots;
+};
+
+//returns the pool of material names shared by the whole program
+String_pool& materialNames();
+
 class Thin_film  {
 public:
     //default constructor   
@@ -43,7 +321,10 @@ public:
         returns the material of the thin film
         @param mat Material of thin film
     */
-    string getMat() const;
+    const string& getMat() const;
+
+    //returns the id of the material name in materialNames()
+    uint32_t getMatId() const;
     
     /**
         returns spectral range
@@ -58,6 +339,23 @@ public:
         of the thin film being measured
     */
     double getIndex() const;
+
+    /**
+        returns the real part of the refractive index at a wavelength,
+        from the dispersion model if the film has one
+        @param wavelength The wavelength in nm
+    */
+    double getIndex(double wavelength) const;
+
+    /**
+        returns the extinction coefficient k at a wavelength, 0 unless
+        the dispersion model holds one
+        @param wavelength The wavelength in nm
+    */
+    double getExtinction(double wavelength) const;
+
+    //returns the dispersion model, or null for a constant index
+    const Dispersion* getDispersion() const;
     
     /**
         returns approximate thin film thickness assuming Silicon substrate and 
@@ -90,6 +388,14 @@ public:
         @param setIndex sets the index of refraction
     */
     void setIndex(double newIndex);
+
+    /**
+        changes the dispersion model; the index becomes the model's n at
+        632.8nm, a null model keeps the current constant index
+        @param newDispersion The dispersion model of the film, from
+        internDispersion()
+    */
+    void setDispersion(const Dispersion* newDispersion);
     
     /**
         changes the number of maxima the spectral range
@@ -118,200 +424,7548 @@ public:
     */
 	void writeMeasResultFile(ofstream& fout, string fileName)  const;
 	
+	/**
+	    writes one measurement result line in the data.txt layout
+	    without asking the user
+	    @param out The stream to which the result is written
+	*/
+	void writeMeasResult(ostream& out) const;
+	
 	//prints mat & index of library films
 	void printLib() const;
     
 private:
     //Instance variables
-    string mat;
     double spectralRange;
     double index;
     double numberOfMaxima;
+    const Dispersion* dispersion;
+    uint32_t mat;
 };
 
-//formatting constants
-const int MATERIAL_WIDTH = 30;
-const int INDEX_WIDTH = 10;
-const int MAXIMA_WIDTH = 15;
-const int THICKNESS_WIDTH = 20;
-    
-//default constructor
-Thin_film::Thin_film()  {
-    spectralRange = 0.0;
-    index = 0.0;
-    numberOfMaxima = 0.0;
-}
-    
-//overloaded constructor
-Thin_film::Thin_film(string mat, double index)  {
-    setMat(mat);
-    setIndex(index);
-}
-        
-string Thin_film::getMat() const {
-    return mat;
-}
-    
-int Thin_film::getspectralRange() const {
-    return spectralRange;
-}
-    
-double Thin_film::getIndex() const {
-    return index;
-}
-
-double Thin_film::getThickness() const  {
-    return (numberOfMaxima * spectralRange) / 2.0 *
-    sqrt(double ((index * index) - 1));
-}
-
-void Thin_film::setMat(string newMat)   {
-    mat = newMat;
-}
+//films are copied freely into batches, fitters and worker tasks
+static_assert(is_trivially_copyable<Thin_film>::value, "Thin_film must stay a plain record");
 
-void Thin_film::setspectralRange(double newSpectralRange)  {
-    if (newSpectralRange < 0)  {
-        spectralRange = 0.0;
-    }
-        else {
-            spectralRange = newSpectralRange;
-        }
-}
+//the wavelength in nm at which films.txt indices are given
+const double REFERENCE_WAVELENGTH = 632.8;
 
-void Thin_film::setIndex(double newIndex)  {
-    if (newIndex < 0)  {
-        index = 0.0;
-    }
-        else  {
-            index = newIndex;	
-        }
-}
+//dispersion models a film may carry in films.txt
+enum Dispersion_model  {
+    DISPERSION_CAUCHY,
+    DISPERSION_SELLMEIER,
+    DISPERSION_TABLE
+};
 
-void Thin_film::setnumberOfMaxima(double newMaxima) {
-    if (newMaxima < 0)  {
-        numberOfMaxima = 0.0;
-    }
-        else {
-            numberOfMaxima = newMaxima;  
-        }
-}
+/**
+    Dispersion describes how the refractive index n and the extinction
+    coefficient k of a film change with wavelength. In films.txt the index
+    line of a film may hold a model instead of a number:
+        cauchy A B C                   n = A + B/l^2 + C/l^4, l in um
+        sellmeier B1 C1 B2 C2 B3 C3    n^2 = 1 + sum Bi l^2/(l^2 - Ci), l in um
+        table l1 n1 k1 l2 n2 k2 ...    n and k at wavelengths in nm,
+                                       interpolated linearly
+    Cauchy and Sellmeier models have k = 0; a table is held beyond its
+    first and last wavelength.
+*/
+class Dispersion  {
+public:
+    /**
+        parses a model written in the films.txt form
+        @param begin The first character of the model
+        @param end One past the last character
+        @param dispersion Receives the model
+        @return false if the text is not a valid model
+    */
+    static bool parse(const char* begin, const char* end, Dispersion& dispersion);
 
-void Thin_film::print()   const  {
-    cout.setf(ios::fixed);
-    cout << setw(MATERIAL_WIDTH) << left << mat
-        << setw(INDEX_WIDTH) << setprecision(2) << right << index
-        << setw(MAXIMA_WIDTH) << setprecision(2) << numberOfMaxima
-        << setw(THICKNESS_WIDTH) << setprecision(1) << getThickness() << endl;
-}
+    //returns the refractive index n at a wavelength in nm
+    double getIndex(double wavelength) const;
 
-void Thin_film::printLib() const  {
-    cout.setf(ios::fixed);
-    cout << setw(MATERIAL_WIDTH) << left << mat
-        << setw(INDEX_WIDTH) << setprecision(2) << right << index << endl;
-}
+    //returns the extinction coefficient k at a wavelength in nm
+    double getExtinction(double wavelength) const;
 
-void Thin_film::read()  {
-    cout << "Enter the name of the film: ";
-    cin >>ws;
-    getline(cin, mat);
-    cout << "Enter the refractive index of the film: ";
-    cin >> index;
-    cout << "Enter the spectral bandwidth over which the spectra was acquired in nm: ";
-    cin >> spectralRange;
-    cout << "Enter the number of maxima within the spectral range: ";
-    cin >> numberOfMaxima;
-}
+    //returns the model in the films.txt form
+    string format() const;
 
-void Thin_film::read(ifstream& fin) {
-    fin >> ws;
-    getline(fin, mat);
-    fin >> index;
-}
-    
-void Thin_film::readFilm(ifstream& fin) {
-    fin >> ws;
-    getline(fin, mat);
-    fin >> index >> spectralRange >> numberOfMaxima;
-}
+    //returns the kind of model
+    Dispersion_model getModel() const;
 
-void Thin_film::writeFile(ofstream& fout) const {
-    fout << mat << endl << index << endl;
-}
+    //returns the model coefficients; a table holds wavelength, n, k triplets
+    const vector<double>& getCoefficients() const;
 
-void Thin_film::writeMeasResultFile(ofstream& fout, string fileName)  const  {
-    cout << "Would you like to save this measurement result (y/n)? ";
-    string saveMeasurement = "n";
-    cin >> saveMeasurement;
-    if (saveMeasurement == "y")  {
-        ofstream fout;
-        fout.open(fileName, ios::app);
-        if (fout.fail()) {
-            cout << "Output file failed to open.\n";
-            exit(-1);
-        }
-        fout.setf(ios::fixed);
-        fout << setw(MATERIAL_WIDTH) << setprecision(2) << left << mat
-            << setw(INDEX_WIDTH) << setprecision(2) << right << index
-            << setw(MAXIMA_WIDTH) << setprecision(1) << getThickness()
-            << setprecision(1) << endl;
-    }
-}
+private:
+    Dispersion_model model;
+    //model coefficients; a table holds wavelength, n, k triplets
+    vector<double> coefficients;
+};
 
 /**
-adds material to films.txt file
+    returns the shared copy of a dispersion model, kept until the program
+    ends; models with the same films.txt form share one copy
+    @param dispersion The model
 */
-void addMaterial();
+const Dispersion* internDispersion(const Dispersion& dispersion);
 
 /**
-    prints film library to terminal
-    @param materialList The list of Thin Film objects
-*/
-void listFilms(vector<Thin_film>& materialList);
-    
-/**
-    deletes a film from the film file
-    @param materialList The list of Thin Film objects
+    Wavelength_grid is the uniform wavelength axis of an instrument
 */
-void deleteFilm(vector<Thin_film>& materialList);
+struct Wavelength_grid  {
+    //first wavelength in nm
+    double first;
+    //spacing between samples in nm
+    double step;
+    //number of samples
+    size_t count;
+
+    Wavelength_grid(double first = 200.0, double last = 1100.0, double step = 1.0);
+
+    //returns the wavelength of sample i
+    double getWavelength(size_t i) const;
+};
+
+//largest n a dispersion model may give; beyond it the model is next to a pole
+const double MAX_DISPERSION_INDEX = 10.0;
 
 /**
-    gets the film "vector index" (not refractive index)
-    @param materialList The list of films in the library
+    Dispersion_tables holds n(l) and k(l) of every library film with a
+    dispersion model, evaluated once on the instrument wavelength grid, so
+    fitting loops read or interpolate tables instead of evaluating the
+    model formulas. Films with a constant index need no table. The tables
+    follow library positions, so they are built again whenever the films
+    change.
 */
-int getFilmIndex(vector<Thin_film>& materialList);
+class Dispersion_tables  {
+public:
+    /**
+        evaluates the dispersion of every film on a grid
+        @param materialList The list of films in the library
+        @param grid The instrument wavelength grid
+    */
+    void build(const vector<Thin_film>& materialList, const Wavelength_grid& grid);
+
+    //returns the grid the tables were built on
+    const Wavelength_grid& getGrid() const;
+
+    /**
+        returns n at a wavelength, interpolated between grid samples
+        @param pos The library position of the film
+        @param wavelength The wavelength in nm
+    */
+    double getIndex(size_t pos, double wavelength) const;
+
+    /**
+        returns k at a wavelength, interpolated between grid samples
+        @param pos The library position of the film
+        @param wavelength The wavelength in nm
+    */
+    double getExtinction(size_t pos, double wavelength) const;
+
+    /**
+        returns the n table of a film on the grid, or null if its index is
+        constant
+        @param pos The library position of the film
+    */
+    const double* getIndexTable(size_t pos) const;
+
+    //returns the k table of a film on the grid, or null if k is 0
+    const double* getExtinctionTable(size_t pos) const;
+
+private:
+    //interpolates a table at a wavelength
+    double interpolate(const vector<double>& table, double wavelength) const;
+
+    Wavelength_grid grid;
+    vector<double> constants;
+    vector<vector<double> > indexTables;
+    vector<vector<double> > extinctionTables;
+};
 
 /**
-    Loads the film data from the specified file name and returns
-    the data in a vector of Thin Film objects
-    @param list The vector of Thin Film objects
-    @param fileName The name of the file from which to read
+    parses the index line of a films.txt entry: a number or a dispersion
+    model
+    @param begin The first character of the line
+    @param end One past the last character
+    @param film Receives the index and dispersion model
+    @return false if the line is malformed
 */
-void loadData(vector<Thin_film>& materialList, string fileName);
+bool parseOptics(const char* begin, const char* end, Thin_film& film);
+
+//returns the index line of a films.txt entry for a film
+string formatOptics(const Thin_film& film);
+
+//returns whether two films have the same index and dispersion model
+bool sameOptics(const Thin_film& a, const Thin_film& b);
 
 /**
-    Calculates film thickness from arbitrary film or from library
-    @param list of the vector of the Thin Film objects
+    thin film equation shared by Thin_film::getThickness() and the bulk
+    kernels so that every path evaluates exactly the same expression
+    @param index Index of refraction of thin film
+    @param spectralRange Spectral range of spectra
+    @param numberOfMaxima The number of maxima with spectral range
 */
-void calculateThickness(vector<Thin_film>& materialList);
+inline double filmThickness(double index, double spectralRange, double numberOfMaxima)  {
+    return (numberOfMaxima * spectralRange) / 2.0 *
+    sqrt(double ((index * index) - 1));
+}
+
+//instruction sets the bulk thickness kernel can run on
+enum Simd_level { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
 
 /**
-    Writes thin film data to output file
-    @param materialList The name of the file to which to write
-*/
-void saveData(const vector<Thin_film>& materialList, string filename);
+    Film_batch holds many measurements as a structure of arrays (one
+    contiguous array per quantity) so the thickness of all of them can
+    be calculated in one vectorized pass. Values are clamped the same
+    way the Thin_film setters clamp them.
 
-//menu items
-const int CAL_THICKNESS = 1;
-const int MATERIAL_LIST = 2;
-const int ADD_MATERIAL = 3;
-const int DEL_MATERIAL = 4;
-const int EXIT = 0;
+    The AVX2 and AVX-512 kernels perform the same IEEE operations in the
+    same order as filmThickness() (multiply, halve, square root, multiply)
+    and therefore return bit-identical results to Thin_film::getThickness()
+    on a standard build. The vector kernels are always compiled without
+    floating point contraction; if the whole program is built with FMA
+    contraction (for example -march=native), the scalar path may fuse
+    n*n - 1 and differ from the vector path by 1 ulp in the square root
+    argument.
+*/
+class Film_batch  {
+public:
+    //reserves room for n measurements
+    void reserve(size_t n);
 
-int main()  {
-    //load thin films on start up
-    vector<Thin_film> materialList;
-    loadData(materialList, "films.txt");
-        
+    /**
+        appends one measurement
+        @param index Index of refraction of thin film
+        @param spectralRange Spectral range of spectra
+        @param numberOfMaxima The number of maxima with spectral range
+    */
+    void add(double index, double spectralRange, double numberOfMaxima);
+
+    //removes all measurements
+    void clear();
+
+    //returns the number of measurements
+    size_t size() const;
+
+    /**
+        calculates the thickness of every measurement with the selected
+        SIMD kernel
+        @return the thickness array, one entry per measurement
+    */
+    const double* calculateThickness();
+
+    //contiguous input columns and the thickness output column
+    vector<double> index;
+    vector<double> spectralRange;
+    vector<double> numberOfMaxima;
+    vector<double> thickness;
+};
+
+/**
+    calculates thickness[i] for n measurements held in separate arrays,
+    using the kernel chosen by setSimdLevel()
+    @param index Index of refraction of each film
+    @param spectralRange Spectral range of each spectrum
+    @param numberOfMaxima Number of maxima of each spectrum
+    @param thickness Receives the calculated thicknesses
+    @param n The number of measurements
+*/
+void calculateThickness(const double* index, const double* spectralRange,
+    const double* numberOfMaxima, double* thickness, size_t n);
+
+//returns the best instruction set supported by this CPU
+Simd_level detectSimdLevel();
+
+/**
+    selects the kernel used by the bulk thickness calculation; a level the
+    CPU cannot run is lowered to the best supported one
+    @param level The requested instruction set
+    @return the level actually selected
+*/
+Simd_level setSimdLevel(Simd_level level);
+
+//returns the kernel currently used by the bulk thickness calculation
+Simd_level getSimdLevel();
+
+//returns the name of an instruction set level
+const char* simdLevelName(Simd_level level);
+
+//instrumented stages of the measurement pipeline
+enum Stage  {
+    STAGE_LOAD_LIBRARY,
+    STAGE_SAVE_LIBRARY,
+    STAGE_PARSE,
+    STAGE_READ_SPECTRUM,
+    STAGE_PREPROCESS,
+    STAGE_COUNT_FRINGES,
+    STAGE_FFT_ESTIMATE,
+    STAGE_COMPUTE,
+    STAGE_FIT,
+    STAGE_FORMAT_RESULTS,
+    STAGE_WRITE_RESULTS,
+    STAGE_REQUEST,
+    //from the end of its acquisition to its result in the sink, per spectrum
+    STAGE_PIPELINE,
+    STAGE_COUNT
+};
+
+//latency buckets per stage; bucket i counts calls that took [2^i, 2^(i+1)) ns
+const int LATENCY_BUCKETS = 40;
+
+//switches the collection of stage statistics on or off, it starts off
+void setStatsEnabled(bool enabled);
+
+//returns whether stage statistics are collected
+bool getStatsEnabled();
+
+//returns the name of a stage
+const char* stageName(Stage stage);
+
+/**
+    adds one call of a stage to the statistics; the counters are relaxed
+    atomics, so stages may be recorded from any thread
+    @param stage The stage
+    @param nanos How long the call took
+    @param items The number of films, rows or records it handled
+    @param bytes The bytes it read or wrote
+*/
+void recordStage(Stage stage, uint64_t nanos, uint64_t items, uint64_t bytes);
+
+/**
+    formats the statistics of every stage that ran as a table with latency
+    histograms, followed by the fit cache counters if the cache was used
+*/
+string formatStats();
+
+/**
+    formats the statistics on one line for scraping, a field per stage
+        name=calls,items,nanos,bytes,p50,p99
+    with the percentiles in ns, then fit_cache=hits,disk_hits,misses,evictions
+    if the cache was used and uptime=ns
+*/
+string formatStatsLine();
+
+//fit cache events counted for the statistics as relaxed atomics
+enum Cache_event  {
+    CACHE_HIT,
+    CACHE_DISK_HIT,
+    CACHE_MISS,
+    CACHE_EVICTION,
+    CACHE_EVENT_COUNT
+};
+
+//counts one fit cache event, whether or not statistics are on
+void recordCacheEvent(Cache_event event);
+
+/**
+    Stage_timer records the time from its construction to its destruction,
+    or to finish(), as one call of a stage. While statistics are off it
+    does not read the clock.
+*/
+class Stage_timer  {
+public:
+    /**
+        starts timing a call
+        @param stage The stage
+        @param items The number of items the call handles
+    */
+    explicit Stage_timer(Stage stage, uint64_t items = 1);
+
+    //records the call unless finish() already did
+    ~Stage_timer();
+
+    //changes the number of items recorded for the call
+    void setItems(uint64_t items);
+
+    //adds bytes read or written by the call
+    void addBytes(uint64_t bytes);
+
+    //records the call so far and starts timing the next one
+    void restart();
+
+    //records the call
+    void finish();
+
+private:
+    Stage stage;
+    uint64_t items;
+    uint64_t bytes;
+    bool running;
+    chrono::steady_clock::time_point start;
+};
+
+/**
+    writes one measurement result line in the data.txt layout
+    @param out The stream to which the result is written
+    @param mat Name of material of thin film
+    @param index Index of refraction of thin film
+    @param thickness The calculated thin film thickness
+*/
+void writeMeasResult(ostream& out, const string& mat, double index, double thickness);
+
+/*
+    The format functions append one record to a caller's buffer with
+    std::to_chars, so a reused buffer formats without allocating. Their
+    output is byte for byte what the iostream layouts were: fixed notation,
+    right aligned numbers and left aligned names padded with blanks.
+*/
+
+/**
+    formats one measurement result line in the data.txt layout
+    @param out The string to which the line is appended
+    @param mat Name of material of thin film
+    @param index Index of refraction of thin film
+    @param thickness The calculated thin film thickness
+*/
+void formatMeasResult(string& out, const string& mat, double index, double thickness);
+
+/**
+    formats one result line in the print() layout
+    @param out The string to which the line is appended
+    @param mat Name of material of thin film
+    @param index Index of refraction of thin film
+    @param numberOfMaxima The number of maxima
+    @param thickness The calculated thin film thickness
+*/
+void formatFilmResult(string& out, const string& mat, double index, double numberOfMaxima,
+    double thickness);
+
+//formats the column headings of the print() layout
+void formatResultHeader(string& out);
+
+/**
+    formats one library line in the printLib() layout
+    @param out The string to which the line is appended
+    @param mat Name of material of thin film
+    @param index Index of refraction of thin film
+*/
+void formatLibraryEntry(string& out, const string& mat, double index);
+
+/**
+    formats one result as a CSV record with round-trip numbers:
+    material,index,spectralRange,numberOfMaxima,thickness
+    @param out The string to which the record is appended
+*/
+void formatCsvResult(string& out, const string& mat, double index, double spectralRange,
+    double numberOfMaxima, double thickness);
+
+//one saved measurement result as stored in data.txt
+struct Meas_record  {
+    //id of the material name in materialNames()
+    uint32_t mat;
+    double index;
+    double thickness;
+};
+
+/**
+    Mapped_file gives read-only access to the whole contents of a file.
+    The file is memory-mapped where the platform supports it and read
+    into memory otherwise. A mapped file that another process truncates
+    raises SIGBUS when the lost pages are read, so files that others
+    append to are read rather than mapped, and a file that shrinks while
+    it is mapped is read instead.
+*/
+class Mapped_file  {
+public:
+    Mapped_file();
+
+    //unmaps the file
+    ~Mapped_file();
+
+    /**
+        maps a file, replacing any file mapped before
+        @param fileName The name of the file
+        @param growing Whether other processes may append to the file or
+        truncate it, in which case it is read up to its size at the open
+        @return false if the file cannot be opened
+    */
+    bool open(const string& fileName, bool growing = false);
+
+    //unmaps the file
+    void close();
+
+    //returns the first byte of the file
+    const char* data() const;
+
+    //returns the size of the file in bytes
+    size_t size() const;
+
+private:
+    Mapped_file(const Mapped_file&);
+    Mapped_file& operator=(const Mapped_file&);
+
+    const char* begin;
+    size_t length;
+    bool mapped;
+    string buffer;
+};
+
+/**
+    File_lock holds an advisory flock() lock for its lifetime, so processes
+    on several stations can take turns writing a shared file. A file that
+    is appended to is locked through its own descriptor; a file that is
+    replaced by rename is locked through a lock file next to it, which
+    stays in place. Readers take no locks. Locks are held only around a
+    single update. Without POSIX the lock does nothing.
+*/
+class File_lock  {
+public:
+    /**
+        locks an open file, waiting for other holders
+        @param fd The descriptor of the file
+        @param exclusive Whether to take an exclusive or a shared lock
+    */
+    File_lock(int fd, bool exclusive = true);
+
+    /**
+        opens or creates a lock file and locks it, waiting for other holders
+        @param fileName The name of the lock file
+        @param exclusive Whether to take an exclusive or a shared lock
+    */
+    File_lock(const string& fileName, bool exclusive = true);
+
+    //releases the lock
+    ~File_lock();
+
+    //returns whether the lock is held
+    bool isLocked() const;
+
+private:
+    File_lock(const File_lock&);
+    File_lock& operator=(const File_lock&);
+
+    //takes the lock on fd
+    void lock(bool exclusive);
+
+    int fd;
+    bool owned;
+    bool locked;
+};
+
+/**
+    Film_index maps material names to positions in the film library so a
+    material is found in O(1) without listing the library. A name may carry
+    a variant tag after a colon, for example "SiO2:thermal"; the tagged name
+    is found as written and the plain name "SiO2" finds the first variant
+    unless an untagged SiO2 exists. When the index is built, exact
+    duplicates (same name and index) are merged out of the library and
+    names that appear with different indices are reported, since only the
+    first of them can be found by name.
+*/
+class Film_index  {
+public:
+    //creates an empty index
+    Film_index();
+
+    /**
+        builds the index, merging exact duplicates out of the library
+        @param materialList The list of films in the library
+        @param report Whether to report merged and conflicting duplicates
+        @return the number of duplicates merged
+    */
+    int build(vector<Thin_film>& materialList, bool report);
+
+    /**
+        indexes a film appended at the end of the library
+        @param materialList The list of films in the library
+    */
+    void addLast(const vector<Thin_film>& materialList);
+
+    /**
+        returns the library position of a material, or -1
+        @param name Material name, optionally with a variant tag
+    */
+    int find(const string& name) const;
+
+    /**
+        returns the position of a film with the same name and index, or -1
+        @param film The film to look for
+        @param materialList The list of films in the library
+    */
+    int findExact(const Thin_film& film, const vector<Thin_film>& materialList) const;
+
+    //returns the number of names in the index
+    size_t size() const;
+
+    /**
+        returns a page of the films whose names start with a prefix, ignoring
+        case, in name order. The first call sorts the library positions by
+        name into a view kept until the index changes, after which a page
+        costs two binary searches; it must not run concurrently with other
+        calls on the index
+        @param materialList The list of films in the library
+        @param prefix The start of the names, empty for every film
+        @param first The first match of the page
+        @param count The most matches the page holds
+        @param page Receives the library positions of the page
+        @return the number of matches
+    */
+    size_t findPrefix(const vector<Thin_film>& materialList, const string& prefix,
+        size_t first, size_t count, vector<int>& page) const;
+
+    /**
+        returns a page of the films whose names hold the characters of a
+        pattern in order, ignoring case, best match first: the fewer
+        characters skipped between the matched ones and the earlier the
+        match starts, the better. Only the matches up to the end of the page
+        are put in order
+        @param materialList The list of films in the library
+        @param pattern The characters to look for
+        @param first The first match of the page
+        @param count The most matches the page holds
+        @param page Receives the library positions of the page
+        @return the number of matches
+    */
+    size_t findFuzzy(const vector<Thin_film>& materialList, const string& pattern,
+        size_t first, size_t count, vector<int>& page) const;
+
+private:
+    //indexes the film at position pos
+    void insert(const vector<Thin_film>& materialList, int pos);
+
+    //points a name id at a position unless the name is taken
+    void claim(uint32_t id, int pos);
+
+    //library position by name id in materialNames(), -1 for none
+    vector<int> positions;
+    size_t names;
+    //every library position in name order ignoring case, built by findPrefix()
+    mutable vector<int> order;
+};
+
+/**
+    Film_journal records edits to the film library as one line each in an
+    append-only journal next to it (films.txt.journal), so an edit costs one
+    small append instead of rewriting films.txt. Records are
+        +<tab>name<tab>index    a film was added
+        -<tab>name<tab>index    a film was deleted
+    and a record cut short by a crash is ignored. Once the journal holds
+    enough records it is compacted in a background thread: films.txt and
+    the journal are read back from the disk, so edits of other stations are
+    kept, a new snapshot is written to a temporary file and renamed over
+    films.txt, and the journal is emptied. A journal left as
+    films.txt.journal.old by an earlier version is replayed and removed
+    the same way. Films are unique by name and index once merged, so
+    replaying a record the snapshot already contains changes nothing.
+
+    Several processes may share the library. Appends and compactions hold
+    an exclusive flock() on films.txt.lock for the one update only.
+    Readers take no lock; they use films.txt.version as a sequence lock. A
+    compaction makes the version odd before it touches a file and even
+    again once it is done, and a reader that saw an odd version, or a
+    different one after reading, reads again.
+*/
+class Film_journal  {
+public:
+    /**
+        @param fileName The name of the library the journal belongs to
+        @param compactRecords The journal size that triggers compaction
+    */
+    Film_journal(string fileName = "films.txt", size_t compactRecords = 1000);
+
+    //waits for a running compaction
+    ~Film_journal();
+
+    /**
+        appends a consistent snapshot of the library file and its journals
+        to a list, reading again while a compaction runs; a missing library
+        file is empty
+        @param materialList Receives the films after the ones it holds
+        @return the number of journal records applied
+    */
+    size_t load(vector<Thin_film>& materialList);
+
+    //returns the sequence lock version of the library, odd while it is compacted
+    uint64_t readVersion() const;
+
+    //returns whether the library file or one of its journals exists
+    bool exists() const;
+
+    //records that a film was added
+    void add(const Thin_film& film);
+
+    //records that a film was deleted
+    void remove(const Thin_film& film);
+
+    //records that a film was replaced by another one
+    void update(const Thin_film& oldFilm, const Thin_film& newFilm);
+
+    //starts a background compaction once the journal is large enough
+    void compactIfNeeded();
+
+    //starts a background compaction now
+    void compact();
+
+    //waits for a running compaction to finish
+    void wait();
+
+private:
+    Film_journal(const Film_journal&);
+    Film_journal& operator=(const Film_journal&);
+
+    //appends records to the journal in one write
+    void append(const string& records);
+
+    //applies the records of one journal file
+    size_t replayFile(const string& journalName, vector<Thin_film>& materialList);
+
+    /**
+        appends the library file and its journals as they are on the disk
+        @param materialList Receives the films
+        @param live Receives the number of records in the live journal
+        @return the number of journal records applied
+    */
+    size_t readLibrary(vector<Thin_film>& materialList, size_t& live);
+
+    //rewrites the library file from the disk under the lock
+    void compactLibrary();
+
+    //replaces the version file
+    bool writeVersion(uint64_t version);
+
+    string fileName;
+    string journalName;
+    string lockName;
+    string versionName;
+    size_t compactRecords;
+    size_t records;
+    thread compactor;
+};
+
+//a film of the built-in catalog
+struct Catalog_film  {
+    const char* mat;
+    //index of refraction at 632.8nm
+    double index;
+};
+
+//standard materials compiled into the program, usable without films.txt
+constexpr Catalog_film BUILTIN_FILMS[] = {
+    { "SiO2", 1.457 },
+    { "Si3N4", 2.022 },
+    { "TiO2", 2.4 },
+    { "LiNbO3", 2.286 },
+    { "Al2O3", 1.766 },
+    { "HfO2", 1.9 },
+    { "Ta2O5", 2.1 },
+    { "ZrO2", 2.15 },
+    { "Y2O3", 1.93 },
+    { "ZnO", 1.99 },
+    { "MgF2", 1.378 },
+    { "ITO", 1.85 },
+    { "Polyimide", 1.7 },
+};
+
+const size_t BUILTIN_FILM_COUNT = sizeof(BUILTIN_FILMS) / sizeof(BUILTIN_FILMS[0]);
+
+/**
+    Loads the film data from the specified file name and returns
+    the data in a vector of Thin Film objects
+    @param list The vector of Thin Film objects
+    @param fileName The name of the file from which to read
+*/
+void loadData(vector<Thin_film>& materialList, string fileName);
+
+/**
+    Film_library is the film library of a run. It starts out as the
+    built-in catalog, which needs no file I/O, and films.txt with its
+    journal is laid over it the first time a film is looked up if either
+    exists, or when the whole library is needed. A films.txt entry named
+    like a catalog film replaces it, and films.txt may add variants of
+    catalog films such as SiO2:thermal. Until load() has run, a library
+    must not be shared between threads.
+*/
+class Film_library  {
+public:
+    /**
+        sets up the catalog
+        @param fileName The library file laid over the catalog, empty for
+        the catalog alone
+        @param grid The instrument wavelength grid of the dispersion tables
+    */
+    Film_library(string fileName, const Wavelength_grid& grid);
+
+    /**
+        loads the library file and its journal unless they are loaded; a
+        missing file is empty. Catalog films named by the library file are
+        replaced by its entries
+    */
+    void load();
+
+    //returns whether the library file has been loaded
+    bool isLoaded() const;
+
+    /**
+        returns the position of a material, loading the library file first
+        since it may replace a catalog film
+        @param name Material name, optionally with a variant tag
+        @return the position, or -1 if neither holds it
+    */
+    int find(const string& name);
+
+    //returns whether the film at a position is a catalog film
+    bool isBuiltin(int pos) const;
+
+    //returns the number of catalog films, which come first
+    size_t getBuiltinCount() const;
+
+    //returns the films, catalog first
+    vector<Thin_film>& getFilms();
+    const vector<Thin_film>& getFilms() const;
+
+    //returns the name index of the films
+    Film_index& getIndex();
+    const Film_index& getIndex() const;
+
+    //returns the dispersion tables of the films
+    const Dispersion_tables& getTables() const;
+
+    //builds the dispersion tables again after films were added or deleted
+    void updateTables();
+
+    //returns the journal of library edits
+    Film_journal& getJournal();
+
+private:
+    string fileName;
+    Wavelength_grid grid;
+    vector<Thin_film> films;
+    Film_index index;
+    Dispersion_tables tables;
+    Film_journal journal;
+    //catalog films at the front of films
+    size_t builtins;
+    bool loaded;
+};
+
+//number of latest results kept per material for the trend
+const int RECENT_RESULTS = 16;
+
+/**
+    Thickness_stats holds running aggregates of the thicknesses of one
+    material: Welford's mean and sum of squared deviations, the extremes
+    and the latest results, each updated in O(1) per result
+*/
+struct Thickness_stats  {
+    uint64_t count;
+    double mean;
+    //sum of squared deviations from the mean
+    double m2;
+    double min;
+    double max;
+    //the latest results, oldest first
+    int recentCount;
+    double recent[RECENT_RESULTS];
+
+    Thickness_stats();
+
+    //adds one result
+    void add(double thickness);
+
+    //returns the sample standard deviation
+    double getStddev() const;
+
+    //returns the least squares slope of the latest results in nm per result
+    double getTrend() const;
+};
+
+/**
+    Stats_index keeps per-material Thickness_stats for a results file such
+    as data.txt in a sidecar file, data.txt.stats, together with the size of
+    the results file it covers and a fingerprint of the line just before
+    that point. Results appended since are parsed from the covered offset
+    only; a results file that shrank or whose fingerprint changed was
+    rewritten and is read again from the start. The sidecar is small text
+    made of blocks, each the materials that changed followed by the offset
+    they are complete up to:
+        TFSTATS 2
+        <material> TAB count mean m2 min max recentCount recent...
+        covered <bytes> <fingerprint>
+    A save appends one block, and the sidecar is rewritten as a single
+    block once it holds twice as many lines as materials. A block cut short
+    by a crash is ignored. Saves are made under the lock of the results
+    file and only by an index that covers all of it, so the offsets of the
+    blocks only grow and every block completes the ones before it.
+*/
+class Stats_index  {
+public:
+    /**
+        loads the sidecar of a results file, if there is one
+        @param dataName The name of the results file
+    */
+    explicit Stats_index(const string& dataName = "data.txt");
+
+    /**
+        catches up with results appended to the results file
+        @return false if the results file cannot be read
+    */
+    bool refresh();
+
+    /**
+        adds result lines in the data.txt layout that were appended to the
+        results file at the covered offset, without reading the file
+        @param begin The first character of the appended text
+        @param end One past the last character
+    */
+    void addLines(const char* begin, const char* end);
+
+    /**
+        appends the materials changed since the last save to the sidecar,
+        or rewrites it atomically when it is due for compaction. The lock
+        of the results file must be held
+        @return false if it cannot be written or the index does not cover
+        the whole results file
+    */
+    bool save();
+
+    //returns the size of the results file covered
+    uint64_t getCovered() const;
+
+    //returns the statistics of a material, or null if it has no results
+    const Thickness_stats* find(const string& mat) const;
+
+    //forgets every result, as for a results file that is read from its start again
+    void clear();
+
+private:
+    //returns the fingerprint of the bytes before an offset of a file
+    static uint64_t fingerprint(const char* data, uint64_t offset);
+
+    //appends the sidecar line of a material
+    static void formatMaterial(string& text, const string& mat, const Thickness_stats& stats);
+
+    //reads the blocks of the sidecar; false if it is damaged
+    bool load(const char* p, const char* end);
+
+    string dataName;
+    string indexName;
+    uint64_t covered;
+    uint64_t coveredPrint;
+    unordered_map<string, Thickness_stats> materials;
+    //materials that changed since the last save
+    unordered_set<string> changed;
+    //lines in the sidecar as far as this index knows
+    size_t sidecarLines;
+    //whether the next save rewrites the sidecar
+    bool rewrite;
+};
+
+//the longest a Result_follower waits before looking at its file again
+const int FOLLOW_POLL_MILLIS = 200;
+
+//bytes a Result_follower reads at a time
+const size_t FOLLOW_CHUNK = 1 << 16;
+
+/**
+    Result_follower tails a results file such as data.txt while stations
+    append to it. It remembers the byte offset it has read up to and the
+    line just before it, and poll() reads only the bytes appended since,
+    handing complete lines to its subscribers; a line still being written
+    is handed out by a later poll. wait() sleeps until the file's
+    directory reports a change through inotify, or for a poll interval
+    where there is none. A file that was rotated (renamed away and created
+    anew), truncated or rewritten, so that the line before the offset is no
+    longer in place, is followed from its start after telling the
+    subscribers to reset; a replacement that holds the same bytes up to
+    the offset, such as an atomic rewrite, is followed on from the offset.
+    The rest of a rotated file is read before switching to the new one.
+*/
+class Result_follower  {
+public:
+    //receives complete lines in the data.txt layout, appended at the offset
+    typedef function<void(const char* begin, const char* end)> Line_subscriber;
+
+    //told that the file is read again from its start
+    typedef function<void()> Reset_subscriber;
+
+    /**
+        opens a results file, which need not exist yet
+        @param fileName The name of the results file
+        @param offset The offset the subscribers have read up to, at a line
+        boundary; an offset the file no longer fits resets them
+    */
+    Result_follower(const string& fileName, uint64_t offset = 0);
+
+    //closes the file and the change notifications
+    ~Result_follower();
+
+    /**
+        adds a subscriber
+        @param lines Receives the appended lines
+        @param reset Told when the file is read from its start again, or empty
+    */
+    void subscribe(const Line_subscriber& lines, const Reset_subscriber& reset = Reset_subscriber());
+
+    /**
+        hands the lines appended since the last poll to the subscribers
+        @return the number of bytes handed out
+    */
+    uint64_t poll();
+
+    /**
+        waits until the file may have changed
+        @param timeoutMillis The longest wait
+    */
+    void wait(int timeoutMillis);
+
+    //returns the offset read up to
+    uint64_t getOffset() const;
+
+    //returns how often the file was found rotated, truncated or rewritten
+    uint64_t getResets() const;
+
+private:
+    //opens the file at the path and records its identity; false if there is none
+    bool openFile();
+
+    //returns whether the open file still holds the last line read before the offset
+    bool holdsLast() const;
+
+    //starts again at the beginning of the open file and resets the subscribers
+    void reset();
+
+    //reads the open file from the offset to its end, all complete lines
+    uint64_t drain();
+
+    string fileName;
+    int fd;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;
+    //the end of the line before the offset, at most FOLLOW_CHUNK bytes
+    string last;
+    vector<char> buffer;
+    vector<Line_subscriber> lineSubscribers;
+    vector<Reset_subscriber> resetSubscribers;
+    //the inotify descriptor, or -1 to poll
+    int notify;
+    uint64_t resets;
+};
+
+//separates a material name from its variant tag
+const char VARIANT_SEPARATOR = ':';
+
+//how far a Result_sink goes to make committed results durable
+enum Durability { DURABILITY_NONE = 0, DURABILITY_FSYNC = 1 };
+
+//when a Result_sink writes its buffer to the file
+struct Sink_policy  {
+    //flush once this many bytes are buffered, 0 flushes every record
+    size_t flushBytes;
+    //flush buffered records at least this often, 0 disables the timer
+    int flushMillis;
+    //whether every flush is also synced to the disk
+    Durability durability;
+
+    Sink_policy();
+};
+
+/**
+    Result_sink keeps a results file such as data.txt open and buffers
+    measurement records in the data.txt layout. The buffer is written
+    when it reaches the policy's size, when a background timer finds
+    records older than the flush interval, on commit() and when the sink
+    is destroyed. With DURABILITY_FSYNC every flush is synced to the disk.
+    The per-material statistics sidecar is kept for data.txt only.
+    Records may be written from several threads.
+*/
+class Result_sink  {
+public:
+    /**
+        opens the results file for appending
+        @param fileName The name of the results file
+        @param policy When the buffered records are written
+    */
+    Result_sink(string fileName, const Sink_policy& policy = Sink_policy());
+
+    //commits the buffered records and closes the file
+    ~Result_sink();
+
+    //returns false if the file could not be opened
+    bool isOpen() const;
+
+    /**
+        buffers one measurement result
+        @param mat Name of material of thin film
+        @param index Index of refraction of thin film
+        @param thickness The calculated thin film thickness
+    */
+    void write(const string& mat, double index, double thickness);
+
+    //buffers the result of a film
+    void write(const Thin_film& film);
+
+    /**
+        writes all buffered records to the file
+        @return false if the file could not be written
+    */
+    bool commit();
+
+    //returns the number of bytes written to the file so far
+    size_t getBytesWritten() const;
+
+private:
+    Result_sink(const Result_sink&);
+    Result_sink& operator=(const Result_sink&);
+
+    //writes the buffer, the lock must be held
+    bool flush();
+
+    //background timer that flushes records left in the buffer
+    void flushLoop();
+
+    string fileName;
+    Sink_policy policy;
+    FILE* file;
+    string buffer;
+    size_t bytesWritten;
+    //records in the buffer
+    size_t pendingRecords;
+    //per-material statistics of the results file
+    Stats_index stats;
+    //whether the statistics are kept, which they are for data.txt
+    bool indexed;
+    bool failed;
+    mutable mutex lock;
+    condition_variable wake;
+    thread flusher;
+    bool stopping;
+};
+
+/**
+    Columnar_history gives zero-copy access to a binary columnar store of
+    measurement history. The file, in host byte order, is
+        header     "TFCM", uint32 version (1), then uint64 row count,
+                   dictionary count and the byte offsets of the
+                   dictionary, material, index, thickness and timestamp
+                   columns (64 bytes)
+        dictionary uint32 offsets[count + 1] into the name bytes that
+                   follow them
+        material   uint32 dictionary id per row
+        index      float64 per row
+        thickness  float64 per row
+        timestamp  int64 seconds since the epoch per row, 0 if unknown
+    Every column starts on an 8-byte boundary, so the mapped file is
+    scanned in place.
+*/
+class Columnar_history  {
+public:
+    /**
+        maps a columnar history file
+        @param fileName The name of the file
+        @return false if the file is missing or not a valid store
+    */
+    bool open(const string& fileName);
+
+    //returns the number of rows
+    size_t size() const;
+
+    //returns the number of distinct materials
+    size_t getMaterialCount() const;
+
+    //returns the name of a material id
+    string getMaterial(uint32_t id) const;
+
+    /**
+        returns the id of a material name
+        @return false if the material does not occur
+    */
+    bool findMaterial(const string& mat, uint32_t& id) const;
+
+    //column pointers, each holding size() values
+    const uint32_t* getMaterials() const;
+    const double* getIndices() const;
+    const double* getThicknesses() const;
+    const int64_t* getTimestamps() const;
+
+private:
+    Mapped_file file;
+    uint64_t rows;
+    uint64_t materialCount;
+    const uint32_t* dictionary;
+    const char* names;
+    const uint32_t* materials;
+    const double* indices;
+    const double* thicknesses;
+    const int64_t* timestamps;
+};
+
+/**
+    writes measurement history to a columnar history file
+    @param results The measurements in time order
+    @param timestamps Seconds since the epoch per measurement; empty if unknown
+    @param fileName The name of the file
+    @return false if the file cannot be written
+*/
+bool writeColumnarHistory(const vector<Meas_record>& results, const vector<int64_t>& timestamps,
+    string fileName);
+
+/**
+    writes a number in the shortest form that reads back to the same value
+    @param out The string to which the number is appended
+*/
+void appendShortest(string& out, double value);
+
+/**
+    writes a number with a fixed number of decimals, right aligned in a
+    field, as setw(width) << fixed << setprecision(precision) would
+    @param out The string to which the number is appended
+    @param value The number
+    @param width The minimum field width
+    @param precision The number of decimals
+*/
+void appendFixed(string& out, double value, int width, int precision);
+
+/**
+    writes text padded with blanks to a field width, as setw(width) would
+    @param out The string to which the text is appended
+    @param text The text
+    @param width The minimum field width
+    @param alignLeft Whether the text is left aligned
+*/
+void appendPadded(string& out, const string& text, int width, bool alignLeft);
+
+/**
+    appends data to a file in one write and optionally waits until it
+    reached the disk
+    @param fileName The name of the file
+    @param data The bytes to append
+    @param sync Whether to flush the data to the disk
+    @return false if the file cannot be written
+*/
+bool appendToFile(const string& fileName, const string& data, bool sync);
+
+/**
+    replaces a file atomically: the data is written to a temporary file
+    which is flushed to the disk and renamed over the target, so readers
+    and a crash only ever see the old or the new contents. The temporary
+    file name is unique to the process, so writers on several stations do
+    not write into each other's temporary files.
+    @param fileName The name of the file
+    @param data The new contents
+    @param sync Whether to flush the data to the disk before the rename,
+    which a cache that is rebuilt when damaged can skip
+    @return false if the file cannot be written
+*/
+bool replaceFile(const string& fileName, const string& data, bool sync = true);
+
+/**
+    parses a number filling the whole of [begin, end) with std::from_chars
+    @param value Receives the number
+    @return false if the text is not exactly one number
+*/
+bool parseNumber(const char* begin, const char* end, double& value);
+
+/**
+    parses one data.txt line: the material name followed by the index and
+    the thickness; the name may contain blanks
+    @param begin The first character of the line
+    @param end One past the last character of the line, without the newline
+    @param record Receives the measurement
+    @return false if the line is malformed
+*/
+bool parseMeasRecord(const char* begin, const char* end, Meas_record& record);
+
+/**
+    Spectrum holds one reflectance spectrum as separate wavelength (nm)
+    and intensity arrays sorted by increasing wavelength
+*/
+struct Spectrum  {
+    vector<double> wavelength;
+    vector<double> intensity;
+
+    //returns the spectral range covered by the samples in nm
+    double getspectralRange() const;
+};
+
+/**
+    Loads a spectrum from a file. Text files hold two columns,
+    wavelength and intensity, separated by blanks, tabs or a comma; lines
+    that do not start with a number are skipped. Binary files start with
+    the magic "TFSP", followed by a uint32 version (1), a uint32 sample
+    count n, n float32 wavelengths and n float32 intensities, all in host
+    byte order.
+    @param spectrum Receives the samples
+    @param fileName The name of the spectrum file
+    @return false if the file cannot be read or holds fewer than 3 samples
+*/
+bool loadSpectrum(Spectrum& spectrum, string fileName);
+
+/**
+    Fringe_counter derives the number of maxima of a reflectance spectrum.
+    The intensity is smoothed with a box filter computed from prefix sums,
+    then maxima are detected with hysteresis: a maximum only counts once
+    the signal has risen by the prominence above the preceding minimum and
+    fallen by it again, so noise ripples are ignored. The scratch arrays
+    are kept between calls, so counting spectra of the same size does not
+    allocate.
+*/
+class Fringe_counter  {
+public:
+    /**
+        @param smoothing Width of the box filter in samples, 0 picks one
+        from the spectrum size
+        @param prominence Minimum rise and fall of a maximum as a fraction
+        of the smoothed intensity span
+    */
+    Fringe_counter(int smoothing = 0, double prominence = 0.1);
+
+    /**
+        counts the maxima of a spectrum
+        @param intensity The intensity samples
+        @param n The number of samples
+    */
+    int countMaxima(const double* intensity, size_t n);
+
+    //counts the maxima of a spectrum
+    int countMaxima(const Spectrum& spectrum);
+
+    //returns the smoothed intensity of the last spectrum counted
+    const vector<double>& getSmoothed() const;
+
+private:
+    int smoothing;
+    double prominence;
+    vector<double> prefix;
+    vector<double> smoothed;
+};
+
+/**
+    Fft_plan holds the twiddle factors and the bit reversal permutation of
+    an in-place radix-2 complex FFT of one size
+*/
+class Fft_plan  {
+public:
+    //@param size The transform size, a power of two
+    explicit Fft_plan(size_t size);
+
+    //returns the transform size
+    size_t size() const;
+
+    //replaces data with its forward transform
+    void transform(complex<double>* data) const;
+
+private:
+    vector<complex<double> > twiddles;
+    vector<uint32_t> reversed;
+};
+
+/**
+    Fft_setup holds what the FFT thickness estimate derives from the
+    wavelength axis alone: a uniform wavenumber grid with as many points as
+    the spectrum rounded up to a power of two, the linear interpolation
+    weights that resample the spectrum onto it, a Hann window and the plan
+    of the transform, zero padded by FFT_PADDING.
+*/
+struct Fft_setup  {
+    explicit Fft_setup(const vector<double>& wavelength);
+
+    //the wavelength axis the setup was built for
+    vector<double> wavelength;
+    //lower spectrum sample of each grid point and the weight of the upper one
+    vector<uint32_t> source;
+    vector<double> weight;
+    vector<double> window;
+    //wavenumber of the first grid point and spacing, in 1/nm
+    double first;
+    double step;
+    Fft_plan plan;
+};
+
+//zero padding factor of the FFT, it narrows the bins the peak falls between
+const size_t FFT_PADDING = 2;
+
+//number of most recently used wavelength axes whose setups are kept
+const size_t FFT_SETUP_CACHE = 8;
+
+/**
+    returns the setup for a wavelength axis; setups are cached per axis, so
+    repeated spectra from one instrument share the setup. Safe to call from
+    any thread.
+    @param wavelength The ascending wavelength axis in nm
+    @return the setup, or null if the axis has fewer than 8 samples
+*/
+shared_ptr<const Fft_setup> fftSetup(const vector<double>& wavelength);
+
+/**
+    Fft_estimator reads the thickness of a film from the fringe frequency of
+    its spectrum. The reflectance of a film of optical thickness n d
+    oscillates in wavenumber 1/l with frequency 2 n d, so the spectrum is
+    resampled onto a uniform wavenumber grid, windowed and transformed, and
+    the strongest peak is located between bins by Gaussian interpolation
+    of the log magnitudes. The setup of the last axis and the scratch
+    arrays are kept between calls.
+*/
+class Fft_estimator  {
+public:
+    Fft_estimator();
+
+    /**
+        estimates the thickness of a film
+        @param spectrum The measured spectrum
+        @param film The film, whose mean index over the spectrum converts
+        optical thickness to thickness
+        @param tables Precomputed dispersion tables, or null
+        @param pos The library position of the film in the tables, or -1
+        @return the thickness in nm, or 0 if the spectrum holds less than
+        about two fringes
+    */
+    double estimate(const Spectrum& spectrum, const Thin_film& film,
+        const Dispersion_tables* tables = 0, int pos = -1);
+
+    //returns the optical thickness n d in nm of the last spectrum
+    double getOpticalThickness() const;
+
+private:
+    shared_ptr<const Fft_setup> setup;
+    vector<complex<double> > buffer;
+    double opticalThickness;
+};
+
+/**
+    Counter_rng is the Philox4x32-10 counter-based random number generator.
+    Each 128 bit counter is encrypted with the seed as the key into four
+    32 bit words, so any sample can be drawn without the ones before it and
+    a number never depends on the thread that draws it. Counters are
+    generated eight at a time with AVX2 when the CPU supports it.
+*/
+class Counter_rng  {
+public:
+    //sets the key
+    Counter_rng(uint64_t seed);
+
+    /**
+        generates the words of the counters (first + i, stream) for i in [0, n)
+        @param first The first counter
+        @param stream Selects an independent sequence of counters
+        @param n The number of counters
+        @param words Receives 4 n words, word j of counter i at words[j * n + i]
+    */
+    void generate(uint64_t first, uint64_t stream, size_t n, uint32_t* words) const;
+
+    //maps a word to a uniform number in (0, 1)
+    static double uniform(uint32_t word);
+
+    //maps two words to a standard normal number with the Box-Muller transform
+    static double normal(uint32_t a, uint32_t b);
+
+private:
+    uint32_t key[2];
+};
+
+//shape of the distribution of an uncertain input
+enum Input_shape { INPUT_FIXED, INPUT_NORMAL, INPUT_UNIFORM };
+
+/**
+    Input_distribution is the distribution of one input of the thickness
+    model. An argument is written value for a fixed input, value+-sigma for
+    a normal distribution or value~halfwidth for a uniform one.
+*/
+struct Input_distribution  {
+    double value;
+    //the standard deviation or half width
+    double spread;
+    Input_shape shape;
+
+    Input_distribution();
+
+    /**
+        splits the spread off an argument
+        @param text The argument
+        @param head Receives the argument without its spread
+        @return false if the spread is not a non-negative number
+    */
+    bool parse(const string& text, string& head);
+
+    //draws a sample from two random words
+    double sample(uint32_t a, uint32_t b) const;
+
+    //formats the input as it is written on the command line
+    string format() const;
+};
+
+//outcome of fitting a reflectance model to a spectrum
+struct Fit_result  {
+    //fitted film thickness in nm
+    double thickness;
+    //intensity = scale * reflectance + offset
+    double scale;
+    double offset;
+    //root mean square difference between model and spectrum
+    double residual;
+    //number of Levenberg-Marquardt iterations
+    int iterations;
+    //whether the iterations converged before the limit
+    bool converged;
+};
+
+/**
+    returns the optical constants of the silicon substrate, tabulated from
+    400nm to 1200nm and held constant outside that range
+*/
+shared_ptr<const Dispersion> siliconDispersion();
+
+/**
+    Reflectance_fit fits the thickness of one film on a silicon substrate
+    to a measured spectrum. The model is the transfer-matrix (Airy) result
+    for a single layer at normal incidence
+        r = (r01 + r12 E) / (1 + r01 r12 E),  E = exp(i 4 pi N1 d / l)
+    with complex indices N = n + ik for air, film and substrate, and the
+    spectrum is modelled as scale * |r|^2 + offset, so it may be relative
+    reflectance in any unit. prepare() computes everything that does not
+    depend on the thickness once per spectrum and stores it as separate
+    arrays per wavelength, so the model, its analytic derivative with
+    respect to the thickness and the sums of the normal equations are plain
+    loops over contiguous arrays.
+
+    fit() first scans thicknesses around the starting estimate on a
+    subsample of the wavelengths, solving scale and offset in closed form,
+    to land in the basin of the global minimum, then refines thickness,
+    scale and offset with Levenberg-Marquardt on all wavelengths.
+*/
+class Reflectance_fit  {
+public:
+    /**
+        prepares the per-wavelength terms for a film and a spectrum
+        @param spectrum The measured spectrum
+        @param film The film, with its index or dispersion model
+        @param tables Precomputed dispersion tables, or null
+        @param pos The library position of the film in the tables, or -1
+    */
+    void prepare(const Spectrum& spectrum, const Thin_film& film,
+        const Dispersion_tables* tables = 0, int pos = -1);
+
+    /**
+        prepares the per-wavelength terms from samples held in place
+        @param wavelength The ascending wavelengths in nm
+        @param intensity The measured intensities
+        @param n The number of samples
+        @param film The film, with its index or dispersion model
+        @param tables Precomputed dispersion tables, or null
+        @param pos The library position of the film in the tables, or -1
+    */
+    void prepare(const double* wavelength, const double* intensity, size_t n,
+        const Thin_film& film, const Dispersion_tables* tables = 0, int pos = -1);
+
+    /**
+        fits the thickness
+        @param estimate Starting thickness in nm, for example getThickness()
+        @return the fitted thickness, scale, offset and residual
+    */
+    Fit_result fit(double estimate);
+
+    /**
+        scans the basin around an estimate on a subsample of the wavelengths,
+        one quarter fringe at a time
+        @param estimate Starting thickness in nm
+        @param cost Receives the mean squared residual at the best thickness
+        @return the best thickness of the scan
+    */
+    double scan(double estimate, double& cost);
+
+    /**
+        refines thickness, scale and offset with Levenberg-Marquardt
+        @param start Starting thickness in nm, for example from scan()
+        @return the fitted thickness, scale, offset and residual
+    */
+    Fit_result refine(double start);
+
+    /**
+        calculates the reflectance |r|^2 of the prepared film at a thickness,
+        and optionally its derivative with respect to the thickness
+        @param thickness Film thickness in nm
+        @param stride Use every stride-th wavelength only
+        @param derivative Receives dR/dd, or null
+        @return the reflectance array
+    */
+    const double* reflectance(double thickness, size_t stride = 1, double* derivative = 0);
+
+    //returns the number of prepared wavelengths
+    size_t size() const;
+
+private:
+    vector<double> intensity;
+    //r01, r12 and beta = 4 pi N1 / l, split into real and imaginary parts
+    vector<double> ar;
+    vector<double> ai;
+    vector<double> br;
+    vector<double> bi;
+    vector<double> betaR;
+    vector<double> betaI;
+    vector<double> model;
+    vector<double> slope;
+    //thickness of a quarter fringe at the shortest wavelength
+    double fringeStep;
+};
+
+/**
+    solves the intensity scale and offset of a model in closed form
+    @param intensity The measured intensities
+    @param model The model reflectance
+    @param count The number of samples
+    @param stride Use every stride-th sample only
+    @param scale Receives the scale
+    @param offset Receives the offset
+    @return the mean squared residual
+*/
+double linearResidual(const double* intensity, const double* model, size_t count,
+    size_t stride, double& scale, double& offset);
+
+/**
+    solves a x = b in place by Gaussian elimination with partial pivoting
+    @param a The n by n matrix, row major, destroyed
+    @param b The right hand side, receives x
+    @param n The number of unknowns
+    @return false if the matrix is singular
+*/
+bool solveLinear(vector<double>& a, vector<double>& b, size_t n);
+
+//identifies a fit by the spectrum it was fitted to and the model it was fitted with
+struct Fit_key  {
+    //two independent hashes of the wavelengths and intensities
+    uint64_t spectrum;
+    uint64_t check;
+    //hash of the material, its index or dispersion model, the dispersion
+    //table grid, the spectral range and the getThickness() estimate that
+    //starts the fit
+    uint64_t model;
+
+    bool operator==(const Fit_key& other) const;
+};
+
+//entries the fit cache holds in memory unless --cache-size= says otherwise
+const size_t FIT_CACHE_ENTRIES = 4096;
+
+//entries of the disk tier the fit cache indexes in memory and keeps on compacting
+const size_t FIT_CACHE_DISK_ENTRIES = 65536;
+
+//version of Reflectance_fit results; a change to the fitter must bump it
+const int FITTER_VERSION = 1;
+
+/**
+    Fit_cache remembers the results of Reflectance_fit by Fit_key, so a
+    reference spectrum that is measured again is not fitted again. Memory
+    holds the most recently used entries in a preallocated Fit_table, so
+    lookups and insertions do not allocate once the cache is in use; only
+    the append of a new result to the disk tier, after a fit, does. The
+    optional disk tier appends every new result to a file,
+        TFFITCACHE <format> <FITTER_VERSION>
+        <spectrum> <check> <model> <thickness> <scale> <offset> <residual> <iterations> <converged>
+    with the keys in hex and a line per result, locked with File_lock so
+    processes can share it. A file of another format or fitter version is
+    discarded. It is read once, at the first lookup, into a second
+    Fit_table of FIT_CACHE_DISK_ENTRIES, and rewritten with the entries of
+    that table when it holds more than twice as many lines. The cache is
+    shared by all threads behind a mutex, which is held for a lookup, not
+    a fit or an append to the file.
+*/
+class Fit_cache  {
+public:
+    /**
+        creates an empty cache
+        @param capacity The number of entries held in memory, 0 for none
+    */
+    explicit Fit_cache(size_t capacity = FIT_CACHE_ENTRIES);
+
+    /**
+        changes the number of entries held in memory, dropping all of them
+        @param capacity The number of entries, 0 to disable the memory tier
+    */
+    void setCapacity(size_t capacity);
+
+    /**
+        adds the disk tier
+        @param fileName The cache file, created on the first store
+    */
+    void setFile(const string& fileName);
+
+    /**
+        builds the key of a fit without allocating
+        @param wavelength The wavelengths of the spectrum in nm
+        @param intensity The intensities of the spectrum
+        @param n The number of samples
+        @param film The film, with its spectral range and number of maxima set
+        @param tables Precomputed dispersion tables, or null
+        @param pos The library position of the film in the tables, or -1
+    */
+    static Fit_key makeKey(const double* wavelength, const double* intensity, size_t n,
+        const Thin_film& film, const Dispersion_tables* tables, int pos);
+
+    /**
+        looks a fit up in memory, then on disk
+        @param key The key of the fit
+        @param result Receives the cached result
+        @return false on a miss
+    */
+    bool find(const Fit_key& key, Fit_result& result);
+
+    /**
+        adds a fit to memory, evicting the least recently used entry, and
+        to the disk tier
+        @param key The key of the fit
+        @param result The fitted result
+    */
+    void store(const Fit_key& key, const Fit_result& result);
+
+private:
+    struct Key_hash  {
+        size_t operator()(const Fit_key& key) const;
+    };
+
+    /**
+        Fit_table holds up to a fixed number of fits in a preallocated
+        table, a doubly linked LRU list threaded through it and an open
+        addressing index
+    */
+    class Fit_table  {
+    public:
+        //creates an empty table that holds nothing
+        Fit_table();
+
+        //drops every entry and changes the number of entries held
+        void setCapacity(size_t capacity);
+
+        //returns the number of entries held
+        size_t size() const;
+
+        /**
+            looks a fit up, making it the most recently used
+            @return false if the table does not hold it
+        */
+        bool find(const Fit_key& key, Fit_result& result);
+
+        /**
+            adds or refreshes a fit as the most recently used
+            @return whether the least recently used entry was evicted
+        */
+        bool insert(const Fit_key& key, const Fit_result& result);
+
+        //calls visit(key, result) for every entry, least recently used first
+        template <class Visitor>
+        void visit(Visitor visitor) const;
+
+    private:
+        struct Entry  {
+            Fit_key key;
+            Fit_result result;
+            //neighbours in the LRU list, NONE at its ends
+            uint32_t newer;
+            uint32_t older;
+        };
+
+        static const uint32_t NONE = 0xFFFFFFFFu;
+
+        //returns the index slot holding a key, or the empty slot ending its probe
+        size_t probe(const Fit_key& key) const;
+
+        //removes an entry from the index, shifting back the entries probed past it
+        void unindex(uint32_t entry);
+
+        //unlinks an entry from the LRU list
+        void unlink(uint32_t entry);
+
+        //links an entry at the newest end of the LRU list
+        void pushNewest(uint32_t entry);
+
+        size_t capacity;
+        vector<Entry> entries;
+        //entry + 1 per slot, 0 for an empty slot
+        vector<uint32_t> slots;
+        size_t used;
+        uint32_t newest;
+        uint32_t oldest;
+    };
+
+    /**
+        reads the disk tier, and rewrites it if it is of another version or
+        due for compaction; the mutex is held
+    */
+    void loadFile();
+
+    /**
+        reads the contents of the disk tier into the disk table
+        @return the number of result lines, or -1 if the header does not match
+    */
+    long parseFile(const string& contents);
+
+    //formats a disk tier line
+    static void formatLine(string& line, const Fit_key& key, const Fit_result& result);
+
+    //returns the header line of the disk tier
+    static string formatHeader();
+
+    mutex lock;
+    Fit_table memory;
+    string fileName;
+    bool fileLoaded;
+    Fit_table disk;
+};
+
+//returns the process-wide fit cache
+Fit_cache& fitCache();
+
+/**
+    fits a film to a spectrum through fitCache(), preparing and running the
+    fitter on a miss only
+    @param fitter The fitter, whose prepared state is undefined afterwards
+    @param spectrum The measured spectrum
+    @param film The film, with its spectral range and number of maxima set
+    @param tables Precomputed dispersion tables, or null
+    @param pos The library position of the film in the tables, or -1
+    @return the fit of fitter.fit(film.getThickness())
+*/
+Fit_result cachedFit(Reflectance_fit& fitter, const Spectrum& spectrum, const Thin_film& film,
+    const Dispersion_tables* tables, int pos);
+
+/**
+    fits a film to samples held in place through fitCache()
+    @param fitter The fitter, whose prepared state is undefined afterwards
+    @param wavelength The ascending wavelengths in nm
+    @param intensity The measured intensities
+    @param n The number of samples
+    @param film The film, with its spectral range and number of maxima set
+    @param tables Precomputed dispersion tables, or null
+    @param pos The library position of the film in the tables, or -1
+    @return the fit of fitter.fit(film.getThickness())
+*/
+Fit_result cachedFit(Reflectance_fit& fitter, const double* wavelength, const double* intensity,
+    size_t n, const Thin_film& film, const Dispersion_tables* tables, int pos);
+
+/**
+    Film_stack models a stack of films on a silicon substrate at normal
+    incidence with the characteristic matrix method. Layer 0 faces the air
+    and each layer has the matrix
+        M = [cos D, -i sin D / N; -i N sin D, cos D],  D = 2 pi N d / l
+    with N = n + ik. The stack reflects r = (B - C) / (B + C), where
+    [B; C] = M0 M1 ... [1; Ns].
+
+    The matrices of every layer are kept per wavelength, together with the
+    product of the layers above each layer (its prefix) and the substrate
+    vector carried through the layers below it (its suffix).
+    setThickness() recomputes the matrices of the changed layer only and
+    invalidates the products on either side of it, so a fit that varies one
+    layer at a time evaluates the stack as prefix * layer * suffix without
+    touching the other layers. The same products give the analytic
+    derivative of the reflectance with respect to every thickness.
+*/
+class Film_stack  {
+public:
+    Film_stack();
+
+    /**
+        adds a layer below the existing ones; call prepare() afterwards
+        @param film The film, with its index or dispersion model
+        @param thickness Layer thickness in nm
+        @param tables Precomputed dispersion tables, or null
+        @param pos The library position of the film in the tables, or -1
+    */
+    void addLayer(const Thin_film& film, double thickness,
+        const Dispersion_tables* tables = 0, int pos = -1);
+
+    /**
+        computes the optical constants and matrices of every layer
+        @param wavelength The wavelengths in nm
+    */
+    void prepare(const vector<double>& wavelength);
+
+    //returns the number of layers
+    size_t getLayerCount() const;
+
+    //returns the film of a layer
+    const Thin_film& getFilm(size_t layer) const;
+
+    //returns the thickness of a layer in nm
+    double getThickness(size_t layer) const;
+
+    /**
+        changes the thickness of one layer
+        @param layer The layer, 0 faces the air
+        @param thickness Layer thickness in nm
+    */
+    void setThickness(size_t layer, double thickness);
+
+    /**
+        calculates the reflectance |r|^2 of the stack
+        @param derivatives Also calculate dR/dd of every layer
+        @return the reflectance array
+    */
+    const double* reflectance(bool derivatives = false);
+
+    //returns dR/dd of a layer from the last reflectance(true)
+    const double* getDerivative(size_t layer) const;
+
+    //returns the thickness of a quarter fringe of a layer at the shortest wavelength
+    double getFringeStep(size_t layer) const;
+
+    //returns the number of prepared wavelengths
+    size_t size() const;
+
+private:
+    struct Stack_layer  {
+        Thin_film film;
+        double thickness;
+        const Dispersion_tables* tables;
+        int pos;
+        //complex index N and 2 pi N / l
+        vector<complex<double>> index;
+        vector<complex<double>> phase;
+        //the characteristic matrix, m00 = m11 = cos D
+        vector<complex<double>> cosine;
+        vector<complex<double>> sine;
+        vector<complex<double>> m01;
+        vector<complex<double>> m10;
+        //product of the layers above
+        vector<complex<double>> p00;
+        vector<complex<double>> p01;
+        vector<complex<double>> p10;
+        vector<complex<double>> p11;
+        //substrate vector through the layers below
+        vector<complex<double>> sb;
+        vector<complex<double>> sc;
+        vector<double> derivative;
+        double fringeStep;
+    };
+
+    //recomputes the matrices of a layer at its thickness
+    void updateLayer(Stack_layer& layer);
+
+    //makes the prefix products valid down to a layer
+    void extendPrefix(size_t layer);
+
+    //makes the suffix vectors valid up to a layer
+    void extendSuffix(size_t layer);
+
+    vector<Stack_layer> layers;
+    vector<double> wavelength;
+    vector<complex<double>> substrate;
+    vector<double> model;
+    //prefixes are valid for layers <= prefixValid, suffixes for layers >= suffixValid
+    size_t prefixValid;
+    size_t suffixValid;
+    //the layer that changed last, where the product is split
+    size_t split;
+};
+
+//outcome of fitting a film stack to a spectrum
+struct Stack_fit_result  {
+    //fitted thickness of every layer in nm, layer 0 faces the air
+    vector<double> thickness;
+    //intensity = scale * reflectance + offset
+    double scale;
+    double offset;
+    //root mean square difference between model and spectrum
+    double residual;
+    //number of Levenberg-Marquardt iterations
+    int iterations;
+    //whether the iterations converged before the limit
+    bool converged;
+};
+
+/**
+    Stack_fit fits the thickness of every layer of a Film_stack to a
+    measured spectrum, modelled as scale * |r|^2 + offset. The layer
+    thicknesses the stack was built with are the starting estimates.
+    fit() scans the thicknesses around the estimates on a subsample of the
+    wavelengths, varying one layer per step so only that layer is
+    recomputed, then refines all thicknesses, scale and offset with
+    Levenberg-Marquardt using the analytic derivatives of the stack.
+*/
+class Stack_fit  {
+public:
+    /**
+        prepares a stack for a spectrum
+        @param spectrum The measured spectrum
+        @param stack The layers with their starting thicknesses
+    */
+    void prepare(const Spectrum& spectrum, const Film_stack& stack);
+
+    //fits the layer thicknesses
+    Stack_fit_result fit();
+
+private:
+    vector<double> intensity;
+    vector<double> coarseIntensity;
+    Film_stack coarse;
+    Film_stack stack;
+};
+
+/**
+    Work_pool is a fixed set of worker threads, one per hardware thread by
+    default. run() splits the items evenly over per-worker queues; a worker
+    takes items from the back of its own queue and, once it runs dry,
+    steals from the front of the other queues, so uneven item costs still
+    keep every core busy. The calling thread takes part as worker 0.
+*/
+class Work_pool  {
+public:
+    /**
+        starts the worker threads
+        @param threads The number of workers, 0 for one per hardware thread
+    */
+    Work_pool(unsigned threads = 0);
+
+    //stops and joins the worker threads
+    ~Work_pool();
+
+    //returns the number of workers, including the calling thread
+    unsigned size() const;
+
+    /**
+        calls task(item, worker) once for every item in [0, count) and
+        returns when all of them have finished; worker identifies the
+        thread so tasks can keep per-thread state without locking. If a
+        task throws, the items not started yet are skipped and the first
+        exception is thrown again on the calling thread
+        @param count The number of items
+        @param task The function run for each item
+    */
+    void run(size_t count, const function<void(size_t, unsigned)>& task);
+
+private:
+    struct Work_queue  {
+        mutex lock;
+        deque<size_t> items;
+    };
+
+    //runs items until every queue is empty
+    void work(unsigned worker);
+
+    //takes the next item for a worker, stealing if its queue is empty
+    bool take(unsigned worker, size_t& item);
+
+    //worker thread loop
+    void loop(unsigned worker);
+
+    vector<thread> threads;
+    vector<Work_queue> queues;
+    const function<void(size_t, unsigned)>* task;
+    //the first exception a task threw in this run
+    exception_ptr failure;
+    //whether a task threw, so the remaining items are skipped
+    atomic<bool> failing;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    unsigned generation;
+    unsigned busy;
+    bool stopping;
+};
+
+/**
+    Prints the running statistics of one material's results from the
+    sidecar index of a results file, catching up with results appended
+    since it was last updated
+    @param material The material
+    @param fileName The results file
+    @return 1 if the material has no results, 0 otherwise
+*/
+int runMaterialStats(const string& material, const string& fileName);
+
+//output layouts of the pipe mode
+enum Pipe_format { PIPE_TEXT = 0, PIPE_CSV = 1, PIPE_JSON = 2 };
+
+/**
+    Reads batch lines, material,index,spectralRange,numberOfMaxima, from
+    standard input as a stream and writes the thicknesses to standard
+    output in the print() column layout, as CSV or as JSON lines. Input and
+    output go through large buffers; output is written when its buffer is
+    full, every flushEvery records and at the end
+    @param library The film library
+    @param format The output layout
+    @param flushEvery Write the output every this many records, 0 only when full
+    @return the number of malformed lines
+*/
+int runPipe(Film_library& library, Pipe_format format, size_t flushEvery);
+
+/**
+    Follows a results file such as data.txt with a Result_follower until
+    SIGINT or SIGTERM, writing every appended result with the running
+    statistics of its material to standard output. The per-material
+    statistics index starts where its sidecar left off, so history is not
+    read again, and the sidecar is brought up to date about once a second
+    @param fileName The name of the results file
+    @param format The output layout
+    @return 1 if the results file or standard output fails, 0 otherwise
+*/
+int runFollow(const string& fileName, Pipe_format format);
+
+//one benchmark measurement
+struct Bench_result  {
+    string name;
+    //the number of items processed in the measured time
+    size_t items;
+    //the best time of the repeats in seconds
+    double seconds;
+};
+
+//largest synthetic library of --bench by default
+const size_t BENCH_MAX_FILMS = 10000000;
+
+/**
+    Runs the benchmarks of the thickness kernels, library load and save,
+    result writing at several flush policies, fringe counting, fits and
+    server requests on synthetic data in a temporary directory, and
+    prints the results as JSON
+    @param maxFilms The largest synthetic library, from 1000 in steps of ten
+    @param outFile The file for the JSON results, empty for standard output
+    @return 1 if the results cannot be written, 0 otherwise
+*/
+int runBench(size_t maxFilms, const string& outFile);
+
+/**
+    resolves a library material name or a refractive index typed as a
+    number into a film
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param material Library material name or refractive index
+    @param film Receives the material and index
+    @return false if the name is not in the library
+*/
+bool resolveMaterial(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const string& material, Thin_film& film);
+
+/**
+    Film_server answers thickness and fit requests over a Unix or TCP
+    socket, so the library is loaded once instead of once per request.
+    The protocol is one request per line and one response line per
+    request, in the order of the requests:
+        T <material|index> <spectralRange> <maxima>   OK <thickness>
+        F <material|index> <spectrum file>            OK <thickness> <residual>
+        P                                             OK
+        S                                             OK <statistics>
+        Q                                             closes the connection
+    A bad request is answered with ERR and a reason. Every client is served
+    by its own thread, up to MAX_SERVER_CLIENTS at a time; a client beyond
+    them is answered ERR and closed. Requests may be pipelined: all
+    complete lines that have arrived are answered and their responses sent
+    in one write before the next read. The statistics are those of
+    formatStatsLine(), which the server collects while it runs. A spectrum
+    file of an F request is named relative to the directory the server was
+    started in and must lie inside it. There is no authentication, so :port
+    listens on the loopback interface only.
+*/
+//clients a Film_server serves at a time
+const int MAX_SERVER_CLIENTS = 64;
+
+class Film_server  {
+public:
+    //per-client scratch buffers, reused from request to request
+    struct Session  {
+        Fringe_counter counter;
+        Reflectance_fit fitter;
+        Spectrum spectrum;
+        vector<const char*> fields;
+    };
+
+    Film_server(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+        const Dispersion_tables& tables);
+    ~Film_server();
+
+    /**
+        opens the listening socket
+        @param address A Unix socket path, or host:port or :port for TCP on
+        the loopback interface
+        @return false if the socket cannot be opened
+    */
+    bool listen(const string& address);
+
+    /**
+        accepts clients until SIGINT or SIGTERM, then disconnects the
+        clients and waits for their threads
+        @return false if the listening socket failed
+    */
+    bool run();
+
+    /**
+        answers one request line
+        @param session The scratch buffers of the client
+        @param begin The first character of the line
+        @param end One past the last character, without the newline
+        @param response The response line is appended to this
+        @return false if the client asked to close the connection
+    */
+    bool handle(Session& session, const char* begin, const char* end, string& response) const;
+
+private:
+    //serves one client until it disconnects
+    void serve(int client);
+
+    /**
+        resolves the spectrum file of an F request
+        @param name The file name the client sent
+        @param path Receives the file inside the spectrum directory
+        @return false if the file lies outside it
+    */
+    bool resolveSpectrum(const string& name, filesystem::path& path) const;
+
+    const vector<Thin_film>& materialList;
+    const Film_index& filmIndex;
+    const Dispersion_tables& tables;
+    int listener;
+    bool tcp;
+    string socketPath;
+    //the directory F requests read spectra from
+    filesystem::path spectrumDirectory;
+    //sockets of the clients being served
+    vector<int> clients;
+    mutex clientLock;
+    condition_variable clientDone;
+};
+
+//spectra in flight in the acquisition pipeline
+const size_t ACQUIRE_SLOTS = 32;
+//the most samples of one acquired spectrum
+const size_t ACQUIRE_MAX_SAMPLES = 16384;
+
+/**
+    Acquisition_pipeline measures spectra streamed by a spectrometer as
+    they arrive. A stream is a sequence of frames in the binary spectrum
+    file layout of loadSpectrum(). Four threads run the stages
+        acquire      reads a frame into a free slot
+        preprocess   converts it to a Spectrum, ascending and checked
+        compute      counts the fringes and calculates the thickness,
+                     then optionally fits it
+        sink         writes the result through a Result_sink
+    and pass slot numbers through Spsc_ring queues, the sink returning
+    each slot to the acquisition. Slots and scratch buffers are allocated
+    up front, so a spectrum is measured without allocating. Acquisition
+    from a live stream (a pipe, FIFO or device) never waits for the later
+    stages: a frame that finds no free slot is read and dropped. A regular
+    file is replayed and waits for a slot instead. Every stage is timed as a Stage_timer stage, and the
+    time from acquisition to the sink as STAGE_PIPELINE.
+*/
+class Acquisition_pipeline  {
+public:
+    /**
+        allocates the slots
+        @param film The film, with its index or dispersion model
+        @param tables Precomputed dispersion tables, or null
+        @param pos The library position of the film in the tables, or -1
+        @param fitting Whether to fit the thickness after counting fringes
+        @param results The sink the results are written to
+    */
+    Acquisition_pipeline(const Thin_film& film, const Dispersion_tables* tables, int pos,
+        bool fitting, Result_sink& results);
+
+    /**
+        measures the spectra of a stream until it ends
+        @param source The stream of frames
+        @param live Whether frames that find no free slot are dropped
+        @return false if the stream held a malformed frame
+    */
+    bool run(FILE* source, bool live);
+
+    //returns the number of frames read
+    uint64_t getFrames() const;
+
+    //returns the number of frames dropped because no slot was free
+    uint64_t getDropped() const;
+
+    //returns the number of spectra rejected by the preprocessing
+    uint64_t getRejected() const;
+
+    //returns the number of results written
+    uint64_t getWritten() const;
+
+private:
+    //one spectrum in flight
+    struct Slot  {
+        //wavelengths followed by intensities as read
+        vector<float> raw;
+        size_t samples;
+        Spectrum spectrum;
+        bool valid;
+        double thickness;
+        chrono::steady_clock::time_point acquired;
+    };
+
+    //slot number that ends the stream
+    static const uint32_t END = 0xFFFFFFFFu;
+
+    /**
+        reads one frame
+        @param source The stream
+        @param slot The slot receiving the samples
+        @return 1 for a frame, 0 at the end of the stream, -1 for a malformed frame
+    */
+    int readFrame(FILE* source, Slot& slot);
+
+    //the stage loops
+    void acquire(FILE* source, bool live);
+    void preprocess();
+    void compute();
+    void sink();
+
+    Thin_film film;
+    const Dispersion_tables* tables;
+    int pos;
+    bool fitting;
+    Result_sink& results;
+    vector<Slot> slots;
+    //receives the frames that find no free slot
+    Slot overflow;
+    Spsc_ring<uint32_t> freeSlots;
+    Spsc_ring<uint32_t> acquired;
+    Spsc_ring<uint32_t> preprocessed;
+    Spsc_ring<uint32_t> computed;
+    Fringe_counter counter;
+    Reflectance_fit fitter;
+    atomic<uint64_t> frames;
+    atomic<uint64_t> dropped;
+    atomic<uint64_t> rejected;
+    atomic<uint64_t> written;
+    atomic<bool> malformed;
+};
+
+//formatting constants
+const int MATERIAL_WIDTH = 30;
+const int INDEX_WIDTH = 10;
+const int MAXIMA_WIDTH = 15;
+const int THICKNESS_WIDTH = 20;
+    
+String_pool::String_pool()  {
+    grow(64);
+    intern(string());
+}
+
+size_t String_pool::probe(string_view text, uint32_t hash) const  {
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slots[i].id != 0
+        && (slots[i].hash != hash || strings.get(slots[i].id - 1) != text)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void String_pool::grow(size_t n)  {
+    size_t capacity = 64;
+    while (capacity < 2 * n) {
+        capacity *= 2;
+    }
+    if (capacity <= slots.size())  {
+        return;
+    }
+    vector<Slot> old(capacity, Slot());
+    old.swap(slots);
+    for (size_t i = 0; i < old.size(); i++) {
+        if (old[i].id != 0)  {
+            size_t j = old[i].hash & (capacity - 1);
+            while (slots[j].id != 0) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = old[i];
+        }
+    }
+}
+
+uint32_t String_pool::intern(const char* begin, const char* end)  {
+    string_view text(begin, end - begin);
+    uint32_t hash = uint32_t(std::hash<string_view>()(text));
+    {
+        shared_lock<shared_mutex> reading(lock);
+        const Slot& slot = slots[probe(text, hash)];
+        if (slot.id != 0)  {
+            return slot.id - 1;
+        }
+    }
+    unique_lock<shared_mutex> writing(lock);
+    if (2 * (strings.size() + 1) > slots.size())  {
+        grow(strings.size() + 1);
+    }
+    Slot& slot = slots[probe(text, hash)];
+    if (slot.id == 0)  {
+        slot.hash = hash;
+        slot.id = strings.add(string(begin, end)) + 1;
+    }
+    return slot.id - 1;
+}
+
+uint32_t String_pool::intern(const string& text)  {
+    return intern(text.data(), text.data() + text.size());
+}
+
+bool String_pool::find(string_view text, uint32_t& id) const  {
+    uint32_t hash = uint32_t(std::hash<string_view>()(text));
+    shared_lock<shared_mutex> reading(lock);
+    const Slot& slot = slots[probe(text, hash)];
+    if (slot.id == 0)  {
+        return false;
+    }
+    id = slot.id - 1;
+    return true;
+}
+
+const string& String_pool::get(uint32_t id) const  {
+    return strings.get(id);
+}
+
+size_t String_pool::size() const  {
+    shared_lock<shared_mutex> reading(lock);
+    return strings.size();
+}
+
+void String_pool::reserve(size_t n)  {
+    unique_lock<shared_mutex> writing(lock);
+    grow(strings.size() + n);
+}
+
+String_pool& materialNames()  {
+    static String_pool names;
+    return names;
+}
+
+void fail(ostream& out, const string& message, int status)  {
+#ifdef THINFILMCALC_LIBRARY
+    (void)out;
+    (void)status;
+    throw runtime_error(message);
+#else
+    out << message << '\n';
+    exit(status);
+#endif
+}
+
+ostream& warnings()  {
+#ifdef THINFILMCALC_LIBRARY
+    //a stream without a buffer drops what is written to it
+    static ostream discard(0);
+    return discard;
+#else
+    return cerr;
+#endif
+}
+
+//default constructor
+Thin_film::Thin_film()  {
+    spectralRange = 0.0;
+    index = 0.0;
+    numberOfMaxima = 0.0;
+    dispersion = 0;
+    mat = 0;
+}
+    
+//overloaded constructor
+Thin_film::Thin_film(string mat, double index)  {
+    spectralRange = 0.0;
+    numberOfMaxima = 0.0;
+    dispersion = 0;
+    setMat(mat);
+    setIndex(index);
+}
+        
+const string& Thin_film::getMat() const {
+    return materialNames().get(mat);
+}
+
+uint32_t Thin_film::getMatId() const {
+    return mat;
+}
+    
+int Thin_film::getspectralRange() const {
+    return spectralRange;
+}
+    
+double Thin_film::getIndex() const {
+    return index;
+}
+
+double Thin_film::getIndex(double wavelength) const {
+    return dispersion ? dispersion->getIndex(wavelength) : index;
+}
+
+double Thin_film::getExtinction(double wavelength) const {
+    return dispersion ? dispersion->getExtinction(wavelength) : 0.0;
+}
+
+const Dispersion* Thin_film::getDispersion() const {
+    return dispersion;
+}
+
+void Thin_film::setDispersion(const Dispersion* newDispersion)  {
+    dispersion = newDispersion;
+    if (dispersion)  {
+        setIndex(dispersion->getIndex(REFERENCE_WAVELENGTH));
+    }
+}
+
+double Thin_film::getThickness() const  {
+    return filmThickness(index, spectralRange, numberOfMaxima);
+}
+
+void Thin_film::setMat(string newMat)   {
+    mat = materialNames().intern(newMat);
+}
+
+void Thin_film::setspectralRange(double newSpectralRange)  {
+    if (newSpectralRange < 0)  {
+        spectralRange = 0.0;
+    }
+        else {
+            spectralRange = newSpectralRange;
+        }
+}
+
+void Thin_film::setIndex(double newIndex)  {
+    if (newIndex < 0)  {
+        index = 0.0;
+    }
+        else  {
+            index = newIndex;	
+        }
+}
+
+void Thin_film::setnumberOfMaxima(double newMaxima) {
+    if (newMaxima < 0)  {
+        numberOfMaxima = 0.0;
+    }
+        else {
+            numberOfMaxima = newMaxima;  
+        }
+}
+
+//returns this thread's buffer for formatting single lines
+static string& lineBuffer()  {
+    static thread_local string line;
+    line.clear();
+    return line;
+}
+
+void Thin_film::print()   const  {
+    string& line = lineBuffer();
+    formatFilmResult(line, getMat(), index, numberOfMaxima, getThickness());
+    cout.write(line.data(), line.size());
+    //cout keeps the state the iostream layout left it in for later output
+    cout << fixed << setprecision(1) << right;
+}
+
+void Thin_film::printLib() const  {
+    string& line = lineBuffer();
+    formatLibraryEntry(line, getMat(), index);
+    cout.write(line.data(), line.size());
+    cout << fixed << setprecision(2) << right;
+}
+
+void Thin_film::read()  {
+    cout << "Enter the name of the film: ";
+    cin >>ws;
+    string name;
+    getline(cin, name);
+    setMat(name);
+    cout << "Enter the refractive index of the film: ";
+    cin >> index;
+    cout << "Enter the spectral bandwidth over which the spectra was acquired in nm: ";
+    cin >> spectralRange;
+    cout << "Enter the number of maxima within the spectral range: ";
+    cin >> numberOfMaxima;
+}
+
+void Thin_film::read(ifstream& fin) {
+    fin >> ws;
+    string name;
+    getline(fin, name);
+    setMat(name);
+    fin >> index;
+}
+    
+void Thin_film::readFilm(ifstream& fin) {
+    fin >> ws;
+    string name;
+    getline(fin, name);
+    setMat(name);
+    fin >> index >> spectralRange >> numberOfMaxima;
+}
+
+void Thin_film::writeFile(ofstream& fout) const {
+    fout << getMat() << '\n' << formatOptics(*this) << '\n';
+}
+
+void Thin_film::writeMeasResultFile(ofstream& fout, string fileName)  const  {
+    cout << "Would you like to save this measurement result (y/n)? ";
+    string saveMeasurement = "n";
+    cin >> saveMeasurement;
+    if (saveMeasurement == "y")  {
+        //the sink locks the file around the append and updates the sidecar
+        Sink_policy policy;
+        policy.flushMillis = 0;
+        Result_sink results(fileName, policy);
+        if (!results.isOpen()) {
+            cout << "Output file failed to open.\n";
+            exit(-1);
+        }
+        results.write(*this);
+        results.commit();
+    }
+}
+
+void Thin_film::writeMeasResult(ostream& out) const  {
+    ::writeMeasResult(out, getMat(), index, getThickness());
+}
+
+void writeMeasResult(ostream& out, const string& mat, double index, double thickness)  {
+    string& line = lineBuffer();
+    formatMeasResult(line, mat, index, thickness);
+    out.write(line.data(), line.size());
+}
+
+void formatMeasResult(string& out, const string& mat, double index, double thickness)  {
+    appendPadded(out, mat, MATERIAL_WIDTH, true);
+    appendFixed(out, index, INDEX_WIDTH, 2);
+    appendFixed(out, thickness, MAXIMA_WIDTH, 1);
+    out += '\n';
+}
+
+void formatFilmResult(string& out, const string& mat, double index, double numberOfMaxima,
+    double thickness)  {
+    appendPadded(out, mat, MATERIAL_WIDTH, true);
+    appendFixed(out, index, INDEX_WIDTH, 2);
+    appendFixed(out, numberOfMaxima, MAXIMA_WIDTH, 2);
+    appendFixed(out, thickness, THICKNESS_WIDTH, 1);
+    out += '\n';
+}
+
+void formatResultHeader(string& out)  {
+    static const string columns[] = { "Material", "Index", "# of maxima", "Thickness (nm)" };
+    appendPadded(out, columns[0], MATERIAL_WIDTH, true);
+    appendPadded(out, columns[1], INDEX_WIDTH, false);
+    appendPadded(out, columns[2], MAXIMA_WIDTH, false);
+    appendPadded(out, columns[3], THICKNESS_WIDTH, false);
+    out += '\n';
+}
+
+void formatLibraryEntry(string& out, const string& mat, double index)  {
+    appendPadded(out, mat, MATERIAL_WIDTH, true);
+    appendFixed(out, index, INDEX_WIDTH, 2);
+    out += '\n';
+}
+
+void formatCsvResult(string& out, const string& mat, double index, double spectralRange,
+    double numberOfMaxima, double thickness)  {
+    out += mat;
+    out += ',';
+    appendShortest(out, index);
+    out += ',';
+    appendShortest(out, spectralRange);
+    out += ',';
+    appendShortest(out, numberOfMaxima);
+    out += ',';
+    appendShortest(out, thickness);
+    out += '\n';
+}
+
+void Film_batch::reserve(size_t n)  {
+    index.reserve(n);
+    spectralRange.reserve(n);
+    numberOfMaxima.reserve(n);
+    thickness.reserve(n);
+}
+
+void Film_batch::add(double newIndex, double newSpectralRange, double newNumberOfMaxima)  {
+    index.push_back(newIndex < 0 ? 0.0 : newIndex);
+    spectralRange.push_back(newSpectralRange < 0 ? 0.0 : newSpectralRange);
+    numberOfMaxima.push_back(newNumberOfMaxima < 0 ? 0.0 : newNumberOfMaxima);
+}
+
+void Film_batch::clear()  {
+    index.clear();
+    spectralRange.clear();
+    numberOfMaxima.clear();
+    thickness.clear();
+}
+
+size_t Film_batch::size() const  {
+    return index.size();
+}
+
+const double* Film_batch::calculateThickness()  {
+    thickness.resize(index.size());
+    ::calculateThickness(index.data(), spectralRange.data(), numberOfMaxima.data(),
+        thickness.data(), index.size());
+    return thickness.data();
+}
+
+static void thicknessScalar(const double* index, const double* spectralRange,
+    const double* numberOfMaxima, double* thickness, size_t n)  {
+    for (size_t i = 0; i < n; i++) {
+        thickness[i] = filmThickness(index[i], spectralRange[i], numberOfMaxima[i]);
+    }
+}
+
+#ifdef THIN_FILM_X86_DISPATCH
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static void thicknessAvx2(const double* index, const double* spectralRange,
+    const double* numberOfMaxima, double* thickness, size_t n)  {
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d one = _mm256_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d m = _mm256_loadu_pd(numberOfMaxima + i);
+        __m256d r = _mm256_loadu_pd(spectralRange + i);
+        __m256d k = _mm256_loadu_pd(index + i);
+        __m256d mr = _mm256_div_pd(_mm256_mul_pd(m, r), two);
+        __m256d root = _mm256_sqrt_pd(_mm256_sub_pd(_mm256_mul_pd(k, k), one));
+        _mm256_storeu_pd(thickness + i, _mm256_mul_pd(mr, root));
+    }
+    thicknessScalar(index + i, spectralRange + i, numberOfMaxima + i, thickness + i, n - i);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void thicknessAvx512(const double* index, const double* spectralRange,
+    const double* numberOfMaxima, double* thickness, size_t n)  {
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d one = _mm512_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d m = _mm512_loadu_pd(numberOfMaxima + i);
+        __m512d r = _mm512_loadu_pd(spectralRange + i);
+        __m512d k = _mm512_loadu_pd(index + i);
+        __m512d mr = _mm512_div_pd(_mm512_mul_pd(m, r), two);
+        __m512d root = _mm512_maskz_sqrt_pd(0xFF, _mm512_sub_pd(_mm512_mul_pd(k, k), one));
+        _mm512_storeu_pd(thickness + i, _mm512_mul_pd(mr, root));
+    }
+    thicknessScalar(index + i, spectralRange + i, numberOfMaxima + i, thickness + i, n - i);
+}
+#endif
+
+static Simd_level simdLevel = detectSimdLevel();
+
+void calculateThickness(const double* index, const double* spectralRange,
+    const double* numberOfMaxima, double* thickness, size_t n)  {
+    Stage_timer timer(STAGE_COMPUTE, n);
+#ifdef THIN_FILM_X86_DISPATCH
+    if (simdLevel == SIMD_AVX512)  {
+        thicknessAvx512(index, spectralRange, numberOfMaxima, thickness, n);
+        return;
+    }
+    if (simdLevel == SIMD_AVX2)  {
+        thicknessAvx2(index, spectralRange, numberOfMaxima, thickness, n);
+        return;
+    }
+#endif
+    thicknessScalar(index, spectralRange, numberOfMaxima, thickness, n);
+}
+
+Simd_level detectSimdLevel()  {
+#ifdef THIN_FILM_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))  {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))  {
+        return SIMD_AVX2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+Simd_level setSimdLevel(Simd_level level)  {
+    Simd_level best = detectSimdLevel();
+    simdLevel = level > best ? best : level;
+    return simdLevel;
+}
+
+Simd_level getSimdLevel()  {
+    return simdLevel;
+}
+
+const char* simdLevelName(Simd_level level)  {
+    if (level == SIMD_AVX512)  {
+        return "avx512";
+    }
+    if (level == SIMD_AVX2)  {
+        return "avx2";
+    }
+    return "scalar";
+}
+
+//statistics of one stage, zero-initialized as a static
+struct Stage_stats  {
+    atomic<uint64_t> calls;
+    atomic<uint64_t> items;
+    atomic<uint64_t> nanos;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> latency[LATENCY_BUCKETS];
+};
+
+static Stage_stats stageStats[STAGE_COUNT];
+static atomic<bool> statsEnabled(false);
+static chrono::steady_clock::time_point statsStart = chrono::steady_clock::now();
+static atomic<uint64_t> cacheEvents[CACHE_EVENT_COUNT];
+
+void setStatsEnabled(bool enabled)  {
+    statsEnabled.store(enabled, memory_order_relaxed);
+}
+
+bool getStatsEnabled()  {
+    return statsEnabled.load(memory_order_relaxed);
+}
+
+const char* stageName(Stage stage)  {
+    static const char* names[STAGE_COUNT] = { "load_library", "save_library", "parse",
+        "read_spectrum", "preprocess", "count_fringes", "fft_estimate", "compute", "fit",
+        "format_results", "write_results", "request", "pipeline" };
+    return names[stage];
+}
+
+void recordCacheEvent(Cache_event event)  {
+    cacheEvents[event].fetch_add(1, memory_order_relaxed);
+}
+
+void recordStage(Stage stage, uint64_t nanos, uint64_t items, uint64_t bytes)  {
+    Stage_stats& stats = stageStats[stage];
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (nanos >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    stats.calls.fetch_add(1, memory_order_relaxed);
+    stats.items.fetch_add(items, memory_order_relaxed);
+    stats.nanos.fetch_add(nanos, memory_order_relaxed);
+    stats.bytes.fetch_add(bytes, memory_order_relaxed);
+    stats.latency[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+//returns the upper bound in ns of the bucket holding a fraction of the calls
+static uint64_t latencyPercentile(const Stage_stats& stats, double fraction)  {
+    uint64_t calls = stats.calls.load(memory_order_relaxed);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += stats.latency[bucket].load(memory_order_relaxed);
+        if (seen > 0 && seen >= fraction * calls)  {
+            return uint64_t(2) << bucket;
+        }
+    }
+    return uint64_t(2) << (LATENCY_BUCKETS - 1);
+}
+
+//formats a duration in ns with a unit
+static string formatNanos(uint64_t nanos)  {
+    const char* units[] = { "ns", "us", "ms", "s" };
+    int unit = 0;
+    while (unit < 3 && nanos >= 1000 && nanos % 1000 == 0) {
+        nanos /= 1000;
+        unit++;
+    }
+    double value = double(nanos);
+    while (unit < 3 && value >= 1000.0) {
+        value /= 1000.0;
+        unit++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), value == floor(value) ? "%.0f%s" : "%.1f%s", value, units[unit]);
+    return text;
+}
+
+string formatStats()  {
+    double uptime = chrono::duration<double>(chrono::steady_clock::now() - statsStart).count();
+    ostringstream out;
+    out.setf(ios::fixed);
+    out << "Stage statistics after " << setprecision(3) << uptime << " s\n"
+        << setw(MAXIMA_WIDTH) << left << "Stage" << right
+        << setw(INDEX_WIDTH) << "Calls" << setw(MAXIMA_WIDTH) << "Items"
+        << setw(MAXIMA_WIDTH) << "Time (ms)" << setw(MAXIMA_WIDTH) << "Items/s"
+        << setw(MAXIMA_WIDTH) << "Bytes" << setw(INDEX_WIDTH) << "p50"
+        << setw(INDEX_WIDTH) << "p99" << '\n';
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const Stage_stats& stats = stageStats[stage];
+        uint64_t calls = stats.calls.load(memory_order_relaxed);
+        if (calls == 0)  {
+            continue;
+        }
+        uint64_t items = stats.items.load(memory_order_relaxed);
+        uint64_t nanos = stats.nanos.load(memory_order_relaxed);
+        out << setw(MAXIMA_WIDTH) << left << stageName(Stage(stage)) << right
+            << setw(INDEX_WIDTH) << calls << setw(MAXIMA_WIDTH) << items
+            << setw(MAXIMA_WIDTH) << setprecision(3) << nanos / 1e6
+            << setw(MAXIMA_WIDTH) << setprecision(0) << (nanos > 0 ? items * 1e9 / nanos : 0.0)
+            << setw(MAXIMA_WIDTH) << stats.bytes.load(memory_order_relaxed)
+            << setw(INDEX_WIDTH) << formatNanos(latencyPercentile(stats, 0.5))
+            << setw(INDEX_WIDTH) << formatNanos(latencyPercentile(stats, 0.99)) << '\n';
+        //the histogram, one entry per non-empty bucket below its upper bound
+        out << "    ";
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            uint64_t count = stats.latency[bucket].load(memory_order_relaxed);
+            if (count > 0)  {
+                out << " <" << formatNanos(uint64_t(2) << bucket) << ':' << count;
+            }
+        }
+        out << '\n';
+    }
+    uint64_t hits = cacheEvents[CACHE_HIT].load(memory_order_relaxed);
+    uint64_t diskHits = cacheEvents[CACHE_DISK_HIT].load(memory_order_relaxed);
+    uint64_t misses = cacheEvents[CACHE_MISS].load(memory_order_relaxed);
+    if (hits + misses > 0)  {
+        out << "Fit cache: " << hits << " hits (" << diskHits << " from disk), " << misses
+            << " misses, " << cacheEvents[CACHE_EVICTION].load(memory_order_relaxed)
+            << " evictions, " << setprecision(1) << 100.0 * hits / (hits + misses)
+            << "% hit rate\n";
+    }
+    return out.str();
+}
+
+string formatStatsLine()  {
+    string line;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const Stage_stats& stats = stageStats[stage];
+        uint64_t calls = stats.calls.load(memory_order_relaxed);
+        if (calls == 0)  {
+            continue;
+        }
+        line += stageName(Stage(stage));
+        line += '=' + to_string(calls) + ',' + to_string(stats.items.load(memory_order_relaxed))
+            + ',' + to_string(stats.nanos.load(memory_order_relaxed))
+            + ',' + to_string(stats.bytes.load(memory_order_relaxed))
+            + ',' + to_string(latencyPercentile(stats, 0.5))
+            + ',' + to_string(latencyPercentile(stats, 0.99)) + ' ';
+    }
+    uint64_t hits = cacheEvents[CACHE_HIT].load(memory_order_relaxed);
+    uint64_t misses = cacheEvents[CACHE_MISS].load(memory_order_relaxed);
+    if (hits + misses > 0)  {
+        line += "fit_cache=" + to_string(hits)
+            + ',' + to_string(cacheEvents[CACHE_DISK_HIT].load(memory_order_relaxed))
+            + ',' + to_string(misses)
+            + ',' + to_string(cacheEvents[CACHE_EVICTION].load(memory_order_relaxed)) + ' ';
+    }
+    line += "uptime=" + to_string(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - statsStart).count());
+    return line;
+}
+
+Stage_timer::Stage_timer(Stage stage, uint64_t items)  {
+    this->stage = stage;
+    this->items = items;
+    bytes = 0;
+    running = getStatsEnabled();
+    if (running)  {
+        start = chrono::steady_clock::now();
+    }
+}
+
+Stage_timer::~Stage_timer()  {
+    finish();
+}
+
+void Stage_timer::setItems(uint64_t items)  {
+    this->items = items;
+}
+
+void Stage_timer::addBytes(uint64_t bytes)  {
+    this->bytes += bytes;
+}
+
+void Stage_timer::restart()  {
+    finish();
+    running = getStatsEnabled();
+    if (running)  {
+        start = chrono::steady_clock::now();
+    }
+}
+
+void Stage_timer::finish()  {
+    if (running)  {
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        recordStage(stage, chrono::duration_cast<chrono::nanoseconds>(end - start).count(),
+            items, bytes);
+        running = false;
+    }
+    bytes = 0;
+}
+
+Mapped_file::Mapped_file()  {
+    begin = 0;
+    length = 0;
+    mapped = false;
+}
+
+Mapped_file::~Mapped_file()  {
+    close();
+}
+
+bool Mapped_file::open(const string& fileName, bool growing)  {
+    close();
+#ifdef THIN_FILM_POSIX
+    int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)  {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0)  {
+        ::close(fd);
+        return false;
+    }
+    length = size_t(info.st_size);
+    if (length > 0 && !growing)  {
+        void* p = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)  {
+            begin = static_cast<const char*>(p);
+            mapped = true;
+            //a file truncated while it was mapped is read instead
+            if (fstat(fd, &info) != 0 || size_t(info.st_size) < length)  {
+                munmap(p, length);
+                begin = 0;
+                mapped = false;
+            } else  {
+                madvise(p, length, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    if (length > 0 && !mapped)  {
+        //the bytes present at the open, fewer if the file shrinks meanwhile
+        buffer.resize(length);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t got = read(fd, &buffer[done], length - done);
+            if (got < 0 && errno == EINTR)  {
+                continue;
+            }
+            if (got < 0)  {
+                //a directory or a read error
+                ::close(fd);
+                buffer.clear();
+                length = 0;
+                return false;
+            }
+            if (got == 0)  {
+                break;
+            }
+            done += size_t(got);
+        }
+        buffer.resize(done);
+        length = done;
+    }
+    ::close(fd);
+    if (!mapped)  {
+        begin = buffer.data();
+    }
+#else
+    (void) growing;
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (fin.fail()) {
+        return false;
+    }
+    buffer.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    begin = buffer.data();
+    length = buffer.size();
+#endif
+    return true;
+}
+
+void Mapped_file::close()  {
+#ifdef THIN_FILM_POSIX
+    if (mapped)  {
+        munmap(const_cast<char*>(begin), length);
+    }
+#endif
+    begin = 0;
+    length = 0;
+    mapped = false;
+    buffer.clear();
+}
+
+const char* Mapped_file::data() const  {
+    return begin;
+}
+
+File_lock::File_lock(int fd, bool exclusive)  {
+    this->fd = fd;
+    owned = false;
+    lock(exclusive);
+}
+
+File_lock::File_lock(const string& fileName, bool exclusive)  {
+#ifdef THIN_FILM_POSIX
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+#else
+    fd = -1;
+#endif
+    owned = true;
+    lock(exclusive);
+}
+
+File_lock::~File_lock()  {
+#ifdef THIN_FILM_POSIX
+    if (locked)  {
+        flock(fd, LOCK_UN);
+    }
+    if (owned && fd >= 0)  {
+        ::close(fd);
+    }
+#endif
+}
+
+bool File_lock::isLocked() const  {
+    return locked;
+}
+
+void File_lock::lock(bool exclusive)  {
+    locked = false;
+#ifdef THIN_FILM_POSIX
+    if (fd < 0)  {
+        return;
+    }
+    int result = 0;
+    do {
+        result = flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+    } while (result != 0 && errno == EINTR);
+    locked = result == 0;
+#else
+    locked = true;
+#endif
+}
+
+size_t Mapped_file::size() const  {
+    return length;
+}
+
+bool parseNumber(const char* begin, const char* end, double& value)  {
+    if (begin < end && *begin == '+')  {
+        begin++;
+    }
+    from_chars_result result = from_chars(begin, end, value);
+    return result.ec == errc() && result.ptr == end && begin != end;
+}
+
+//characters treated as blanks when trimming a line
+static bool isBlank(char c)  {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool parseMeasRecord(const char* begin, const char* end, Meas_record& record)  {
+    while (end > begin && isBlank(end[-1])) {
+        end--;
+    }
+    const char* thicknessEnd = end;
+    while (end > begin && !isBlank(end[-1])) {
+        end--;
+    }
+    const char* thicknessBegin = end;
+    while (end > begin && isBlank(end[-1])) {
+        end--;
+    }
+    const char* indexEnd = end;
+    while (end > begin && !isBlank(end[-1])) {
+        end--;
+    }
+    const char* indexBegin = end;
+    while (end > begin && isBlank(end[-1])) {
+        end--;
+    }
+    while (begin < end && isBlank(*begin)) {
+        begin++;
+    }
+    if (begin == end
+        || !parseNumber(indexBegin, indexEnd, record.index)
+        || !parseNumber(thicknessBegin, thicknessEnd, record.thickness))  {
+        return false;
+    }
+    record.mat = materialNames().intern(begin, end);
+    return true;
+}
+
+Film_index::Film_index()  {
+    names = 0;
+}
+
+//hashes the name and optics of a film; dispersion models are interned, so equal ones share an address
+static size_t filmHash(const Thin_film& film)  {
+    uint64_t bits = 0;
+    double index = film.getIndex();
+    memcpy(&bits, &index, sizeof(bits));
+    uint64_t hash = (film.getMatId() * 0x9E3779B97F4A7C15ull) ^ bits;
+    hash = (hash ^ reinterpret_cast<uintptr_t>(film.getDispersion())) * 0xC2B2AE3D27D4EB4Full;
+    return size_t(hash ^ (hash >> 31));
+}
+
+int Film_index::build(vector<Thin_film>& materialList, bool report)  {
+    order.clear();
+    positions.assign(materialNames().size(), -1);
+    names = 0;
+    int merged = 0;
+    size_t kept = 0;
+    //kept films by name and optics, position + 1 per slot, so a duplicate is found in O(1)
+    size_t mask = 15;
+    while (mask < 2 * materialList.size()) {
+        mask = 2 * mask + 1;
+    }
+    vector<int> seen(mask + 1, 0);
+    for (size_t i = 0; i < materialList.size(); i++) {
+        const Thin_film& film = materialList[i];
+        int first = find(film.getMat());
+        bool duplicate = false;
+        size_t slot = filmHash(film) & mask;
+        if (first >= 0 && materialList[first].getMatId() == film.getMatId())  {
+            for (; seen[slot] != 0 && !duplicate; slot = (slot + 1) & mask) {
+                const Thin_film& other = materialList[seen[slot] - 1];
+                duplicate = other.getMatId() == film.getMatId() && sameOptics(other, film);
+            }
+            if (!duplicate && report)  {
+                warnings() << "films.txt: " << film.getMat() << " appears with indices "
+                    << materialList[first].getIndex() << " and " << film.getIndex()
+                    << "; name lookups use " << materialList[first].getIndex()
+                    << ", add a variant tag (" << film.getMat() << VARIANT_SEPARATOR
+                    << "tag) to tell them apart\n";
+            }
+        }
+        if (duplicate)  {
+            merged++;
+            continue;
+        }
+        if (kept != i)  {
+            materialList[kept] = film;
+        }
+        while (seen[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        seen[slot] = int(kept) + 1;
+        insert(materialList, kept);
+        kept++;
+    }
+    materialList.resize(kept);
+    if (report && merged > 0)  {
+        warnings() << "films.txt: merged " << merged << " duplicate entries\n";
+    }
+    return merged;
+}
+
+void Film_index::addLast(const vector<Thin_film>& materialList)  {
+    order.clear();
+    if (!materialList.empty())  {
+        insert(materialList, materialList.size() - 1);
+    }
+}
+
+int Film_index::find(const string& name) const  {
+    uint32_t id = 0;
+    if (!materialNames().find(name, id) || id >= positions.size())  {
+        return -1;
+    }
+    return positions[id];
+}
+
+int Film_index::findExact(const Thin_film& film, const vector<Thin_film>& materialList) const  {
+    int pos = find(film.getMat());
+    if (pos < 0 || materialList[pos].getMatId() != film.getMatId())  {
+        return -1;
+    }
+    //a name repeated with other indices is rare, scan for the exact entry
+    for (size_t i = pos; i < materialList.size(); i++) {
+        if (materialList[i].getMatId() == film.getMatId()
+            && sameOptics(materialList[i], film))  {
+            return i;
+        }
+    }
+    return -1;
+}
+
+size_t Film_index::size() const  {
+    return names;
+}
+
+//compares the first n characters of two names ignoring case, n = 0 for all of them
+static int compareFolded(const string& a, const string& b, size_t n = 0)  {
+    size_t length = n > 0 ? n : max(a.size(), b.size());
+    for (size_t i = 0; i < length; i++) {
+        if (i == a.size() || i == b.size())  {
+            return i == a.size() ? (i == b.size() ? 0 : -1) : 1;
+        }
+        int x = tolower(static_cast<unsigned char>(a[i]));
+        int y = tolower(static_cast<unsigned char>(b[i]));
+        if (x != y)  {
+            return x < y ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+size_t Film_index::findPrefix(const vector<Thin_film>& materialList, const string& prefix,
+    size_t first, size_t count, vector<int>& page) const  {
+    if (order.size() != materialList.size())  {
+        order.resize(materialList.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = int(i);
+        }
+        stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return compareFolded(materialList[a].getMat(), materialList[b].getMat()) < 0;
+        });
+    }
+    size_t n = prefix.size();
+    auto begin = partition_point(order.begin(), order.end(), [&](int pos) {
+        return compareFolded(materialList[pos].getMat(), prefix, n) < 0;
+    });
+    auto end = n == 0 ? order.end() : partition_point(begin, order.end(), [&](int pos) {
+        return compareFolded(materialList[pos].getMat(), prefix, n) == 0;
+    });
+    size_t total = end - begin;
+    page.clear();
+    for (size_t i = first; i < total && i < first + count; i++) {
+        page.push_back(begin[i]);
+    }
+    return total;
+}
+
+size_t Film_index::findFuzzy(const vector<Thin_film>& materialList, const string& pattern,
+    size_t first, size_t count, vector<int>& page) const  {
+    string folded(pattern);
+    for (char& c : folded) {
+        c = char(tolower(static_cast<unsigned char>(c)));
+    }
+    //(score, position) of every match, lower scores first
+    vector<pair<size_t, int> > matches;
+    for (size_t pos = 0; pos < materialList.size(); pos++) {
+        const string& name = materialList[pos].getMat();
+        size_t matched = 0;
+        size_t start = 0;
+        size_t skipped = 0;
+        for (size_t i = 0; i < name.size() && matched < folded.size(); i++) {
+            if (tolower(static_cast<unsigned char>(name[i])) == folded[matched])  {
+                start = matched == 0 ? i : start;
+                matched++;
+            } else if (matched > 0)  {
+                skipped++;
+            }
+        }
+        if (matched == folded.size())  {
+            matches.push_back(make_pair((skipped * 64 + min<size_t>(start, 63)) * 1024
+                + min<size_t>(name.size(), 1023), int(pos)));
+        }
+    }
+    size_t end = min(matches.size(), first + count);
+    partial_sort(matches.begin(), matches.begin() + end, matches.end());
+    page.clear();
+    for (size_t i = first; i < end; i++) {
+        page.push_back(matches[i].second);
+    }
+    return matches.size();
+}
+
+void Film_index::insert(const vector<Thin_film>& materialList, int pos)  {
+    const string& mat = materialList[pos].getMat();
+    uint32_t id = materialList[pos].getMatId();
+    size_t separator = mat.find(VARIANT_SEPARATOR);
+    if (separator != string::npos)  {
+        claim(id, pos);
+        claim(materialNames().intern(mat.data(), mat.data() + separator), pos);
+        return;
+    }
+    //an untagged film takes the plain name over from a variant
+    claim(id, pos);
+    if (materialList[positions[id]].getMatId() != id)  {
+        positions[id] = pos;
+    }
+}
+
+void Film_index::claim(uint32_t id, int pos)  {
+    if (id >= positions.size())  {
+        positions.resize(materialNames().size() > id ? materialNames().size() : id + 1, -1);
+    }
+    if (positions[id] < 0)  {
+        positions[id] = pos;
+        names++;
+    }
+}
+
+bool Dispersion::parse(const char* begin, const char* end, Dispersion& dispersion)  {
+    const char* p = begin;
+    while (p < end && !isspace((unsigned char) *p)) {
+        p++;
+    }
+    string name(begin, p);
+    if (name == "cauchy")  {
+        dispersion.model = DISPERSION_CAUCHY;
+    } else if (name == "sellmeier")  {
+        dispersion.model = DISPERSION_SELLMEIER;
+    } else if (name == "table")  {
+        dispersion.model = DISPERSION_TABLE;
+    } else  {
+        return false;
+    }
+    dispersion.coefficients.clear();
+    while (p < end) {
+        while (p < end && isspace((unsigned char) *p)) {
+            p++;
+        }
+        const char* wordEnd = p;
+        while (wordEnd < end && !isspace((unsigned char) *wordEnd)) {
+            wordEnd++;
+        }
+        double value = 0.0;
+        if (p < wordEnd)  {
+            if (!parseNumber(p, wordEnd, value))  {
+                return false;
+            }
+            dispersion.coefficients.push_back(value);
+        }
+        p = wordEnd;
+    }
+    const vector<double>& c = dispersion.coefficients;
+    if (dispersion.model == DISPERSION_CAUCHY)  {
+        return c.size() >= 1 && c.size() <= 3;
+    }
+    if (dispersion.model == DISPERSION_SELLMEIER)  {
+        //a pole at the reference wavelength leaves the film without an index
+        if (c.size() < 2 || c.size() > 6 || c.size() % 2 != 0)  {
+            return false;
+        }
+        double n = dispersion.getIndex(REFERENCE_WAVELENGTH);
+        return n > 0.0 && n <= MAX_DISPERSION_INDEX;
+    }
+    if (c.empty() || c.size() % 3 != 0)  {
+        return false;
+    }
+    for (size_t i = 3; i < c.size(); i += 3) {
+        if (c[i] <= c[i - 3])  {
+            return false;
+        }
+    }
+    return true;
+}
+
+double Dispersion::getIndex(double wavelength) const  {
+    const vector<double>& c = coefficients;
+    double microns = wavelength / 1000.0;
+    double square = microns * microns;
+    if (model == DISPERSION_CAUCHY)  {
+        double n = c[0];
+        if (c.size() > 1)  {
+            n += c[1] / square;
+        }
+        if (c.size() > 2)  {
+            n += c[2] / (square * square);
+        }
+        return n;
+    }
+    if (model == DISPERSION_SELLMEIER)  {
+        double n2 = 1.0;
+        for (size_t i = 0; i + 1 < c.size(); i += 2) {
+            n2 += c[i] * square / (square - c[i + 1]);
+        }
+        return n2 > 0.0 && isfinite(n2) ? sqrt(n2) : 0.0;
+    }
+    if (wavelength <= c[0])  {
+        return c[1];
+    }
+    for (size_t i = 3; i < c.size(); i += 3) {
+        if (wavelength <= c[i])  {
+            double t = (wavelength - c[i - 3]) / (c[i] - c[i - 3]);
+            return c[i - 2] + t * (c[i + 1] - c[i - 2]);
+        }
+    }
+    return c[c.size() - 2];
+}
+
+double Dispersion::getExtinction(double wavelength) const  {
+    if (model != DISPERSION_TABLE)  {
+        return 0.0;
+    }
+    const vector<double>& c = coefficients;
+    if (wavelength <= c[0])  {
+        return c[2];
+    }
+    for (size_t i = 3; i < c.size(); i += 3) {
+        if (wavelength <= c[i])  {
+            double t = (wavelength - c[i - 3]) / (c[i] - c[i - 3]);
+            return c[i - 1] + t * (c[i + 2] - c[i - 1]);
+        }
+    }
+    return c[c.size() - 1];
+}
+
+string Dispersion::format() const  {
+    string text = model == DISPERSION_CAUCHY ? "cauchy"
+        : model == DISPERSION_SELLMEIER ? "sellmeier" : "table";
+    for (size_t i = 0; i < coefficients.size(); i++) {
+        text += ' ';
+        appendShortest(text, coefficients[i]);
+    }
+    return text;
+}
+
+Dispersion_model Dispersion::getModel() const  {
+    return model;
+}
+
+const vector<double>& Dispersion::getCoefficients() const  {
+    return coefficients;
+}
+
+Wavelength_grid::Wavelength_grid(double first, double last, double step)  {
+    this->first = first;
+    this->step = step > 0.0 ? step : 1.0;
+    this->count = last >= first ? size_t((last - first) / this->step + 0.5) + 1 : 1;
+}
+
+double Wavelength_grid::getWavelength(size_t i) const  {
+    return first + step * i;
+}
+
+void Dispersion_tables::build(const vector<Thin_film>& materialList, const Wavelength_grid& grid)  {
+    this->grid = grid;
+    constants.resize(materialList.size());
+    indexTables.assign(materialList.size(), vector<double>());
+    extinctionTables.assign(materialList.size(), vector<double>());
+    for (size_t pos = 0; pos < materialList.size(); pos++) {
+        const Dispersion* dispersion = materialList[pos].getDispersion();
+        constants[pos] = materialList[pos].getIndex();
+        if (dispersion == 0)  {
+            continue;
+        }
+        vector<double>& n = indexTables[pos];
+        n.resize(grid.count);
+        //samples at or next to a Sellmeier pole hold the last valid one,
+        //or the index at the reference wavelength before the first
+        double held = constants[pos];
+        for (size_t i = 0; i < grid.count; i++) {
+            n[i] = dispersion->getIndex(grid.getWavelength(i));
+            if (n[i] > 0.0 && n[i] <= MAX_DISPERSION_INDEX)  {
+                held = n[i];
+            } else  {
+                n[i] = held;
+            }
+        }
+        if (dispersion->getModel() == DISPERSION_TABLE)  {
+            vector<double>& k = extinctionTables[pos];
+            k.resize(grid.count);
+            for (size_t i = 0; i < grid.count; i++) {
+                k[i] = dispersion->getExtinction(grid.getWavelength(i));
+            }
+        }
+    }
+}
+
+const Wavelength_grid& Dispersion_tables::getGrid() const  {
+    return grid;
+}
+
+double Dispersion_tables::interpolate(const vector<double>& table, double wavelength) const  {
+    double t = (wavelength - grid.first) / grid.step;
+    if (t <= 0.0)  {
+        return table.front();
+    }
+    size_t i = size_t(t);
+    if (i + 1 >= table.size())  {
+        return table.back();
+    }
+    double fraction = t - double(i);
+    return table[i] + fraction * (table[i + 1] - table[i]);
+}
+
+double Dispersion_tables::getIndex(size_t pos, double wavelength) const  {
+    if (indexTables[pos].empty())  {
+        return constants[pos];
+    }
+    return interpolate(indexTables[pos], wavelength);
+}
+
+double Dispersion_tables::getExtinction(size_t pos, double wavelength) const  {
+    if (extinctionTables[pos].empty())  {
+        return 0.0;
+    }
+    return interpolate(extinctionTables[pos], wavelength);
+}
+
+const double* Dispersion_tables::getIndexTable(size_t pos) const  {
+    return indexTables[pos].empty() ? 0 : indexTables[pos].data();
+}
+
+const double* Dispersion_tables::getExtinctionTable(size_t pos) const  {
+    return extinctionTables[pos].empty() ? 0 : extinctionTables[pos].data();
+}
+
+const Dispersion* internDispersion(const Dispersion& dispersion)  {
+    static mutex lock;
+    static Block_arena<Dispersion> models;
+    static unordered_map<string, uint32_t> ids;
+    string text = dispersion.format();
+    lock_guard<mutex> guard(lock);
+    unordered_map<string, uint32_t>::iterator it = ids.find(text);
+    if (it == ids.end())  {
+        it = ids.emplace(text, models.add(dispersion)).first;
+    }
+    return &models.get(it->second);
+}
+
+bool parseOptics(const char* begin, const char* end, Thin_film& film)  {
+    double index = 0.0;
+    if (parseNumber(begin, end, index))  {
+        film.setDispersion(0);
+        film.setIndex(index);
+        return true;
+    }
+    Dispersion dispersion;
+    if (!Dispersion::parse(begin, end, dispersion))  {
+        return false;
+    }
+    film.setDispersion(internDispersion(dispersion));
+    return true;
+}
+
+string formatOptics(const Thin_film& film)  {
+    if (film.getDispersion() != 0)  {
+        return film.getDispersion()->format();
+    }
+    string text;
+    appendShortest(text, film.getIndex());
+    return text;
+}
+
+bool sameOptics(const Thin_film& a, const Thin_film& b)  {
+    if (a.getIndex() != b.getIndex())  {
+        return false;
+    }
+    if (a.getDispersion() == b.getDispersion())  {
+        return true;
+    }
+    return formatOptics(a) == formatOptics(b);
+}
+
+Film_journal::Film_journal(string fileName, size_t compactRecords)  {
+    this->fileName = fileName;
+    this->journalName = fileName + ".journal";
+    this->lockName = fileName + ".lock";
+    this->versionName = fileName + ".version";
+    this->compactRecords = compactRecords > 0 ? compactRecords : 1;
+    this->records = 0;
+}
+
+Film_journal::~Film_journal()  {
+    wait();
+}
+
+size_t Film_journal::replayFile(const string& name, vector<Thin_film>& materialList)  {
+    Mapped_file file;
+    if (!file.open(name, true))  {
+        return 0;
+    }
+    size_t applied = 0;
+    const char* p = file.data();
+    const char* end = p + file.size();
+    int lineNumber = 0;
+    while (p < end) {
+        const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (newline == 0)  {
+            //a record cut short by a crash
+            break;
+        }
+        const char* line = p;
+        p = newline + 1;
+        lineNumber++;
+        const char* nameEnd = line + 2 <= newline
+            ? static_cast<const char*>(memchr(line + 2, '\t', newline - line - 2)) : 0;
+        Thin_film film;
+        if (nameEnd == 0 || (line[0] != '+' && line[0] != '-') || line[1] != '\t'
+            || !parseOptics(nameEnd + 1, newline, film))  {
+            warnings() << name << ":" << lineNumber << ": malformed journal record\n";
+            continue;
+        }
+        film.setMat(string(line + 2, nameEnd));
+        if (line[0] == '+')  {
+            materialList.push_back(film);
+        }
+        else  {
+            for (size_t i = 0; i < materialList.size(); i++) {
+                if (materialList[i].getMatId() == film.getMatId() && sameOptics(materialList[i], film))  {
+                    materialList.erase(materialList.begin() + i);
+                    break;
+                }
+            }
+        }
+        applied++;
+    }
+    return applied;
+}
+
+//formats the library in the films.txt layout
+static string formatLibrary(const vector<Thin_film>& materialList)  {
+    string contents;
+    for (size_t i = 0; i < materialList.size(); i++) {
+        contents += materialList[i].getMat();
+        contents += '\n';
+        contents += formatOptics(materialList[i]);
+        contents += '\n';
+    }
+    return contents;
+}
+
+//formats one journal record
+static string journalRecord(char op, const Thin_film& film)  {
+    string record;
+    record += op;
+    record += '\t';
+    record += film.getMat();
+    record += '\t';
+    record += formatOptics(film);
+    record += '\n';
+    return record;
+}
+
+void Film_journal::add(const Thin_film& film)  {
+    append(journalRecord('+', film));
+}
+
+void Film_journal::remove(const Thin_film& film)  {
+    append(journalRecord('-', film));
+}
+
+void Film_journal::update(const Thin_film& oldFilm, const Thin_film& newFilm)  {
+    append(journalRecord('-', oldFilm) + journalRecord('+', newFilm));
+}
+
+void Film_journal::append(const string& data)  {
+    Stage_timer timer(STAGE_SAVE_LIBRARY, 0);
+    timer.addBytes(data.size());
+    File_lock lock(lockName);
+    if (!lock.isLocked() || !appendToFile(journalName, data, true))  {
+        fail(cout, "Output file failed to open.", -1);
+    }
+    records += count(data.begin(), data.end(), '\n');
+}
+
+void Film_journal::compactIfNeeded()  {
+    if (records >= compactRecords)  {
+        compact();
+    }
+}
+
+void Film_journal::compact()  {
+    wait();
+    records = 0;
+    compactor = thread(&Film_journal::compactLibrary, this);
+}
+
+size_t Film_journal::readLibrary(vector<Thin_film>& materialList, size_t& live)  {
+    error_code error;
+    if (filesystem::exists(fileName, error))  {
+        loadData(materialList, fileName);
+    }
+    size_t applied = replayFile(journalName + ".old", materialList);
+    live = replayFile(journalName, materialList);
+    return applied + live;
+}
+
+//reads of the library that saw a compaction before one is waited out under the lock
+const int LIBRARY_READ_ATTEMPTS = 100;
+
+size_t Film_journal::load(vector<Thin_film>& materialList)  {
+    size_t kept = materialList.size();
+    for (int attempt = 0; attempt < LIBRARY_READ_ATTEMPTS; attempt++) {
+        uint64_t version = readVersion();
+        if (version % 2 == 0)  {
+            size_t applied = readLibrary(materialList, records);
+            if (readVersion() == version)  {
+                return applied;
+            }
+            materialList.resize(kept);
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    //writers hold the lock exclusively, so a shared one sees no compaction
+    File_lock lock(lockName, false);
+    return readLibrary(materialList, records);
+}
+
+uint64_t Film_journal::readVersion() const  {
+    Mapped_file file;
+    error_code error;
+    uint64_t version = 0;
+    if (filesystem::exists(versionName, error) && file.open(versionName))  {
+        from_chars(file.data(), file.data() + file.size(), version);
+    }
+    return version;
+}
+
+bool Film_journal::exists() const  {
+    error_code error;
+    return filesystem::exists(fileName, error) || filesystem::exists(journalName, error)
+        || filesystem::exists(journalName + ".old", error);
+}
+
+bool Film_journal::writeVersion(uint64_t version)  {
+    return replaceFile(versionName, to_string(version) + '\n', false);
+}
+
+void Film_journal::compactLibrary()  {
+    File_lock lock(lockName);
+    uint64_t version = readVersion();
+    //an odd version was left by a compaction that did not finish
+    uint64_t writing = version % 2 == 0 ? version + 1 : version + 2;
+    vector<Thin_film> materialList;
+    if (!lock.isLocked() || !writeVersion(writing))  {
+        warnings() << "Library " << fileName << " could not be compacted.\n";
+        return;
+    }
+    size_t live = 0;
+    readLibrary(materialList, live);
+    Film_index().build(materialList, false);
+    if (replaceFile(fileName, formatLibrary(materialList)))  {
+        error_code error;
+        filesystem::remove(journalName + ".old", error);
+        filesystem::resize_file(journalName, 0, error);
+    }
+    else  {
+        warnings() << "Library " << fileName << " could not be compacted.\n";
+    }
+    writeVersion(writing + 1);
+}
+
+void Film_journal::wait()  {
+    if (compactor.joinable())  {
+        compactor.join();
+    }
+}
+
+Film_library::Film_library(string fileName, const Wavelength_grid& grid)
+    : fileName(fileName), grid(grid), journal(fileName)  {
+    loaded = false;
+    builtins = BUILTIN_FILM_COUNT;
+    films.reserve(BUILTIN_FILM_COUNT);
+    for (size_t i = 0; i < BUILTIN_FILM_COUNT; i++) {
+        films.push_back(Thin_film(BUILTIN_FILMS[i].mat, BUILTIN_FILMS[i].index));
+    }
+    index.build(films, false);
+    tables.build(films, grid);
+}
+
+void Film_library::load()  {
+    if (loaded)  {
+        return;
+    }
+    loaded = true;
+    if (fileName.empty() || !journal.exists())  {
+        return;
+    }
+    //the journal is replayed over the library file alone, so a deletion
+    //never reaches a catalog film of the same name and optics
+    vector<Thin_film> overlay;
+    journal.load(overlay);
+    //the library file overrides catalog films of the same name
+    vector<bool> named(materialNames().size(), false);
+    for (size_t i = 0; i < overlay.size(); i++) {
+        named[overlay[i].getMatId()] = true;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < builtins; i++) {
+        if (!named[films[i].getMatId()])  {
+            films[kept++] = films[i];
+        }
+    }
+    builtins = kept;
+    films.resize(kept);
+    films.insert(films.end(), overlay.begin(), overlay.end());
+    index.build(films, true);
+    tables.build(films, grid);
+}
+
+bool Film_library::isLoaded() const  {
+    return loaded;
+}
+
+int Film_library::find(const string& name)  {
+    load();
+    return index.find(name);
+}
+
+bool Film_library::isBuiltin(int pos) const  {
+    return pos >= 0 && size_t(pos) < builtins;
+}
+
+size_t Film_library::getBuiltinCount() const  {
+    return builtins;
+}
+
+vector<Thin_film>& Film_library::getFilms()  {
+    return films;
+}
+
+const vector<Thin_film>& Film_library::getFilms() const  {
+    return films;
+}
+
+Film_index& Film_library::getIndex()  {
+    return index;
+}
+
+const Film_index& Film_library::getIndex() const  {
+    return index;
+}
+
+const Dispersion_tables& Film_library::getTables() const  {
+    return tables;
+}
+
+void Film_library::updateTables()  {
+    tables.build(films, grid);
+}
+
+Film_journal& Film_library::getJournal()  {
+    return journal;
+}
+
+Sink_policy::Sink_policy()  {
+    flushBytes = 1 << 20;
+    flushMillis = 1000;
+    durability = DURABILITY_NONE;
+}
+
+Result_sink::Result_sink(string fileName, const Sink_policy& policy) : stats(fileName)  {
+    this->fileName = fileName;
+    this->policy = policy;
+    bytesWritten = 0;
+    pendingRecords = 0;
+    indexed = filesystem::path(fileName).filename() == "data.txt";
+    failed = false;
+    stopping = false;
+    //opened for reading too, so flush() can see how the file ends
+    file = fopen(fileName.c_str(), "a+b");
+    if (file != 0)  {
+        //records are buffered here, not in the FILE
+        setvbuf(file, 0, _IONBF, 0);
+        buffer.reserve(policy.flushBytes + 256);
+        if (policy.flushMillis > 0)  {
+            flusher = thread(&Result_sink::flushLoop, this);
+        }
+    }
+}
+
+Result_sink::~Result_sink()  {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (flusher.joinable())  {
+        flusher.join();
+    }
+    commit();
+    if (file != 0)  {
+        fclose(file);
+    }
+}
+
+bool Result_sink::isOpen() const  {
+    return file != 0;
+}
+
+void Result_sink::write(const string& mat, double index, double thickness)  {
+    lock_guard<mutex> guard(lock);
+    Stage_timer timer(STAGE_FORMAT_RESULTS);
+    formatMeasResult(buffer, mat, index, thickness);
+    pendingRecords++;
+    timer.finish();
+    if (buffer.size() >= policy.flushBytes)  {
+        flush();
+    }
+}
+
+void Result_sink::write(const Thin_film& film)  {
+    write(film.getMat(), film.getIndex(), film.getThickness());
+}
+
+bool Result_sink::commit()  {
+    lock_guard<mutex> guard(lock);
+    return flush();
+}
+
+size_t Result_sink::getBytesWritten() const  {
+    lock_guard<mutex> guard(lock);
+    return bytesWritten;
+}
+
+//whether an open file is empty or ends with a complete line
+static bool endsWithNewline(FILE* file)  {
+#ifdef THIN_FILM_POSIX
+    struct stat info;
+    char last = '\n';
+    if (fstat(fileno(file), &info) == 0 && info.st_size > 0
+        && pread(fileno(file), &last, 1, info.st_size - 1) != 1)  {
+        //an end that cannot be read is taken as a complete line
+        return true;
+    }
+    return last == '\n';
+#else
+    (void) file;
+    return true;
+#endif
+}
+
+bool Result_sink::flush()  {
+    if (file == 0 || failed)  {
+        return false;
+    }
+    if (buffer.empty())  {
+        return true;
+    }
+    Stage_timer timer(STAGE_WRITE_RESULTS, pendingRecords);
+    timer.addBytes(buffer.size());
+    if (indexed)  {
+        //a rebuild of the statistics reads the whole history, so it runs before the lock
+        stats.refresh();
+    }
+    {
+        //other stations append between the locks, never into the middle of a buffer
+        File_lock exclusive(fileno(file));
+        if (!exclusive.isLocked())  {
+            cerr << "Output file " << fileName << " could not be locked.\n";
+            failed = true;
+            return false;
+        }
+        //results appended by others since are taken in; the buffer lands at the covered offset
+        if (indexed)  {
+            stats.refresh();
+        }
+        //a writer that died mid-line left a partial record; ours starts on a new line
+        if (!endsWithNewline(file))  {
+            if (fputc('\n', file) == EOF)  {
+                cerr << "Output file " << fileName << " could not be written.\n";
+                failed = true;
+                return false;
+            }
+            if (indexed)  {
+                stats.refresh();
+            }
+        }
+        if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())  {
+            cerr << "Output file " << fileName << " could not be written.\n";
+            failed = true;
+            return false;
+        }
+        if (indexed)  {
+            stats.addLines(buffer.data(), buffer.data() + buffer.size());
+            stats.save();
+        }
+    }
+#ifdef THIN_FILM_POSIX
+    if (policy.durability == DURABILITY_FSYNC && fdatasync(fileno(file)) != 0)  {
+        cerr << "Output file " << fileName << " could not be synced.\n";
+        failed = true;
+        return false;
+    }
+#endif
+    bytesWritten += buffer.size();
+    buffer.clear();
+    pendingRecords = 0;
+    return true;
+}
+
+void Result_sink::flushLoop()  {
+    unique_lock<mutex> guard(lock);
+    while (!stopping) {
+        wake.wait_for(guard, chrono::milliseconds(policy.flushMillis));
+        flush();
+    }
+}
+
+Thickness_stats::Thickness_stats()  {
+    count = 0;
+    mean = 0.0;
+    m2 = 0.0;
+    min = 0.0;
+    max = 0.0;
+    recentCount = 0;
+}
+
+void Thickness_stats::add(double thickness)  {
+    count++;
+    double delta = thickness - mean;
+    mean += delta / count;
+    m2 += delta * (thickness - mean);
+    min = count == 1 || thickness < min ? thickness : min;
+    max = count == 1 || thickness > max ? thickness : max;
+    if (recentCount == RECENT_RESULTS)  {
+        memmove(recent, recent + 1, (RECENT_RESULTS - 1) * sizeof(double));
+        recentCount--;
+    }
+    recent[recentCount++] = thickness;
+}
+
+double Thickness_stats::getStddev() const  {
+    return count > 1 ? sqrt(m2 / (count - 1)) : 0.0;
+}
+
+double Thickness_stats::getTrend() const  {
+    if (recentCount < 2)  {
+        return 0.0;
+    }
+    double middle = (recentCount - 1) / 2.0;
+    double sumXY = 0.0;
+    double sumXX = 0.0;
+    double average = 0.0;
+    for (int i = 0; i < recentCount; i++) {
+        average += recent[i] / recentCount;
+    }
+    for (int i = 0; i < recentCount; i++) {
+        sumXY += (i - middle) * (recent[i] - average);
+        sumXX += (i - middle) * (i - middle);
+    }
+    return sumXY / sumXX;
+}
+
+Stats_index::Stats_index(const string& dataName)  {
+    this->dataName = dataName;
+    indexName = dataName + ".stats";
+    sidecarLines = 0;
+    clear();
+    Mapped_file contents;
+    error_code error;
+    if (!filesystem::exists(indexName, error) || !contents.open(indexName, true))  {
+        return;
+    }
+    //any damage to the sidecar only means the results after it are read again
+    rewrite = !load(contents.data(), contents.data() + contents.size());
+}
+
+bool Stats_index::load(const char* p, const char* end)  {
+    const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (lineEnd == 0 || string(p, lineEnd) != "TFSTATS 2")  {
+        return false;
+    }
+    p = lineEnd + 1;
+    sidecarLines = 1;
+    unordered_map<string, Thickness_stats> block;
+    while (p < end) {
+        lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (lineEnd == 0)  {
+            //a block cut short
+            return true;
+        }
+        sidecarLines++;
+        const char* tab = static_cast<const char*>(memchr(p, '\t', lineEnd - p));
+        if (tab == 0)  {
+            uint64_t offset = 0;
+            uint64_t print = 0;
+            const char* separator = static_cast<const char*>(memchr(p, ' ', lineEnd - p));
+            if (separator == 0 || string(p, separator) != "covered")  {
+                return false;
+            }
+            from_chars_result parsed = from_chars(separator + 1, lineEnd, offset);
+            if (parsed.ec != errc() || parsed.ptr == lineEnd || *parsed.ptr != ' '
+                || from_chars(parsed.ptr + 1, lineEnd, print, 16).ptr != lineEnd)  {
+                return false;
+            }
+            if (offset >= covered)  {
+                for (auto& entry : block) {
+                    materials[entry.first] = entry.second;
+                }
+                covered = offset;
+                coveredPrint = print;
+            }
+            block.clear();
+            p = lineEnd + 1;
+            continue;
+        }
+        Thickness_stats stats;
+        double values[6 + RECENT_RESULTS];
+        int fields = 0;
+        for (const char* field = tab + 1; field < lineEnd && fields < 6 + RECENT_RESULTS;) {
+            const char* fieldEnd = static_cast<const char*>(memchr(field, ' ', lineEnd - field));
+            fieldEnd = fieldEnd != 0 ? fieldEnd : lineEnd;
+            if (!parseNumber(field, fieldEnd, values[fields++]))  {
+                return false;
+            }
+            field = fieldEnd + 1;
+        }
+        if (fields < 6 || values[5] < 0 || values[5] > RECENT_RESULTS || fields != 6 + int(values[5]))  {
+            return false;
+        }
+        stats.count = uint64_t(values[0]);
+        stats.mean = values[1];
+        stats.m2 = values[2];
+        stats.min = values[3];
+        stats.max = values[4];
+        stats.recentCount = int(values[5]);
+        for (int i = 0; i < stats.recentCount; i++) {
+            stats.recent[i] = values[6 + i];
+        }
+        block[string(p, tab)] = stats;
+        p = lineEnd + 1;
+    }
+    return true;
+}
+
+void Stats_index::clear()  {
+    covered = 0;
+    coveredPrint = fingerprint(0, 0);
+    materials.clear();
+    changed.clear();
+    rewrite = true;
+}
+
+uint64_t Stats_index::fingerprint(const char* data, uint64_t offset)  {
+    //FNV-1a of the line that ends at the offset
+    const uint64_t MAX_LINE = 4096;
+    uint64_t start = offset > 0 ? offset - 1 : 0;
+    while (start > 0 && data[start - 1] != '\n' && offset - start < MAX_LINE) {
+        start--;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    for (uint64_t i = start; i < offset; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool Stats_index::refresh()  {
+    error_code error;
+    uint64_t size = filesystem::file_size(dataName, error);
+    if (error)  {
+        //no results yet
+        clear();
+        return !filesystem::exists(dataName, error);
+    }
+    if (size == covered && covered == 0)  {
+        return true;
+    }
+    Mapped_file file;
+    if (!file.open(dataName, true))  {
+        return false;
+    }
+    size = file.size();
+    if (size < covered || fingerprint(file.data(), covered) != coveredPrint)  {
+        clear();
+    }
+    //only complete lines; a line being appended is read next time
+    const char* begin = file.data() + covered;
+    const char* end = file.data() + size;
+    while (end > begin && end[-1] != '\n') {
+        end--;
+    }
+    addLines(begin, end);
+    coveredPrint = fingerprint(file.data(), covered);
+    return true;
+}
+
+void Stats_index::addLines(const char* begin, const char* end)  {
+    Meas_record record;
+    for (const char* p = begin; p < end;) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        lineEnd = lineEnd != 0 ? lineEnd : end;
+        if (parseMeasRecord(p, lineEnd, record) && isfinite(record.thickness))  {
+            const string& mat = materialNames().get(record.mat);
+            materials[mat].add(record.thickness);
+            if (changed.find(mat) == changed.end())  {
+                changed.insert(mat);
+            }
+        }
+        p = lineEnd + 1;
+    }
+    //the text starts at a line boundary, so it holds the whole last line
+    if (end > begin)  {
+        covered += end - begin;
+        coveredPrint = fingerprint(begin, end - begin);
+    }
+}
+
+void Stats_index::formatMaterial(string& text, const string& mat, const Thickness_stats& stats)  {
+    text += mat;
+    text += '\t';
+    text += to_string(stats.count);
+    double values[] = { stats.mean, stats.m2, stats.min, stats.max };
+    for (double value : values) {
+        text += ' ';
+        appendShortest(text, value);
+    }
+    text += ' ';
+    text += to_string(stats.recentCount);
+    for (int i = 0; i < stats.recentCount; i++) {
+        text += ' ';
+        appendShortest(text, stats.recent[i]);
+    }
+    text += '\n';
+}
+
+bool Stats_index::save()  {
+    error_code error;
+    //an index behind the results file would move the sidecar back
+    uint64_t size = filesystem::file_size(dataName, error);
+    if (error || size != covered)  {
+        return false;
+    }
+    bool compact = rewrite || sidecarLines > 2 * materials.size() + 64
+        || !filesystem::exists(indexName, error);
+    if (!compact && changed.empty())  {
+        return true;
+    }
+    string text = compact ? "TFSTATS 2\n" : "";
+    if (compact)  {
+        for (const auto& entry : materials) {
+            formatMaterial(text, entry.first, entry.second);
+        }
+    } else  {
+        for (const string& mat : changed) {
+            formatMaterial(text, mat, materials[mat]);
+        }
+    }
+    text += "covered " + to_string(covered) + ' ';
+    char print[24];
+    text.append(print, to_chars(print, print + sizeof(print), coveredPrint, 16).ptr);
+    text += '\n';
+    //a damaged sidecar is only read again, so it is not synced
+    if (compact ? !replaceFile(indexName, text, false) : !appendToFile(indexName, text, false))  {
+        return false;
+    }
+    sidecarLines = compact ? materials.size() + 2 : sidecarLines + changed.size() + 1;
+    changed.clear();
+    rewrite = false;
+    return true;
+}
+
+uint64_t Stats_index::getCovered() const  {
+    return covered;
+}
+
+const Thickness_stats* Stats_index::find(const string& mat) const  {
+    unordered_map<string, Thickness_stats>::const_iterator found = materials.find(mat);
+    return found != materials.end() ? &found->second : 0;
+}
+
+#ifdef THIN_FILM_POSIX
+Result_follower::Result_follower(const string& fileName, uint64_t offset)
+    : fileName(fileName), fd(-1), device(0), inode(0), offset(offset), buffer(FOLLOW_CHUNK),
+    notify(-1), resets(0)  {
+#ifdef THIN_FILM_INOTIFY
+    //the directory is watched, so a rotated or recreated file is noticed too
+    notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify >= 0)  {
+        string directory = filesystem::path(fileName).parent_path().string();
+        if (inotify_add_watch(notify, directory.empty() ? "." : directory.c_str(), IN_MODIFY
+            | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0)  {
+            close(notify);
+            notify = -1;
+        }
+    }
+#endif
+    if (!openFile())  {
+        this->offset = 0;
+        return;
+    }
+    //the line before the offset identifies the history already read
+    char tail[FOLLOW_CHUNK];
+    uint64_t start = offset > FOLLOW_CHUNK ? offset - FOLLOW_CHUNK : 0;
+    ssize_t got = offset > 0 ? pread(fd, tail, offset - start, start) : 0;
+    if (got != ssize_t(offset - start) || (got > 0 && tail[got - 1] != '\n'))  {
+        reset();
+        return;
+    }
+    ssize_t begin = got - 1;
+    while (begin > 0 && tail[begin - 1] != '\n') {
+        begin--;
+    }
+    last.assign(tail + max<ssize_t>(begin, 0), tail + got);
+}
+
+Result_follower::~Result_follower()  {
+    if (fd >= 0)  {
+        close(fd);
+    }
+    if (notify >= 0)  {
+        close(notify);
+    }
+}
+
+void Result_follower::subscribe(const Line_subscriber& lines, const Reset_subscriber& reset)  {
+    lineSubscribers.push_back(lines);
+    resetSubscribers.push_back(reset);
+}
+
+uint64_t Result_follower::getOffset() const  {
+    return offset;
+}
+
+uint64_t Result_follower::getResets() const  {
+    return resets;
+}
+
+bool Result_follower::openFile()  {
+    fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)  {
+        if (fd >= 0)  {
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+    device = info.st_dev;
+    inode = info.st_ino;
+    return true;
+}
+
+bool Result_follower::holdsLast() const  {
+    if (last.empty())  {
+        return true;
+    }
+    char tail[FOLLOW_CHUNK];
+    return pread(fd, tail, last.size(), offset - last.size()) == ssize_t(last.size())
+        && memcmp(tail, last.data(), last.size()) == 0;
+}
+
+void Result_follower::reset()  {
+    offset = 0;
+    last.clear();
+    resets++;
+    for (const Reset_subscriber& subscriber : resetSubscribers) {
+        if (subscriber)  {
+            subscriber();
+        }
+    }
+}
+
+uint64_t Result_follower::drain()  {
+    uint64_t handed = 0;
+    size_t filled = 0;
+    while (true) {
+        ssize_t got = pread(fd, buffer.data() + filled, buffer.size() - filled, offset + filled);
+        if (got < 0 && errno == EINTR)  {
+            continue;
+        }
+        if (got <= 0)  {
+            return handed;
+        }
+        filled += got;
+        const char* data = buffer.data();
+        const char* end = data + filled;
+        while (end > data && end[-1] != '\n') {
+            end--;
+        }
+        if (end == data)  {
+            if (filled == buffer.size())  {
+                //a line longer than the buffer
+                buffer.resize(buffer.size() * 2);
+            }
+            continue;
+        }
+        for (const Line_subscriber& subscriber : lineSubscribers) {
+            subscriber(data, end);
+        }
+        const char* lineStart = end - 1;
+        while (lineStart > data && lineStart[-1] != '\n' && end - lineStart < ptrdiff_t(FOLLOW_CHUNK)) {
+            lineStart--;
+        }
+        last.assign(lineStart, end);
+        size_t used = end - data;
+        offset += used;
+        handed += used;
+        filled -= used;
+        memmove(buffer.data(), end, filled);
+    }
+}
+
+uint64_t Result_follower::poll()  {
+    struct stat path;
+    if (stat(fileName.c_str(), &path) != 0)  {
+        //rotated away and not created again yet
+        return fd >= 0 ? drain() : 0;
+    }
+    uint64_t handed = 0;
+    if (fd < 0 || uint64_t(path.st_dev) != device || uint64_t(path.st_ino) != inode)  {
+        if (fd >= 0)  {
+            handed += drain();
+            close(fd);
+        }
+        if (!openFile())  {
+            return handed;
+        }
+        if (uint64_t(path.st_size) < offset || !holdsLast())  {
+            reset();
+        }
+    } else if (uint64_t(path.st_size) < offset || !holdsLast())  {
+        reset();
+    }
+    return handed + drain();
+}
+
+void Result_follower::wait(int timeoutMillis)  {
+#ifdef THIN_FILM_INOTIFY
+    if (notify >= 0)  {
+        struct pollfd ready = { notify, POLLIN, 0 };
+        if (::poll(&ready, 1, timeoutMillis) > 0)  {
+            //only whether something changed matters, not what
+            char events[4096];
+            while (read(notify, events, sizeof(events)) > 0) {
+            }
+        }
+        return;
+    }
+#endif
+    this_thread::sleep_for(chrono::milliseconds(timeoutMillis));
+}
+#else
+//without POSIX files cannot be read at an offset, so there is nothing to follow
+Result_follower::Result_follower(const string& fileName, uint64_t offset)
+    : fileName(fileName), fd(-1), device(0), inode(0), offset(offset), notify(-1), resets(0)  {
+}
+
+Result_follower::~Result_follower()  {
+}
+
+void Result_follower::subscribe(const Line_subscriber& lines, const Reset_subscriber& reset)  {
+    lineSubscribers.push_back(lines);
+    resetSubscribers.push_back(reset);
+}
+
+uint64_t Result_follower::getOffset() const  {
+    return offset;
+}
+
+uint64_t Result_follower::getResets() const  {
+    return resets;
+}
+
+uint64_t Result_follower::poll()  {
+    return 0;
+}
+
+void Result_follower::wait(int timeoutMillis)  {
+    this_thread::sleep_for(chrono::milliseconds(timeoutMillis));
+}
+#endif
+
+//fixed part of a columnar history file
+struct Columnar_header  {
+    char magic[4];
+    uint32_t version;
+    uint64_t rows;
+    uint64_t materialCount;
+    uint64_t dictionaryOffset;
+    uint64_t materialOffset;
+    uint64_t indexOffset;
+    uint64_t thicknessOffset;
+    uint64_t timestampOffset;
+};
+
+bool Columnar_history::open(const string& fileName)  {
+    rows = 0;
+    materialCount = 0;
+    if (!file.open(fileName) || file.size() < sizeof(Columnar_header))  {
+        return false;
+    }
+    Columnar_header header;
+    memcpy(&header, file.data(), sizeof(header));
+    uint64_t size = file.size();
+    //whether count entries of width bytes fit from offset on, without
+    //offset + count * width wrapping around
+    auto fits = [size](uint64_t offset, uint64_t count, uint64_t width) {
+        return offset <= size && count <= (size - offset) / width;
+    };
+    if (memcmp(header.magic, "TFCM", 4) != 0 || header.version != 1
+        || header.materialCount >= size / 4
+        || !fits(header.dictionaryOffset, header.materialCount + 1, 4)
+        || !fits(header.materialOffset, header.rows, 4)
+        || !fits(header.indexOffset, header.rows, 8)
+        || !fits(header.thicknessOffset, header.rows, 8)
+        || !fits(header.timestampOffset, header.rows, 8)
+        || header.dictionaryOffset % 4 != 0 || header.materialOffset % 4 != 0
+        || header.indexOffset % 8 != 0 || header.thicknessOffset % 8 != 0
+        || header.timestampOffset % 8 != 0)  {
+        file.close();
+        return false;
+    }
+    const char* base = file.data();
+    dictionary = reinterpret_cast<const uint32_t*>(base + header.dictionaryOffset);
+    names = base + header.dictionaryOffset + (header.materialCount + 1) * 4;
+    //name offsets ascend, so the last one bounds every name
+    for (uint64_t i = 0; i < header.materialCount; i++) {
+        if (dictionary[i + 1] < dictionary[i])  {
+            file.close();
+            return false;
+        }
+    }
+    if (dictionary[header.materialCount] > uint64_t(base + size - names))  {
+        file.close();
+        return false;
+    }
+    materials = reinterpret_cast<const uint32_t*>(base + header.materialOffset);
+    indices = reinterpret_cast<const double*>(base + header.indexOffset);
+    thicknesses = reinterpret_cast<const double*>(base + header.thicknessOffset);
+    timestamps = reinterpret_cast<const int64_t*>(base + header.timestampOffset);
+    rows = header.rows;
+    materialCount = header.materialCount;
+    return true;
+}
+
+size_t Columnar_history::size() const  {
+    return rows;
+}
+
+size_t Columnar_history::getMaterialCount() const  {
+    return materialCount;
+}
+
+string Columnar_history::getMaterial(uint32_t id) const  {
+    if (id >= materialCount)  {
+        return string();
+    }
+    return string(names + dictionary[id], names + dictionary[id + 1]);
+}
+
+bool Columnar_history::findMaterial(const string& mat, uint32_t& id) const  {
+    for (uint32_t i = 0; i < materialCount; i++) {
+        if (dictionary[i + 1] - dictionary[i] == mat.size()
+            && memcmp(names + dictionary[i], mat.data(), mat.size()) == 0)  {
+            id = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const uint32_t* Columnar_history::getMaterials() const  {
+    return materials;
+}
+
+const double* Columnar_history::getIndices() const  {
+    return indices;
+}
+
+const double* Columnar_history::getThicknesses() const  {
+    return thicknesses;
+}
+
+const int64_t* Columnar_history::getTimestamps() const  {
+    return timestamps;
+}
+
+//pads a column so the next one starts on an 8-byte boundary
+static void alignColumn(string& out)  {
+    out.append((8 - out.size() % 8) % 8, '\0');
+}
+
+bool writeColumnarHistory(const vector<Meas_record>& results, const vector<int64_t>& timestamps,
+    string fileName)  {
+    //the history numbers its own dictionary in order of first use
+    unordered_map<uint32_t, uint32_t> ids;
+    vector<const string*> dictionary;
+    vector<uint32_t> materials(results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+        pair<unordered_map<uint32_t, uint32_t>::iterator, bool> entry =
+            ids.emplace(results[i].mat, uint32_t(dictionary.size()));
+        if (entry.second)  {
+            dictionary.push_back(&materialNames().get(results[i].mat));
+        }
+        materials[i] = entry.first->second;
+    }
+
+    Columnar_header header;
+    memcpy(header.magic, "TFCM", 4);
+    header.version = 1;
+    header.rows = results.size();
+    header.materialCount = dictionary.size();
+    string out(sizeof(header), '\0');
+    header.dictionaryOffset = out.size();
+    uint32_t offset = 0;
+    string names;
+    for (size_t i = 0; i <= dictionary.size(); i++) {
+        out.append(reinterpret_cast<const char*>(&offset), 4);
+        if (i < dictionary.size())  {
+            names += *dictionary[i];
+            offset += dictionary[i]->size();
+        }
+    }
+    out += names;
+    alignColumn(out);
+    header.materialOffset = out.size();
+    out.append(reinterpret_cast<const char*>(materials.data()), materials.size() * 4);
+    alignColumn(out);
+    header.indexOffset = out.size();
+    for (size_t i = 0; i < results.size(); i++) {
+        out.append(reinterpret_cast<const char*>(&results[i].index), 8);
+    }
+    header.thicknessOffset = out.size();
+    for (size_t i = 0; i < results.size(); i++) {
+        out.append(reinterpret_cast<const char*>(&results[i].thickness), 8);
+    }
+    header.timestampOffset = out.size();
+    for (size_t i = 0; i < results.size(); i++) {
+        int64_t timestamp = i < timestamps.size() ? timestamps[i] : 0;
+        out.append(reinterpret_cast<const char*>(&timestamp), 8);
+    }
+    memcpy(&out[0], &header, sizeof(header));
+    return replaceFile(fileName, out);
+}
+
+void appendShortest(string& out, double value)  {
+    char text[32];
+    to_chars_result result = to_chars(text, text + sizeof(text), value);
+    out.append(text, result.ptr);
+}
+
+void appendFixed(string& out, double value, int width, int precision)  {
+    char text[352];
+    to_chars_result result = to_chars(text, text + sizeof(text), value, chars_format::fixed,
+        precision);
+    size_t length = result.ptr - text;
+    if (length < size_t(width))  {
+        out.append(width - length, ' ');
+    }
+    out.append(text, length);
+}
+
+void appendPadded(string& out, const string& text, int width, bool alignLeft)  {
+    size_t padding = text.size() < size_t(width) ? width - text.size() : 0;
+    if (!alignLeft)  {
+        out.append(padding, ' ');
+    }
+    out += text;
+    if (alignLeft)  {
+        out.append(padding, ' ');
+    }
+}
+
+bool appendToFile(const string& fileName, const string& data, bool sync)  {
+#ifdef THIN_FILM_POSIX
+    int fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)  {
+        return false;
+    }
+    bool ok = ::write(fd, data.data(), data.size()) == ssize_t(data.size());
+    if (ok && sync)  {
+        ok = fdatasync(fd) == 0;
+    }
+    return ::close(fd) == 0 && ok;
+#else
+    ofstream fout(fileName.c_str(), ios::app | ios::binary);
+    fout.write(data.data(), data.size());
+    fout.close();
+    return !fout.fail();
+#endif
+}
+
+bool replaceFile(const string& fileName, const string& data, bool sync)  {
+    string temporary = fileName + ".tmp";
+#ifdef THIN_FILM_POSIX
+    static atomic<unsigned> temporaries(0);
+    char host[64] = "";
+    gethostname(host, sizeof(host) - 1);
+    temporary += '.';
+    temporary += host;
+    temporary += '.' + to_string(getpid()) + '.' + to_string(temporaries++);
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)  {
+        return false;
+    }
+    bool ok = ::write(fd, data.data(), data.size()) == ssize_t(data.size())
+        && (!sync || fsync(fd) == 0);
+    ok = ::close(fd) == 0 && ok;
+#else
+    ofstream fout(temporary.c_str(), ios::binary);
+    fout.write(data.data(), data.size());
+    fout.close();
+    bool ok = !fout.fail();
+#endif
+    error_code error;
+    if (ok)  {
+        filesystem::rename(temporary, fileName, error);
+        ok = !error;
+    }
+    if (!ok)  {
+        filesystem::remove(temporary, error);
+    }
+    return ok;
+}
+
+double Spectrum::getspectralRange() const  {
+    if (wavelength.empty())  {
+        return 0.0;
+    }
+    return wavelength.back() - wavelength.front();
+}
+
+//reads a whole file into memory
+static bool readWholeFile(const string& fileName, string& contents)  {
+    ifstream fin(fileName.c_str(), ios::binary);
+    if (fin.fail()) {
+        return false;
+    }
+    fin.seekg(0, ios::end);
+    streamoff size = fin.tellg();
+    fin.seekg(0, ios::beg);
+    contents.resize(size < 0 ? 0 : size_t(size));
+    fin.read(&contents[0], contents.size());
+    return !fin.fail();
+}
+
+bool loadSpectrum(Spectrum& spectrum, string fileName)  {
+    spectrum.wavelength.clear();
+    spectrum.intensity.clear();
+    Stage_timer timer(STAGE_READ_SPECTRUM);
+    string contents;
+    if (!readWholeFile(fileName, contents))  {
+        return false;
+    }
+    timer.addBytes(contents.size());
+
+    if (contents.size() >= 12 && contents.compare(0, 4, "TFSP") == 0)  {
+        uint32_t version = 0;
+        uint32_t count = 0;
+        memcpy(&version, &contents[4], 4);
+        memcpy(&count, &contents[8], 4);
+        if (version != 1 || contents.size() < 12 + size_t(count) * 8)  {
+            return false;
+        }
+        vector<float> values(size_t(count) * 2);
+        memcpy(values.data(), &contents[12], values.size() * sizeof(float));
+        spectrum.wavelength.assign(values.begin(), values.begin() + count);
+        spectrum.intensity.assign(values.begin() + count, values.end());
+    }
+    else  {
+        const char* p = contents.c_str();
+        while (*p != '\0') {
+            char* end = 0;
+            double wavelength = strtod(p, &end);
+            bool ok = end != p;
+            if (ok)  {
+                p = end;
+                while (*p == ' ' || *p == '\t' || *p == ',') {
+                    p++;
+                }
+                double intensity = strtod(p, &end);
+                ok = end != p;
+                if (ok)  {
+                    p = end;
+                    spectrum.wavelength.push_back(wavelength);
+                    spectrum.intensity.push_back(intensity);
+                }
+            }
+            //skip the rest of the line
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            if (*p == '\n')  {
+                p++;
+            }
+        }
+    }
+
+    if (spectrum.wavelength.size() < 3)  {
+        return false;
+    }
+    if (spectrum.wavelength.front() > spectrum.wavelength.back())  {
+        reverse(spectrum.wavelength.begin(), spectrum.wavelength.end());
+        reverse(spectrum.intensity.begin(), spectrum.intensity.end());
+    }
+    return true;
+}
+
+Fringe_counter::Fringe_counter(int smoothing, double prominence)  {
+    this->smoothing = smoothing < 0 ? 0 : smoothing;
+    this->prominence = prominence < 0 ? 0.0 : prominence;
+}
+
+int Fringe_counter::countMaxima(const double* intensity, size_t n)  {
+    Stage_timer timer(STAGE_COUNT_FRINGES);
+    if (n < 3)  {
+        return 0;
+    }
+    if (prefix.size() < n + 1)  {
+        prefix.resize(n + 1);
+    }
+    smoothed.resize(n);
+
+    //box filter from prefix sums, the window shrinks at the edges
+    size_t half = smoothing > 0 ? size_t(smoothing) / 2 : n / 512 + 1;
+    if (2 * half + 1 > n)  {
+        half = (n - 1) / 2;
+    }
+    prefix[0] = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        prefix[i + 1] = prefix[i] + intensity[i];
+    }
+    const double* c = prefix.data();
+    double* out = smoothed.data();
+    const double scale = 1.0 / double(2 * half + 1);
+    for (size_t i = 0; i < half; i++) {
+        out[i] = (c[i + half + 1] - c[0]) / double(i + half + 1);
+    }
+    for (size_t i = half; i + half < n; i++) {
+        out[i] = (c[i + half + 1] - c[i - half]) * scale;
+    }
+    for (size_t i = n - half; i < n; i++) {
+        out[i] = (c[n] - c[i - half]) / double(n - i + half);
+    }
+
+    double low = out[0];
+    double high = out[0];
+    for (size_t i = 1; i < n; i++) {
+        low = out[i] < low ? out[i] : low;
+        high = out[i] > high ? out[i] : high;
+    }
+    const double threshold = prominence * (high - low);
+    if (threshold <= 0.0)  {
+        return 0;
+    }
+
+    //hysteresis peak detection
+    int maxima = 0;
+    bool rising = false;
+    double extreme = out[0];
+    for (size_t i = 1; i < n; i++) {
+        double value = out[i];
+        if (rising)  {
+            if (value > extreme)  {
+                extreme = value;
+            } else if (value < extreme - threshold)  {
+                maxima++;
+                rising = false;
+                extreme = value;
+            }
+        }
+        else  {
+            if (value < extreme)  {
+                extreme = value;
+            } else if (value > extreme + threshold)  {
+                rising = true;
+                extreme = value;
+            }
+        }
+    }
+    return maxima;
+}
+
+int Fringe_counter::countMaxima(const Spectrum& spectrum)  {
+    return countMaxima(spectrum.intensity.data(), spectrum.intensity.size());
+}
+
+const vector<double>& Fringe_counter::getSmoothed() const  {
+    return smoothed;
+}
+
+Fft_plan::Fft_plan(size_t size)  {
+    twiddles.resize(size / 2);
+    for (size_t i = 0; i < size / 2; i++) {
+        twiddles[i] = polar(1.0, -2.0 * M_PI * double(i) / double(size));
+    }
+    reversed.resize(size);
+    int bits = 0;
+    while ((size_t(1) << bits) < size) {
+        bits++;
+    }
+    for (size_t i = 0; i < size; i++) {
+        uint32_t r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        reversed[i] = r;
+    }
+}
+
+size_t Fft_plan::size() const  {
+    return reversed.size();
+}
+
+void Fft_plan::transform(complex<double>* data) const  {
+    size_t n = reversed.size();
+    for (size_t i = 0; i < n; i++) {
+        if (i < reversed[i])  {
+            swap(data[i], data[reversed[i]]);
+        }
+    }
+    for (size_t half = 1; half < n; half *= 2) {
+        size_t stride = n / (2 * half);
+        for (size_t start = 0; start < n; start += 2 * half) {
+            for (size_t k = 0; k < half; k++) {
+                //written out, complex operator* checks for infinities
+                const complex<double>& w = twiddles[k * stride];
+                complex<double>& upper = data[start + k + half];
+                complex<double>& lower = data[start + k];
+                double tr = w.real() * upper.real() - w.imag() * upper.imag();
+                double ti = w.real() * upper.imag() + w.imag() * upper.real();
+                upper = complex<double>(lower.real() - tr, lower.imag() - ti);
+                lower = complex<double>(lower.real() + tr, lower.imag() + ti);
+            }
+        }
+    }
+}
+
+//returns the smallest power of two not below n
+static size_t nextPowerOfTwo(size_t n)  {
+    size_t power = 1;
+    while (power < n) {
+        power *= 2;
+    }
+    return power;
+}
+
+Fft_setup::Fft_setup(const vector<double>& wavelength)
+    : wavelength(wavelength), plan(FFT_PADDING * nextPowerOfTwo(wavelength.size()))  {
+    size_t n = wavelength.size();
+    size_t points = nextPowerOfTwo(n);
+    first = 1.0 / wavelength.back();
+    step = (1.0 / wavelength.front() - first) / double(points - 1);
+    source.resize(points);
+    weight.resize(points);
+    window.resize(points);
+    //grid points run from the longest wavelength down to the shortest
+    size_t i = n - 1;
+    for (size_t j = 0; j < points; j++) {
+        double target = 1.0 / (first + j * step);
+        while (i > 0 && wavelength[i - 1] >= target) {
+            i--;
+        }
+        size_t lower = i > 0 ? i - 1 : 0;
+        double span = wavelength[lower + 1] - wavelength[lower];
+        double t = span > 0.0 ? (target - wavelength[lower]) / span : 0.0;
+        source[j] = uint32_t(lower);
+        weight[j] = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+        window[j] = 0.5 - 0.5 * cos(2.0 * M_PI * double(j) / double(points - 1));
+    }
+}
+
+shared_ptr<const Fft_setup> fftSetup(const vector<double>& wavelength)  {
+    static mutex lock;
+    static deque<shared_ptr<const Fft_setup> > cache;
+    if (wavelength.size() < 8)  {
+        return shared_ptr<const Fft_setup>();
+    }
+    lock_guard<mutex> guard(lock);
+    for (size_t i = 0; i < cache.size(); i++) {
+        if (cache[i]->wavelength == wavelength)  {
+            //the most recently used axis stays at the front
+            shared_ptr<const Fft_setup> setup = cache[i];
+            cache.erase(cache.begin() + i);
+            cache.push_front(setup);
+            return setup;
+        }
+    }
+    //the least recently used axis makes room
+    if (cache.size() == FFT_SETUP_CACHE)  {
+        cache.pop_back();
+    }
+    cache.push_front(make_shared<const Fft_setup>(wavelength));
+    return cache.front();
+}
+
+Fft_estimator::Fft_estimator()  {
+    opticalThickness = 0.0;
+}
+
+double Fft_estimator::estimate(const Spectrum& spectrum, const Thin_film& film,
+    const Dispersion_tables* tables, int pos)  {
+    Stage_timer timer(STAGE_FFT_ESTIMATE);
+    opticalThickness = 0.0;
+    if (!setup || setup->wavelength != spectrum.wavelength)  {
+        setup = fftSetup(spectrum.wavelength);
+        if (!setup)  {
+            return 0.0;
+        }
+    }
+    const Fft_setup& grid = *setup;
+    size_t points = grid.source.size();
+    size_t size = grid.plan.size();
+    buffer.assign(size, complex<double>());
+
+    //resample, remove the mean and window
+    const double* y = spectrum.intensity.data();
+    double mean = 0.0;
+    for (size_t j = 0; j < points; j++) {
+        size_t i = grid.source[j];
+        double value = y[i] + grid.weight[j] * (y[i + 1] - y[i]);
+        buffer[j] = value;
+        mean += value;
+    }
+    mean /= double(points);
+    for (size_t j = 0; j < points; j++) {
+        buffer[j] = (buffer[j].real() - mean) * grid.window[j];
+    }
+    grid.plan.transform(buffer.data());
+
+    //the window leaks DC into the first bins, the search starts past them
+    size_t lowest = 2 * FFT_PADDING;
+    size_t best = 0;
+    double bestPower = 0.0;
+    for (size_t k = lowest; k < size / 2; k++) {
+        double power = norm(buffer[k]);
+        if (power > bestPower)  {
+            bestPower = power;
+            best = k;
+        }
+    }
+    //a maximum on the first searched bin is the tail of the leakage
+    if (best <= lowest || best + 1 >= size / 2)  {
+        return 0.0;
+    }
+    double a = log(norm(buffer[best - 1]) + 1e-300);
+    double b = log(bestPower);
+    double c = log(norm(buffer[best + 1]) + 1e-300);
+    double curvature = a - 2.0 * b + c;
+    double offset = curvature < 0.0 ? 0.5 * (a - c) / curvature : 0.0;
+    double frequency = (best + offset) / (double(size) * grid.step);
+    opticalThickness = 0.5 * frequency;
+
+    //mean index over the wavenumber band
+    double index = 0.0;
+    const size_t SAMPLES = 16;
+    for (size_t j = 0; j < SAMPLES; j++) {
+        double wavelength = 1.0 / (grid.first + (points - 1) * grid.step * (j + 0.5) / SAMPLES);
+        index += tables != 0 && pos >= 0 ? tables->getIndex(pos, wavelength)
+            : film.getIndex(wavelength);
+    }
+    index /= double(SAMPLES);
+    return index > 0.0 ? opticalThickness / index : 0.0;
+}
+
+double Fft_estimator::getOpticalThickness() const  {
+    return opticalThickness;
+}
+
+//Philox4x32 round multipliers and key increments
+const uint32_t PHILOX_M0 = 0xD2511F53;
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+const int PHILOX_ROUNDS = 10;
+
+//word j of counter i goes to words[j * stride + i]
+static void philoxScalar(const uint32_t* key, uint64_t first, uint64_t stream, size_t n,
+    uint32_t* words, size_t stride)  {
+    for (size_t i = 0; i < n; i++) {
+        uint64_t counter = first + i;
+        uint32_t x0 = uint32_t(counter);
+        uint32_t x1 = uint32_t(counter >> 32);
+        uint32_t x2 = uint32_t(stream);
+        uint32_t x3 = uint32_t(stream >> 32);
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for (int round = 0; round < PHILOX_ROUNDS; round++) {
+            uint64_t p0 = uint64_t(PHILOX_M0) * x0;
+            uint64_t p1 = uint64_t(PHILOX_M1) * x2;
+            x0 = uint32_t(p1 >> 32) ^ x1 ^ k0;
+            x1 = uint32_t(p1);
+            x2 = uint32_t(p0 >> 32) ^ x3 ^ k1;
+            x3 = uint32_t(p0);
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        words[i] = x0;
+        words[stride + i] = x1;
+        words[2 * stride + i] = x2;
+        words[3 * stride + i] = x3;
+    }
+}
+
+#ifdef THIN_FILM_X86_DISPATCH
+//the low and high halves of the 32 by 32 bit products of eight lanes
+__attribute__((target("avx2")))
+static inline void mulHiLoAvx2(__m256i m, __m256i x, __m256i& lo, __m256i& hi)  {
+    __m256i even = _mm256_mul_epu32(x, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m);
+    lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+__attribute__((target("avx2")))
+static void philoxAvx2(const uint32_t* key, uint64_t first, uint64_t stream, size_t n,
+    uint32_t* words)  {
+    const __m256i m0 = _mm256_set1_epi32(int(PHILOX_M0));
+    const __m256i m1 = _mm256_set1_epi32(int(PHILOX_M1));
+    const __m256i w0 = _mm256_set1_epi32(int(PHILOX_W0));
+    const __m256i w1 = _mm256_set1_epi32(int(PHILOX_W1));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint32_t lo[8];
+        uint32_t hi[8];
+        for (int lane = 0; lane < 8; lane++) {
+            lo[lane] = uint32_t(first + i + lane);
+            hi[lane] = uint32_t((first + i + lane) >> 32);
+        }
+        __m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lo));
+        __m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hi));
+        __m256i x2 = _mm256_set1_epi32(int(uint32_t(stream)));
+        __m256i x3 = _mm256_set1_epi32(int(uint32_t(stream >> 32)));
+        __m256i k0 = _mm256_set1_epi32(int(key[0]));
+        __m256i k1 = _mm256_set1_epi32(int(key[1]));
+        for (int round = 0; round < PHILOX_ROUNDS; round++) {
+            __m256i lo0, hi0, lo1, hi1;
+            mulHiLoAvx2(m0, x0, lo0, hi0);
+            mulHiLoAvx2(m1, x2, lo1, hi1);
+            x0 = _mm256_xor_si256(_mm256_xor_si256(hi1, x1), k0);
+            x1 = lo1;
+            x2 = _mm256_xor_si256(_mm256_xor_si256(hi0, x3), k1);
+            x3 = lo0;
+            k0 = _mm256_add_epi32(k0, w0);
+            k1 = _mm256_add_epi32(k1, w1);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + i), x0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + n + i), x1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + 2 * n + i), x2);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(words + 3 * n + i), x3);
+    }
+    //the tail call is not given a vzeroupper, and dirty upper halves slow the SSE code after it
+    _mm256_zeroupper();
+    philoxScalar(key, first + i, stream, n - i, words + i, n);
+}
+#endif
+
+Counter_rng::Counter_rng(uint64_t seed)  {
+    key[0] = uint32_t(seed);
+    key[1] = uint32_t(seed >> 32);
+}
+
+void Counter_rng::generate(uint64_t first, uint64_t stream, size_t n, uint32_t* words) const  {
+#ifdef THIN_FILM_X86_DISPATCH
+    if (simdLevel >= SIMD_AVX2)  {
+        philoxAvx2(key, first, stream, n, words);
+        return;
+    }
+#endif
+    philoxScalar(key, first, stream, n, words, n);
+}
+
+double Counter_rng::uniform(uint32_t word)  {
+    return (double(word) + 0.5) * (1.0 / 4294967296.0);
+}
+
+double Counter_rng::normal(uint32_t a, uint32_t b)  {
+    return sqrt(-2.0 * log(uniform(a))) * cos(2.0 * M_PI * uniform(b));
+}
+
+Input_distribution::Input_distribution()  {
+    value = 0.0;
+    spread = 0.0;
+    shape = INPUT_FIXED;
+}
+
+bool Input_distribution::parse(const string& text, string& head)  {
+    size_t split = text.find("+-");
+    size_t width = 2;
+    shape = INPUT_NORMAL;
+    if (split == string::npos)  {
+        split = text.rfind('~');
+        width = 1;
+        shape = INPUT_UNIFORM;
+    }
+    spread = 0.0;
+    if (split == string::npos)  {
+        shape = INPUT_FIXED;
+        head = text;
+        return true;
+    }
+    head = text.substr(0, split);
+    const char* begin = text.data() + split + width;
+    return parseNumber(begin, text.data() + text.size(), spread) && spread >= 0.0;
+}
+
+double Input_distribution::sample(uint32_t a, uint32_t b) const  {
+    if (shape == INPUT_NORMAL)  {
+        return value + spread * Counter_rng::normal(a, b);
+    }
+    if (shape == INPUT_UNIFORM)  {
+        return value + spread * (2.0 * Counter_rng::uniform(a) - 1.0);
+    }
+    return value;
+}
+
+string Input_distribution::format() const  {
+    ostringstream out;
+    out << value;
+    if (shape == INPUT_NORMAL)  {
+        out << "+-" << spread;
+    } else if (shape == INPUT_UNIFORM)  {
+        out << '~' << spread;
+    }
+    return out.str();
+}
+
+shared_ptr<const Dispersion> siliconDispersion()  {
+    static shared_ptr<const Dispersion> silicon;
+    static once_flag parsed;
+    call_once(parsed, [] {
+        const char* table = "table 400 5.57 0.387 450 4.67 0.14 500 4.30 0.073 "
+            "550 4.08 0.041 600 3.95 0.025 650 3.85 0.016 700 3.78 0.011 "
+            "800 3.68 0.005 900 3.61 0.002 1000 3.57 0.0006 1100 3.54 0.0001 1200 3.52 0";
+        shared_ptr<Dispersion> dispersion = make_shared<Dispersion>();
+        Dispersion::parse(table, table + strlen(table), *dispersion);
+        silicon = dispersion;
+    });
+    return silicon;
+}
+
+void Reflectance_fit::prepare(const Spectrum& spectrum, const Thin_film& film,
+    const Dispersion_tables* tables, int pos)  {
+    prepare(spectrum.wavelength.data(), spectrum.intensity.data(), spectrum.wavelength.size(),
+        film, tables, pos);
+}
+
+void Reflectance_fit::prepare(const double* wavelengths, const double* intensities, size_t n,
+    const Thin_film& film, const Dispersion_tables* tables, int pos)  {
+    const Dispersion& silicon = *siliconDispersion();
+    intensity.assign(intensities, intensities + n);
+    ar.resize(n);
+    ai.resize(n);
+    br.resize(n);
+    bi.resize(n);
+    betaR.resize(n);
+    betaI.resize(n);
+    double shortest = n > 0 ? wavelengths[0] : 1.0;
+    double highest = 1.0;
+    for (size_t i = 0; i < n; i++) {
+        double wavelength = wavelengths[i];
+        double n1 = tables != 0 && pos >= 0 ? tables->getIndex(pos, wavelength)
+            : film.getIndex(wavelength);
+        double k1 = tables != 0 && pos >= 0 ? tables->getExtinction(pos, wavelength)
+            : film.getExtinction(wavelength);
+        double n2 = silicon.getIndex(wavelength);
+        double k2 = silicon.getExtinction(wavelength);
+        //r01 = (1 - N1) / (1 + N1)
+        double den = (1.0 + n1) * (1.0 + n1) + k1 * k1;
+        ar[i] = ((1.0 - n1) * (1.0 + n1) - k1 * k1) / den;
+        ai[i] = -2.0 * k1 / den;
+        //r12 = (N1 - N2) / (N1 + N2)
+        double sr = n1 + n2;
+        double si = k1 + k2;
+        double dr = n1 - n2;
+        double di = k1 - k2;
+        den = sr * sr + si * si;
+        br[i] = (dr * sr + di * si) / den;
+        bi[i] = (di * sr - dr * si) / den;
+        betaR[i] = 4.0 * M_PI * n1 / wavelength;
+        betaI[i] = 4.0 * M_PI * k1 / wavelength;
+        highest = n1 > highest ? n1 : highest;
+        shortest = wavelength < shortest ? wavelength : shortest;
+    }
+    fringeStep = shortest / (8.0 * highest);
+    model.resize(n);
+    slope.resize(n);
+}
+
+size_t Reflectance_fit::size() const  {
+    return intensity.size();
+}
+
+const double* Reflectance_fit::reflectance(double thickness, size_t stride, double* derivative)  {
+    size_t n = intensity.size();
+    double* out = model.data();
+    for (size_t i = 0; i < n; i += stride) {
+        //E = exp(i beta d)
+        double decay = exp(-betaI[i] * thickness);
+        double er = decay * cos(betaR[i] * thickness);
+        double ei = decay * sin(betaR[i] * thickness);
+        //B E
+        double ber = br[i] * er - bi[i] * ei;
+        double bei = br[i] * ei + bi[i] * er;
+        //numerator A + B E and denominator 1 + A B E
+        double nr = ar[i] + ber;
+        double ni = ai[i] + bei;
+        double dr = 1.0 + ar[i] * ber - ai[i] * bei;
+        double di = ar[i] * bei + ai[i] * ber;
+        double den = dr * dr + di * di;
+        double rr = (nr * dr + ni * di) / den;
+        double ri = (ni * dr - nr * di) / den;
+        out[i] = rr * rr + ri * ri;
+        if (derivative != 0)  {
+            //dr/dd = B (1 - A^2) / (1 + A B E)^2 * i beta E
+            double ur = 1.0 - (ar[i] * ar[i] - ai[i] * ai[i]);
+            double ui = -2.0 * ar[i] * ai[i];
+            double gr = br[i] * ur - bi[i] * ui;
+            double gi = br[i] * ui + bi[i] * ur;
+            double d2r = dr * dr - di * di;
+            double d2i = 2.0 * dr * di;
+            double den2 = d2r * d2r + d2i * d2i;
+            double qr = (gr * d2r + gi * d2i) / den2;
+            double qi = (gi * d2r - gr * d2i) / den2;
+            //i beta E
+            double pr = -(betaR[i] * ei + betaI[i] * er);
+            double pi = betaR[i] * er - betaI[i] * ei;
+            double sr = qr * pr - qi * pi;
+            double si = qr * pi + qi * pr;
+            //dR/dd = 2 Re(conj(r) dr/dd)
+            derivative[i] = 2.0 * (rr * sr + ri * si);
+        }
+    }
+    return out;
+}
+
+Fit_result Reflectance_fit::fit(double estimate)  {
+    double cost = 0.0;
+    return refine(scan(estimate, cost));
+}
+
+double Reflectance_fit::scan(double estimate, double& cost)  {
+    double best = estimate > 0.0 ? estimate : 0.0;
+    cost = 1e300;
+    size_t n = intensity.size();
+    if (n < 4)  {
+        return best;
+    }
+    size_t stride = n > 256 ? n / 256 : 1;
+    double low = 0.5 * best;
+    double high = 1.5 * best + 8.0 * fringeStep;
+    for (double d = low; d <= high; d += fringeStep) {
+        double scale = 0.0;
+        double offset = 0.0;
+        double next = linearResidual(intensity.data(), reflectance(d, stride), n, stride,
+            scale, offset);
+        if (next < cost && scale > 0.0)  {
+            cost = next;
+            best = d;
+        }
+    }
+    return best;
+}
+
+Fit_result Reflectance_fit::refine(double start)  {
+    Stage_timer timer(STAGE_FIT);
+    Fit_result result;
+    result.thickness = start > 0.0 ? start : 0.0;
+    result.scale = 1.0;
+    result.offset = 0.0;
+    result.residual = 0.0;
+    result.iterations = 0;
+    result.converged = false;
+    size_t n = intensity.size();
+    if (n < 4)  {
+        return result;
+    }
+
+    //Levenberg-Marquardt on thickness, scale and offset
+    const double* y = intensity.data();
+    double d = result.thickness;
+    double scale = 1.0;
+    double offset = 0.0;
+    double cost = linearResidual(intensity.data(), reflectance(d), n, 1, scale, offset) * n;
+    double lambda = 1e-3;
+    const int MAX_ITERATIONS = 50;
+    while (result.iterations < MAX_ITERATIONS) {
+        result.iterations++;
+        const double* r = reflectance(d, 1, slope.data());
+        const double* g = slope.data();
+        //normal equations J^T J x = J^T e for (d, scale, offset)
+        double jj[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+        double je[3] = { 0, 0, 0 };
+        for (size_t i = 0; i < n; i++) {
+            double jd = scale * g[i];
+            double js = r[i];
+            double e = y[i] - (scale * r[i] + offset);
+            jj[0][0] += jd * jd;
+            jj[0][1] += jd * js;
+            jj[0][2] += jd;
+            jj[1][1] += js * js;
+            jj[1][2] += js;
+            je[0] += jd * e;
+            je[1] += js * e;
+            je[2] += e;
+        }
+        jj[1][0] = jj[0][1];
+        jj[2][0] = jj[0][2];
+        jj[2][1] = jj[1][2];
+        jj[2][2] = double(n);
+
+        bool improved = false;
+        while (lambda < 1e10) {
+            double a[3][3];
+            for (int row = 0; row < 3; row++) {
+                for (int column = 0; column < 3; column++) {
+                    a[row][column] = jj[row][column];
+                }
+                a[row][row] *= 1.0 + lambda;
+            }
+            //Cramer's rule for the 3x3 step
+            double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+                - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+                + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+            if (det == 0.0)  {
+                lambda *= 10.0;
+                continue;
+            }
+            double step[3];
+            for (int column = 0; column < 3; column++) {
+                double m[3][3];
+                for (int row = 0; row < 3; row++) {
+                    for (int k = 0; k < 3; k++) {
+                        m[row][k] = k == column ? je[row] : a[row][k];
+                    }
+                }
+                step[column] = (m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                    - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                    + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+            }
+            double nextD = d + step[0] > 0.0 ? d + step[0] : 0.0;
+            double nextScale = scale + step[1];
+            double nextOffset = offset + step[2];
+            const double* next = reflectance(nextD);
+            double nextCost = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                double e = y[i] - (nextScale * next[i] + nextOffset);
+                nextCost += e * e;
+            }
+            if (nextCost < cost)  {
+                double change = cost - nextCost;
+                d = nextD;
+                scale = nextScale;
+                offset = nextOffset;
+                cost = nextCost;
+                lambda = lambda * 0.1 > 1e-12 ? lambda * 0.1 : 1e-12;
+                improved = true;
+                if (change <= 1e-12 * cost || fabs(step[0]) < 1e-6)  {
+                    result.converged = true;
+                }
+                break;
+            }
+            lambda *= 10.0;
+        }
+        if (!improved)  {
+            result.converged = true;
+        }
+        if (result.converged)  {
+            break;
+        }
+    }
+    result.thickness = d;
+    result.scale = scale;
+    result.offset = offset;
+    result.residual = sqrt(cost / n);
+    return result;
+}
+
+double linearResidual(const double* intensity, const double* model, size_t count,
+    size_t stride, double& scale, double& offset)  {
+    double samples = 0.0;
+    double sumR = 0.0;
+    double sumY = 0.0;
+    double sumRR = 0.0;
+    double sumRY = 0.0;
+    double sumYY = 0.0;
+    for (size_t i = 0; i < count; i += stride) {
+        samples += 1.0;
+        sumR += model[i];
+        sumY += intensity[i];
+        sumRR += model[i] * model[i];
+        sumRY += model[i] * intensity[i];
+        sumYY += intensity[i] * intensity[i];
+    }
+    double det = samples * sumRR - sumR * sumR;
+    if (det <= 0.0 || samples == 0.0)  {
+        scale = 1.0;
+        offset = 0.0;
+        return 1e300;
+    }
+    scale = (samples * sumRY - sumR * sumY) / det;
+    offset = (sumY - scale * sumR) / samples;
+    double cost = sumYY - 2.0 * scale * sumRY - 2.0 * offset * sumY
+        + scale * scale * sumRR + 2.0 * scale * offset * sumR + offset * offset * samples;
+    return cost / samples;
+}
+
+bool solveLinear(vector<double>& a, vector<double>& b, size_t n)  {
+    for (size_t column = 0; column < n; column++) {
+        size_t pivot = column;
+        for (size_t row = column + 1; row < n; row++) {
+            if (fabs(a[row * n + column]) > fabs(a[pivot * n + column]))  {
+                pivot = row;
+            }
+        }
+        if (a[pivot * n + column] == 0.0)  {
+            return false;
+        }
+        if (pivot != column)  {
+            for (size_t k = 0; k < n; k++) {
+                swap(a[pivot * n + k], a[column * n + k]);
+            }
+            swap(b[pivot], b[column]);
+        }
+        for (size_t row = column + 1; row < n; row++) {
+            double factor = a[row * n + column] / a[column * n + column];
+            for (size_t k = column; k < n; k++) {
+                a[row * n + k] -= factor * a[column * n + k];
+            }
+            b[row] -= factor * b[column];
+        }
+    }
+    for (size_t row = n; row-- > 0;) {
+        double sum = b[row];
+        for (size_t k = row + 1; k < n; k++) {
+            sum -= a[row * n + k] * b[k];
+        }
+        b[row] = sum / a[row * n + row];
+    }
+    return true;
+}
+
+bool Fit_key::operator==(const Fit_key& other) const  {
+    return spectrum == other.spectrum && check == other.check && model == other.model;
+}
+
+size_t Fit_cache::Key_hash::operator()(const Fit_key& key) const  {
+    return size_t(key.spectrum ^ key.model * 0x9E3779B97F4A7C15ull);
+}
+
+//mixes one 64-bit word into a hash
+static uint64_t mixHash(uint64_t hash, uint64_t word, uint64_t multiplier)  {
+    hash = (hash ^ word) * multiplier;
+    return hash ^ (hash >> 29);
+}
+
+//mixes the bits of a double into a hash
+static uint64_t mixHash(uint64_t hash, double value, uint64_t multiplier)  {
+    uint64_t word = 0;
+    memcpy(&word, &value, sizeof(word));
+    return mixHash(hash, word, multiplier);
+}
+
+//mixes the bytes of a string into an FNV-1a hash
+static uint64_t mixHash(uint64_t hash, const string& text)  {
+    for (char c : text) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return (hash ^ 0xFF) * 1099511628211ull;
+}
+
+Fit_cache::Fit_cache(size_t capacity) : fileLoaded(false)  {
+    memory.setCapacity(capacity);
+}
+
+void Fit_cache::setCapacity(size_t capacity)  {
+    lock_guard<mutex> guard(lock);
+    memory.setCapacity(capacity);
+}
+
+void Fit_cache::setFile(const string& fileName)  {
+    lock_guard<mutex> guard(lock);
+    this->fileName = fileName;
+    fileLoaded = false;
+    disk.setCapacity(0);
+}
+
+Fit_key Fit_cache::makeKey(const double* wavelength, const double* intensity, size_t n,
+    const Thin_film& film, const Dispersion_tables* tables, int pos)  {
+    const uint64_t FIRST = 0x9E3779B97F4A7C15ull;
+    const uint64_t SECOND = 0xC2B2AE3D27D4EB4Full;
+    Fit_key key;
+    key.spectrum = mixHash(FIRST, uint64_t(n), FIRST);
+    key.check = mixHash(SECOND, uint64_t(n), SECOND);
+    for (size_t i = 0; i < n; i++) {
+        key.spectrum = mixHash(key.spectrum, wavelength[i], FIRST);
+        key.check = mixHash(key.check, wavelength[i], SECOND);
+    }
+    for (size_t i = 0; i < n; i++) {
+        key.spectrum = mixHash(key.spectrum, intensity[i], FIRST);
+        key.check = mixHash(key.check, intensity[i], SECOND);
+    }
+    uint64_t model = mixHash(14695981039346656037ull, film.getMat());
+    model = mixHash(model, uint64_t(FITTER_VERSION), FIRST);
+    if (film.getDispersion())  {
+        const vector<double>& coefficients = film.getDispersion()->getCoefficients();
+        model = mixHash(model, uint64_t(film.getDispersion()->getModel()) + 1, FIRST);
+        model = mixHash(model, uint64_t(coefficients.size()), FIRST);
+        for (double coefficient : coefficients) {
+            model = mixHash(model, coefficient, FIRST);
+        }
+    }
+    model = mixHash(model, film.getIndex(), FIRST);
+    model = mixHash(model, double(film.getspectralRange()), FIRST);
+    model = mixHash(model, film.getThickness(), FIRST);
+    if (tables && pos >= 0)  {
+        const Wavelength_grid& grid = tables->getGrid();
+        model = mixHash(model, grid.first, FIRST);
+        model = mixHash(model, grid.step, FIRST);
+        model = mixHash(model, uint64_t(grid.count), FIRST);
+    }
+    key.model = model;
+    return key;
+}
+
+Fit_cache::Fit_table::Fit_table() : capacity(0), used(0), newest(NONE), oldest(NONE)  {
+}
+
+void Fit_cache::Fit_table::setCapacity(size_t capacity)  {
+    this->capacity = min(capacity, size_t(NONE - 1));
+    entries.clear();
+    slots.clear();
+    used = 0;
+    newest = NONE;
+    oldest = NONE;
+}
+
+size_t Fit_cache::Fit_table::size() const  {
+    return used;
+}
+
+size_t Fit_cache::Fit_table::probe(const Fit_key& key) const  {
+    size_t mask = slots.size() - 1;
+    size_t i = Key_hash()(key) & mask;
+    while (slots[i] != 0 && !(entries[slots[i] - 1].key == key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void Fit_cache::Fit_table::unindex(uint32_t entry)  {
+    size_t mask = slots.size() - 1;
+    size_t hole = probe(entries[entry].key);
+    slots[hole] = 0;
+    for (size_t i = (hole + 1) & mask; slots[i] != 0; i = (i + 1) & mask) {
+        size_t home = Key_hash()(entries[slots[i] - 1].key) & mask;
+        //moves the slot into the hole unless its probe starts after the hole
+        if (((i - home) & mask) >= ((i - hole) & mask))  {
+            slots[hole] = slots[i];
+            slots[i] = 0;
+            hole = i;
+        }
+    }
+}
+
+void Fit_cache::Fit_table::unlink(uint32_t entry)  {
+    Entry& e = entries[entry];
+    if (e.newer != NONE)  {
+        entries[e.newer].older = e.older;
+    } else  {
+        newest = e.older;
+    }
+    if (e.older != NONE)  {
+        entries[e.older].newer = e.newer;
+    } else  {
+        oldest = e.newer;
+    }
+}
+
+void Fit_cache::Fit_table::pushNewest(uint32_t entry)  {
+    entries[entry].newer = NONE;
+    entries[entry].older = newest;
+    if (newest != NONE)  {
+        entries[newest].newer = entry;
+    } else  {
+        oldest = entry;
+    }
+    newest = entry;
+}
+
+bool Fit_cache::Fit_table::find(const Fit_key& key, Fit_result& result)  {
+    if (slots.empty())  {
+        return false;
+    }
+    size_t slot = probe(key);
+    if (slots[slot] == 0)  {
+        return false;
+    }
+    uint32_t entry = slots[slot] - 1;
+    unlink(entry);
+    pushNewest(entry);
+    result = entries[entry].result;
+    return true;
+}
+
+bool Fit_cache::Fit_table::insert(const Fit_key& key, const Fit_result& result)  {
+    if (capacity == 0)  {
+        return false;
+    }
+    if (slots.empty())  {
+        size_t size = 16;
+        while (size < 2 * capacity) {
+            size *= 2;
+        }
+        entries.resize(capacity);
+        slots.assign(size, 0);
+    }
+    size_t slot = probe(key);
+    uint32_t entry = 0;
+    bool evicted = false;
+    if (slots[slot] != 0)  {
+        entry = slots[slot] - 1;
+        unlink(entry);
+    } else  {
+        if (used < capacity)  {
+            entry = uint32_t(used++);
+        } else  {
+            entry = oldest;
+            unlink(entry);
+            unindex(entry);
+            evicted = true;
+            slot = probe(key);
+        }
+        entries[entry].key = key;
+        slots[slot] = entry + 1;
+    }
+    entries[entry].result = result;
+    pushNewest(entry);
+    return evicted;
+}
+
+template <class Visitor>
+void Fit_cache::Fit_table::visit(Visitor visitor) const  {
+    for (uint32_t entry = oldest; entry != NONE; entry = entries[entry].newer) {
+        visitor(entries[entry].key, entries[entry].result);
+    }
+}
+
+void Fit_cache::formatLine(string& line, const Fit_key& key, const Fit_result& result)  {
+    char hex[64];
+    snprintf(hex, sizeof(hex), "%016llx %016llx %016llx ", (unsigned long long)key.spectrum,
+        (unsigned long long)key.check, (unsigned long long)key.model);
+    line += hex;
+    appendShortest(line, result.thickness);
+    line += ' ';
+    appendShortest(line, result.scale);
+    line += ' ';
+    appendShortest(line, result.offset);
+    line += ' ';
+    appendShortest(line, result.residual);
+    line += ' ' + to_string(result.iterations) + ' ' + (result.converged ? '1' : '0');
+    line += '\n';
+}
+
+string Fit_cache::formatHeader()  {
+    return "TFFITCACHE 1 " + to_string(FITTER_VERSION) + '\n';
+}
+
+long Fit_cache::parseFile(const string& contents)  {
+    disk.setCapacity(FIT_CACHE_DISK_ENTRIES);
+    string header = formatHeader();
+    if (contents.compare(0, header.size(), header) != 0)  {
+        return -1;
+    }
+    long lines = 0;
+    const char* next = contents.data() + header.size();
+    const char* end = contents.data() + contents.size();
+    while (next < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(next, '\n', end - next));
+        if (lineEnd == 0)  {
+            //a line another process is still appending
+            break;
+        }
+        const char* fields[9];
+        const char* fieldEnds[9];
+        size_t count = 0;
+        for (const char* c = next; c < lineEnd && count < 9; ) {
+            while (c < lineEnd && *c == ' ') {
+                c++;
+            }
+            if (c == lineEnd)  {
+                break;
+            }
+            fields[count] = c;
+            while (c < lineEnd && *c != ' ') {
+                c++;
+            }
+            fieldEnds[count++] = c;
+        }
+        Fit_key key;
+        Fit_result result;
+        double iterations = 0.0;
+        double converged = 0.0;
+        bool ok = count == 9;
+        uint64_t* words[3] = { &key.spectrum, &key.check, &key.model };
+        for (size_t i = 0; ok && i < 3; i++) {
+            unsigned long long word = 0;
+            from_chars_result parsed = from_chars(fields[i], fieldEnds[i], word, 16);
+            ok = parsed.ptr == fieldEnds[i] && parsed.ec == errc();
+            *words[i] = word;
+        }
+        ok = ok && parseNumber(fields[3], fieldEnds[3], result.thickness)
+            && parseNumber(fields[4], fieldEnds[4], result.scale)
+            && parseNumber(fields[5], fieldEnds[5], result.offset)
+            && parseNumber(fields[6], fieldEnds[6], result.residual)
+            && parseNumber(fields[7], fieldEnds[7], iterations)
+            && parseNumber(fields[8], fieldEnds[8], converged);
+        if (ok)  {
+            result.iterations = int(iterations);
+            result.converged = converged != 0.0;
+            disk.insert(key, result);
+            lines++;
+        }
+        next = lineEnd + 1;
+    }
+    return lines;
+}
+
+void Fit_cache::loadFile()  {
+    fileLoaded = true;
+    string contents;
+    {
+        File_lock shared(fileName + ".lock", false);
+        if (!readWholeFile(fileName, contents))  {
+            disk.setCapacity(FIT_CACHE_DISK_ENTRIES);
+            return;
+        }
+    }
+    long lines = parseFile(contents);
+    if (lines >= 0 && size_t(lines) <= 2 * disk.size() + 64)  {
+        return;
+    }
+    //read again under the lock, so lines appended since are kept
+    File_lock exclusive(fileName + ".lock");
+    contents.clear();
+    if (!exclusive.isLocked() || !readWholeFile(fileName, contents))  {
+        return;
+    }
+    //a file of another version is dropped
+    parseFile(contents);
+    string compacted = formatHeader();
+    disk.visit([&](const Fit_key& key, const Fit_result& result) {
+        formatLine(compacted, key, result);
+    });
+    replaceFile(fileName, compacted, false);
+}
+
+bool Fit_cache::find(const Fit_key& key, Fit_result& result)  {
+    lock_guard<mutex> guard(lock);
+    if (memory.find(key, result))  {
+        recordCacheEvent(CACHE_HIT);
+        return true;
+    }
+    if (!fileName.empty())  {
+        if (!fileLoaded)  {
+            loadFile();
+        }
+        if (disk.find(key, result))  {
+            if (memory.insert(key, result))  {
+                recordCacheEvent(CACHE_EVICTION);
+            }
+            recordCacheEvent(CACHE_HIT);
+            recordCacheEvent(CACHE_DISK_HIT);
+            return true;
+        }
+    }
+    recordCacheEvent(CACHE_MISS);
+    return false;
+}
+
+void Fit_cache::store(const Fit_key& key, const Fit_result& result)  {
+    string name;
+    {
+        lock_guard<mutex> guard(lock);
+        if (memory.insert(key, result))  {
+            recordCacheEvent(CACHE_EVICTION);
+        }
+        Fit_result known;
+        if (fileName.empty() || disk.find(key, known))  {
+            return;
+        }
+        disk.insert(key, result);
+        name = fileName;
+    }
+    //the line is formatted and appended without holding up other lookups
+    static thread_local string line;
+    line.clear();
+    formatLine(line, key, result);
+#ifdef THIN_FILM_POSIX
+    //shared with the other appenders, a compaction excludes them all; the
+    //file is opened under the lock, so it is never one a compaction replaced
+    File_lock shared(name + ".lock", false);
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)  {
+        return;
+    }
+    struct stat status;
+    if (fstat(fd, &status) == 0 && status.st_size == 0)  {
+        line.insert(0, formatHeader());
+    }
+    ssize_t written = write(fd, line.data(), line.size());
+    (void)written;
+    close(fd);
+#else
+    bool created = !filesystem::exists(name);
+    ofstream out(name.c_str(), ios::app | ios::binary);
+    if (created)  {
+        out << formatHeader();
+    }
+    out.write(line.data(), line.size());
+#endif
+}
+
+Fit_cache& fitCache()  {
+    static Fit_cache cache;
+    return cache;
+}
+
+Fit_result cachedFit(Reflectance_fit& fitter, const Spectrum& spectrum, const Thin_film& film,
+    const Dispersion_tables* tables, int pos)  {
+    return cachedFit(fitter, spectrum.wavelength.data(), spectrum.intensity.data(),
+        spectrum.wavelength.size(), film, tables, pos);
+}
+
+Fit_result cachedFit(Reflectance_fit& fitter, const double* wavelength, const double* intensity,
+    size_t n, const Thin_film& film, const Dispersion_tables* tables, int pos)  {
+    Fit_cache& cache = fitCache();
+    Fit_key key = Fit_cache::makeKey(wavelength, intensity, n, film, tables, pos);
+    Fit_result result;
+    if (cache.find(key, result))  {
+        return result;
+    }
+    fitter.prepare(wavelength, intensity, n, film, tables, pos);
+    result = fitter.fit(film.getThickness());
+    cache.store(key, result);
+    return result;
+}
+
+Film_stack::Film_stack()  {
+    prefixValid = 0;
+    suffixValid = 0;
+    split = 0;
+}
+
+void Film_stack::addLayer(const Thin_film& film, double thickness,
+    const Dispersion_tables* tables, int pos)  {
+    Stack_layer layer;
+    layer.film = film;
+    layer.thickness = thickness > 0.0 ? thickness : 0.0;
+    layer.tables = tables;
+    layer.pos = pos;
+    layer.fringeStep = 1.0;
+    layers.push_back(layer);
+}
+
+void Film_stack::prepare(const vector<double>& wavelength)  {
+    const Dispersion& silicon = *siliconDispersion();
+    size_t n = wavelength.size();
+    this->wavelength = wavelength;
+    substrate.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        substrate[i] = complex<double>(silicon.getIndex(wavelength[i]),
+            silicon.getExtinction(wavelength[i]));
+    }
+    double shortest = n > 0 ? *min_element(wavelength.begin(), wavelength.end()) : 1.0;
+    for (unsigned j = 0; j < layers.size(); j++) {
+        Stack_layer& layer = layers[j];
+        bool tabulated = layer.tables != 0 && layer.pos >= 0;
+        layer.index.resize(n);
+        layer.phase.resize(n);
+        double highest = 1.0;
+        for (size_t i = 0; i < n; i++) {
+            double n1 = tabulated ? layer.tables->getIndex(layer.pos, wavelength[i])
+                : layer.film.getIndex(wavelength[i]);
+            double k1 = tabulated ? layer.tables->getExtinction(layer.pos, wavelength[i])
+                : layer.film.getExtinction(wavelength[i]);
+            layer.index[i] = complex<double>(n1, k1);
+            layer.phase[i] = 2.0 * M_PI * layer.index[i] / wavelength[i];
+            highest = n1 > highest ? n1 : highest;
+        }
+        layer.fringeStep = shortest / (8.0 * highest);
+        layer.p00.assign(n, 1.0);
+        layer.p01.assign(n, 0.0);
+        layer.p10.assign(n, 0.0);
+        layer.p11.assign(n, 1.0);
+        layer.sb.assign(n, 1.0);
+        layer.sc = substrate;
+        layer.derivative.assign(n, 0.0);
+        updateLayer(layer);
+    }
+    model.resize(n);
+    //only the products without layers, above the top and below the bottom, are known
+    prefixValid = 0;
+    suffixValid = layers.empty() ? 0 : layers.size() - 1;
+    split = 0;
+}
+
+size_t Film_stack::getLayerCount() const  {
+    return layers.size();
+}
+
+const Thin_film& Film_stack::getFilm(size_t layer) const  {
+    return layers[layer].film;
+}
+
+double Film_stack::getThickness(size_t layer) const  {
+    return layers[layer].thickness;
+}
+
+void Film_stack::setThickness(size_t layer, double thickness)  {
+    thickness = thickness > 0.0 ? thickness : 0.0;
+    if (layers[layer].thickness == thickness)  {
+        return;
+    }
+    layers[layer].thickness = thickness;
+    updateLayer(layers[layer]);
+    prefixValid = prefixValid < layer ? prefixValid : layer;
+    suffixValid = suffixValid > layer ? suffixValid : layer;
+    split = layer;
+}
+
+void Film_stack::updateLayer(Stack_layer& layer)  {
+    size_t n = wavelength.size();
+    const complex<double> minusI(0.0, -1.0);
+    layer.cosine.resize(n);
+    layer.sine.resize(n);
+    layer.m01.resize(n);
+    layer.m10.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        complex<double> delta = layer.phase[i] * layer.thickness;
+        layer.cosine[i] = cos(delta);
+        layer.sine[i] = sin(delta);
+        layer.m01[i] = minusI * layer.sine[i] / layer.index[i];
+        layer.m10[i] = minusI * layer.index[i] * layer.sine[i];
+    }
+}
+
+void Film_stack::extendPrefix(size_t layer)  {
+    size_t n = wavelength.size();
+    for (size_t j = prefixValid + 1; j <= layer; j++) {
+        const Stack_layer& above = layers[j - 1];
+        Stack_layer& current = layers[j];
+        for (size_t i = 0; i < n; i++) {
+            //P_j = P_j-1 M_j-1
+            complex<double> c = above.cosine[i];
+            current.p00[i] = above.p00[i] * c + above.p01[i] * above.m10[i];
+            current.p01[i] = above.p00[i] * above.m01[i] + above.p01[i] * c;
+            current.p10[i] = above.p10[i] * c + above.p11[i] * above.m10[i];
+            current.p11[i] = above.p10[i] * above.m01[i] + above.p11[i] * c;
+        }
+    }
+    prefixValid = layer > prefixValid ? layer : prefixValid;
+}
+
+void Film_stack::extendSuffix(size_t layer)  {
+    size_t n = wavelength.size();
+    for (size_t j = suffixValid; j-- > layer;) {
+        const Stack_layer& below = layers[j + 1];
+        Stack_layer& current = layers[j];
+        for (size_t i = 0; i < n; i++) {
+            //S_j = M_j+1 S_j+1
+            current.sb[i] = below.cosine[i] * below.sb[i] + below.m01[i] * below.sc[i];
+            current.sc[i] = below.m10[i] * below.sb[i] + below.cosine[i] * below.sc[i];
+        }
+    }
+    suffixValid = layer < suffixValid ? layer : suffixValid;
+}
+
+const double* Film_stack::reflectance(bool derivatives)  {
+    size_t n = wavelength.size();
+    if (layers.empty())  {
+        for (size_t i = 0; i < n; i++) {
+            model[i] = norm((1.0 - substrate[i]) / (1.0 + substrate[i]));
+        }
+        return model.data();
+    }
+    if (derivatives)  {
+        extendPrefix(layers.size() - 1);
+        extendSuffix(0);
+    } else  {
+        extendPrefix(split);
+        extendSuffix(split);
+    }
+    const Stack_layer& middle = layers[split];
+    const complex<double> minusI(0.0, -1.0);
+    for (size_t i = 0; i < n; i++) {
+        //[B; C] = P M S at the split layer
+        complex<double> mb = middle.cosine[i] * middle.sb[i] + middle.m01[i] * middle.sc[i];
+        complex<double> mc = middle.m10[i] * middle.sb[i] + middle.cosine[i] * middle.sc[i];
+        complex<double> b = middle.p00[i] * mb + middle.p01[i] * mc;
+        complex<double> c = middle.p10[i] * mb + middle.p11[i] * mc;
+        complex<double> sum = b + c;
+        complex<double> r = (b - c) / sum;
+        model[i] = norm(r);
+        if (derivatives)  {
+            complex<double> scale = 2.0 / (sum * sum);
+            for (unsigned j = 0; j < layers.size(); j++) {
+                Stack_layer& layer = layers[j];
+                //dM/dd S = 2 pi N / l [-sin sb - i cos sc / N; -i N cos sb - sin sc]
+                complex<double> cosine = layer.cosine[i];
+                complex<double> sine = layer.sine[i];
+                complex<double> db = layer.phase[i] * (-sine * layer.sb[i]
+                    + minusI * cosine * layer.sc[i] / layer.index[i]);
+                complex<double> dc = layer.phase[i] * (minusI * layer.index[i] * cosine
+                    * layer.sb[i] - sine * layer.sc[i]);
+                complex<double> dB = layer.p00[i] * db + layer.p01[i] * dc;
+                complex<double> dC = layer.p10[i] * db + layer.p11[i] * dc;
+                //dr/dd = 2 (C dB - B dC) / (B + C)^2 and dR/dd = 2 Re(conj(r) dr/dd)
+                complex<double> dr = scale * (c * dB - b * dC);
+                layer.derivative[i] = 2.0 * real(conj(r) * dr);
+            }
+        }
+    }
+    return model.data();
+}
+
+const double* Film_stack::getDerivative(size_t layer) const  {
+    return layers[layer].derivative.data();
+}
+
+double Film_stack::getFringeStep(size_t layer) const  {
+    return layers[layer].fringeStep;
+}
+
+size_t Film_stack::size() const  {
+    return wavelength.size();
+}
+
+void Stack_fit::prepare(const Spectrum& spectrum, const Film_stack& stack)  {
+    size_t n = spectrum.wavelength.size();
+    size_t stride = n > 256 ? n / 256 : 1;
+    intensity = spectrum.intensity;
+    vector<double> sampled;
+    coarseIntensity.clear();
+    for (size_t i = 0; i < n; i += stride) {
+        sampled.push_back(spectrum.wavelength[i]);
+        coarseIntensity.push_back(spectrum.intensity[i]);
+    }
+    this->stack = stack;
+    this->stack.prepare(spectrum.wavelength);
+    coarse = stack;
+    coarse.prepare(sampled);
+}
+
+Stack_fit_result Stack_fit::fit()  {
+    Stage_timer timer(STAGE_FIT);
+    Stack_fit_result result;
+    size_t layerCount = stack.getLayerCount();
+    size_t n = intensity.size();
+    for (size_t j = 0; j < layerCount; j++) {
+        result.thickness.push_back(stack.getThickness(j));
+    }
+    result.scale = 1.0;
+    result.offset = 0.0;
+    result.residual = 0.0;
+    result.iterations = 0;
+    result.converged = false;
+    if (n < layerCount + 4)  {
+        return result;
+    }
+
+    //scan the thicknesses around the estimates on the subsample. Small stacks
+    //are scanned on the full grid with the bottom layer varying fastest, so
+    //most steps change only that layer; larger ones one layer at a time
+    vector<double> low(layerCount);
+    vector<size_t> steps(layerCount);
+    double combinations = 1.0;
+    for (size_t j = 0; j < layerCount; j++) {
+        low[j] = 0.5 * result.thickness[j];
+        double high = 1.5 * result.thickness[j] + 8.0 * coarse.getFringeStep(j);
+        steps[j] = size_t((high - low[j]) / coarse.getFringeStep(j)) + 1;
+        combinations *= steps[j];
+    }
+    const double MAX_GRID = 65536;
+    double bestCost = 1e300;
+    if (combinations <= MAX_GRID)  {
+        vector<size_t> position(layerCount, 0);
+        vector<double> best(result.thickness);
+        for (size_t j = 0; j < layerCount; j++) {
+            coarse.setThickness(j, low[j]);
+        }
+        while (true) {
+            double scale = 0.0;
+            double offset = 0.0;
+            double cost = linearResidual(coarseIntensity.data(), coarse.reflectance(),
+                coarseIntensity.size(), 1, scale, offset);
+            if (cost < bestCost && scale > 0.0)  {
+                bestCost = cost;
+                for (size_t j = 0; j < layerCount; j++) {
+                    best[j] = coarse.getThickness(j);
+                }
+            }
+            size_t j = layerCount;
+            while (j-- > 0 && ++position[j] == steps[j]) {
+                position[j] = 0;
+                coarse.setThickness(j, low[j]);
+            }
+            if (j == size_t(-1))  {
+                break;
+            }
+            coarse.setThickness(j, low[j] + position[j] * coarse.getFringeStep(j));
+        }
+        result.thickness = best;
+    } else  {
+        const int PASSES = 4;
+        for (int pass = 0; pass < PASSES; pass++) {
+            for (size_t j = 0; j < layerCount; j++) {
+                double best = result.thickness[j];
+                for (size_t k = 0; k < steps[j]; k++) {
+                    double d = low[j] + k * coarse.getFringeStep(j);
+                    coarse.setThickness(j, d);
+                    double scale = 0.0;
+                    double offset = 0.0;
+                    double cost = linearResidual(coarseIntensity.data(), coarse.reflectance(),
+                        coarseIntensity.size(), 1, scale, offset);
+                    if (cost < bestCost && scale > 0.0)  {
+                        bestCost = cost;
+                        best = d;
+                    }
+                }
+                coarse.setThickness(j, best);
+                result.thickness[j] = best;
+            }
+        }
+    }
+
+    //Levenberg-Marquardt on every thickness, scale and offset
+    const double* y = intensity.data();
+    for (size_t j = 0; j < layerCount; j++) {
+        stack.setThickness(j, result.thickness[j]);
+    }
+    double scale = 1.0;
+    double offset = 0.0;
+    double cost = linearResidual(y, stack.reflectance(), n, 1, scale, offset) * n;
+    size_t unknowns = layerCount + 2;
+    vector<double> jj(unknowns * unknowns);
+    vector<double> je(unknowns);
+    vector<double> row(unknowns);
+    vector<double> a;
+    vector<double> step;
+    vector<double> previous(layerCount);
+    double lambda = 1e-3;
+    const int MAX_ITERATIONS = 50;
+    while (result.iterations < MAX_ITERATIONS) {
+        result.iterations++;
+        const double* r = stack.reflectance(true);
+        //normal equations J^T J x = J^T e for (thicknesses, scale, offset)
+        fill(jj.begin(), jj.end(), 0.0);
+        fill(je.begin(), je.end(), 0.0);
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < layerCount; j++) {
+                row[j] = scale * stack.getDerivative(j)[i];
+            }
+            row[layerCount] = r[i];
+            row[layerCount + 1] = 1.0;
+            double e = y[i] - (scale * r[i] + offset);
+            for (size_t p = 0; p < unknowns; p++) {
+                for (size_t q = p; q < unknowns; q++) {
+                    jj[p * unknowns + q] += row[p] * row[q];
+                }
+                je[p] += row[p] * e;
+            }
+        }
+        for (size_t p = 0; p < unknowns; p++) {
+            for (size_t q = 0; q < p; q++) {
+                jj[p * unknowns + q] = jj[q * unknowns + p];
+            }
+        }
+
+        bool improved = false;
+        while (lambda < 1e10) {
+            a = jj;
+            step = je;
+            for (size_t p = 0; p < unknowns; p++) {
+                a[p * unknowns + p] *= 1.0 + lambda;
+            }
+            if (!solveLinear(a, step, unknowns))  {
+                lambda *= 10.0;
+                continue;
+            }
+            double largest = 0.0;
+            for (size_t j = 0; j < layerCount; j++) {
+                previous[j] = stack.getThickness(j);
+                stack.setThickness(j, previous[j] + step[j]);
+                largest = fabs(step[j]) > largest ? fabs(step[j]) : largest;
+            }
+            double nextScale = scale + step[layerCount];
+            double nextOffset = offset + step[layerCount + 1];
+            const double* next = stack.reflectance();
+            double nextCost = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                double e = y[i] - (nextScale * next[i] + nextOffset);
+                nextCost += e * e;
+            }
+            if (nextCost < cost)  {
+                double change = cost - nextCost;
+                scale = nextScale;
+                offset = nextOffset;
+                cost = nextCost;
+                lambda = lambda * 0.1 > 1e-12 ? lambda * 0.1 : 1e-12;
+                improved = true;
+                if (change <= 1e-12 * cost || largest < 1e-6)  {
+                    result.converged = true;
+                }
+                break;
+            }
+            for (size_t j = 0; j < layerCount; j++) {
+                stack.setThickness(j, previous[j]);
+            }
+            lambda *= 10.0;
+        }
+        if (!improved)  {
+            result.converged = true;
+        }
+        if (result.converged)  {
+            break;
+        }
+    }
+    for (size_t j = 0; j < layerCount; j++) {
+        result.thickness[j] = stack.getThickness(j);
+    }
+    result.scale = scale;
+    result.offset = offset;
+    result.residual = sqrt(cost / n);
+    return result;
+}
+
+Work_pool::Work_pool(unsigned threads) : queues(threads > 0 ? threads
+    : (thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1))  {
+    task = 0;
+    failing = false;
+    generation = 0;
+    busy = 0;
+    stopping = false;
+    for (unsigned worker = 1; worker < queues.size(); worker++) {
+        this->threads.push_back(thread(&Work_pool::loop, this, worker));
+    }
+}
+
+Work_pool::~Work_pool()  {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (unsigned i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+unsigned Work_pool::size() const  {
+    return queues.size();
+}
+
+void Work_pool::run(size_t count, const function<void(size_t, unsigned)>& task)  {
+    size_t workers = queues.size();
+    for (size_t worker = 0; worker < workers; worker++) {
+        lock_guard<mutex> guard(queues[worker].lock);
+        for (size_t item = count * worker / workers; item < count * (worker + 1) / workers; item++) {
+            queues[worker].items.push_back(item);
+        }
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        this->task = &task;
+        busy = workers;
+        generation++;
+    }
+    wake.notify_all();
+    work(0);
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [this] { return busy == 0; });
+    this->task = 0;
+    if (failure)  {
+        exception_ptr thrown = failure;
+        failure = exception_ptr();
+        failing = false;
+        rethrow_exception(thrown);
+    }
+}
+
+void Work_pool::work(unsigned worker)  {
+    size_t item = 0;
+    while (take(worker, item)) {
+        if (failing.load(memory_order_relaxed))  {
+            continue;
+        }
+        try  {
+            (*task)(item, worker);
+        } catch (...)  {
+            //an exception must not leave a worker thread, run() throws it
+            failing = true;
+            lock_guard<mutex> guard(lock);
+            if (!failure)  {
+                failure = current_exception();
+            }
+        }
+    }
+    lock_guard<mutex> guard(lock);
+    if (--busy == 0)  {
+        done.notify_all();
+    }
+}
+
+bool Work_pool::take(unsigned worker, size_t& item)  {
+    {
+        lock_guard<mutex> guard(queues[worker].lock);
+        if (!queues[worker].items.empty())  {
+            item = queues[worker].items.back();
+            queues[worker].items.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        Work_queue& victim = queues[(worker + i) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.items.empty())  {
+            item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Work_pool::loop(unsigned worker)  {
+    unsigned seen = 0;
+    while (true) {
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [this, seen] { return stopping || generation != seen; });
+            if (stopping)  {
+                return;
+            }
+            seen = generation;
+        }
+        work(worker);
+    }
+}
+
+Film_server::Film_server(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables) : materialList(materialList), filmIndex(filmIndex),
+    tables(tables)  {
+    listener = -1;
+    tcp = false;
+    error_code error;
+    spectrumDirectory = filesystem::canonical(filesystem::current_path(error), error);
+}
+
+Film_server::~Film_server()  {
+#ifdef THIN_FILM_POSIX
+    if (listener >= 0)  {
+        close(listener);
+    }
+    if (!socketPath.empty())  {
+        unlink(socketPath.c_str());
+    }
+#endif
+}
+
+bool Film_server::listen(const string& address)  {
+#ifdef THIN_FILM_POSIX
+    size_t colon = address.rfind(':');
+    if (address.find('/') != string::npos || colon == string::npos)  {
+        sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(local.sun_path))  {
+            cerr << "The socket path " << address << " is too long.\n";
+            return false;
+        }
+        strcpy(local.sun_path, address.c_str());
+        //a socket left behind by an earlier server is replaced
+        struct stat status;
+        if (lstat(address.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))  {
+            unlink(address.c_str());
+        }
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (sockaddr*)&local, sizeof(local)) != 0
+            || ::listen(listener, SOMAXCONN) != 0)  {
+            cerr << "Cannot listen on " << address << ": " << strerror(errno) << '\n';
+            return false;
+        }
+        socketPath = address;
+        return true;
+    }
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    //without a host, getaddrinfo() gives the loopback address, 127.0.0.1
+    //as the one most clients of localhost reach
+    hints.ai_family = host.empty() ? AF_INET : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = 0;
+    addrinfo* found = 0;
+    int status = getaddrinfo(host.empty() ? 0 : host.c_str(), port.c_str(), &hints, &found);
+    if (status != 0)  {
+        cerr << "Cannot resolve " << address << ": " << gai_strerror(status) << '\n';
+        return false;
+    }
+    for (addrinfo* candidate = found; candidate != 0; candidate = candidate->ai_next) {
+        listener = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (listener < 0)  {
+            continue;
+        }
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listener, candidate->ai_addr, candidate->ai_addrlen) == 0
+            && ::listen(listener, SOMAXCONN) == 0)  {
+            break;
+        }
+        close(listener);
+        listener = -1;
+    }
+    freeaddrinfo(found);
+    if (listener < 0)  {
+        cerr << "Cannot listen on " << address << ": " << strerror(errno) << '\n';
+        return false;
+    }
+    tcp = true;
+    return true;
+#else
+    cerr << "Server mode needs POSIX sockets.\n";
+    return false;
+#endif
+}
+
+static volatile sig_atomic_t serverStopped = 0;
+
+//asks a running Film_server to stop
+static void stopServing(int)  {
+    serverStopped = 1;
+}
+
+bool Film_server::run()  {
+    bool failed = false;
+#ifdef THIN_FILM_POSIX
+    //a client that goes away mid-response must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServing);
+    signal(SIGTERM, stopServing);
+    while (listener >= 0 && !serverStopped) {
+        pollfd waiting = { listener, POLLIN, 0 };
+        if (poll(&waiting, 1, FOLLOW_POLL_MILLIS) <= 0)  {
+            continue;
+        }
+        int client = accept(listener, 0, 0);
+        if (client < 0)  {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)  {
+                continue;
+            }
+            cerr << "Cannot accept clients: " << strerror(errno) << '\n';
+            failed = true;
+            break;
+        }
+        {
+            lock_guard<mutex> guard(clientLock);
+            if (clients.size() >= size_t(MAX_SERVER_CLIENTS))  {
+                static const char busy[] = "ERR too many clients\n";
+                ssize_t written = write(client, busy, sizeof(busy) - 1);
+                (void)written;
+                close(client);
+                continue;
+            }
+            clients.push_back(client);
+        }
+        if (tcp)  {
+            //responses are written whole, so Nagle's algorithm would only add delay
+            int one = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        thread(&Film_server::serve, this, client).detach();
+    }
+    //the client threads use the server, so they are ended before it goes
+    unique_lock<mutex> guard(clientLock);
+    for (int client : clients) {
+        shutdown(client, SHUT_RDWR);
+    }
+    clientDone.wait(guard, [this] { return clients.empty(); });
+#endif
+    return !failed;
+}
+
+void Film_server::serve(int client)  {
+#ifdef THIN_FILM_POSIX
+    const size_t MAX_REQUEST = 1 << 16;
+    Session session;
+    string input;
+    string output;
+    vector<char> buffer(1 << 16);
+    bool open = true;
+    while (open) {
+        ssize_t got = read(client, buffer.data(), buffer.size());
+        if (got < 0 && errno == EINTR)  {
+            continue;
+        }
+        if (got <= 0)  {
+            break;
+        }
+        input.append(buffer.data(), got);
+        size_t start = 0;
+        size_t newline;
+        while (open && (newline = input.find('\n', start)) != string::npos) {
+            const char* end = input.data() + newline;
+            if (end > input.data() + start && end[-1] == '\r')  {
+                end--;
+            }
+            open = handle(session, input.data() + start, end, output);
+            start = newline + 1;
+        }
+        input.erase(0, start);
+        if (input.size() > MAX_REQUEST)  {
+            output += "ERR request too long\n";
+            open = false;
+        }
+        //everything that arrived is answered, send the responses in one write
+        size_t sent = 0;
+        while (sent < output.size()) {
+            ssize_t written = write(client, output.data() + sent, output.size() - sent);
+            if (written < 0 && errno == EINTR)  {
+                continue;
+            }
+            if (written <= 0)  {
+                open = false;
+                break;
+            }
+            sent += written;
+        }
+        output.clear();
+    }
+    lock_guard<mutex> guard(clientLock);
+    clients.erase(find(clients.begin(), clients.end(), client));
+    close(client);
+    clientDone.notify_all();
+#endif
+}
+
+bool Film_server::resolveSpectrum(const string& name, filesystem::path& path) const  {
+    filesystem::path requested(name);
+    if (spectrumDirectory.empty() || requested.is_absolute())  {
+        return false;
+    }
+    //symbolic links are followed before the check, so none leads out
+    error_code error;
+    path = filesystem::weakly_canonical(spectrumDirectory / requested, error);
+    if (error)  {
+        return false;
+    }
+    filesystem::path::const_iterator inside = path.begin();
+    for (const filesystem::path& part : spectrumDirectory) {
+        if (inside == path.end() || *inside != part)  {
+            return false;
+        }
+        ++inside;
+    }
+    return inside != path.end();
+}
+
+bool Film_server::handle(Session& session, const char* begin, const char* end,
+    string& response) const  {
+    Stage_timer timer(STAGE_REQUEST);
+    //split the line into blank separated fields
+    vector<const char*>& fields = session.fields;
+    fields.clear();
+    for (const char* p = begin; p < end;) {
+        while (p < end && isBlank(*p)) {
+            p++;
+        }
+        if (p == end)  {
+            break;
+        }
+        fields.push_back(p);
+        while (p < end && !isBlank(*p)) {
+            p++;
+        }
+        fields.push_back(p);
+    }
+    size_t count = fields.size() / 2;
+    if (count == 0 || fields[1] - fields[0] != 1)  {
+        response += "ERR unknown request\n";
+        return true;
+    }
+    switch (*fields[0]) {
+        case 'P':
+            response += "OK\n";
+            return true;
+        case 'Q':
+            return false;
+        case 'S':
+            response += "OK " + formatStatsLine() + '\n';
+            return true;
+        case 'T':  {
+            //the material name may contain blanks, the numbers are the last fields
+            double range = 0.0;
+            double maxima = 0.0;
+            if (count < 4 || !parseNumber(fields[2 * count - 4], fields[2 * count - 3], range)
+                || !parseNumber(fields[2 * count - 2], fields[2 * count - 1], maxima))  {
+                response += "ERR expected T <material|index> <spectralRange> <maxima>\n";
+                return true;
+            }
+            if (range < 0.0 || maxima < 0.0)  {
+                response += "ERR negative spectral range or maxima\n";
+                return true;
+            }
+            double index = 0.0;
+            if (!parseNumber(fields[2], fields[2 * count - 5], index))  {
+                int pos = filmIndex.find(string(fields[2], fields[2 * count - 5]));
+                if (pos < 0)  {
+                    response += "ERR unknown material\n";
+                    return true;
+                }
+                index = materialList[pos].getIndex();
+            }
+            double thickness = 0.0;
+            calculateThickness(&index, &range, &maxima, &thickness, 1);
+            response += "OK ";
+            appendShortest(response, thickness);
+            response += '\n';
+            return true;
+        }
+        case 'F':  {
+            if (count < 3)  {
+                response += "ERR expected F <material|index> <spectrum file>\n";
+                return true;
+            }
+            string material(fields[2], fields[3]);
+            string fileName(fields[4], fields[2 * count - 1]);
+            Thin_film film;
+            if (!resolveMaterial(materialList, filmIndex, material, film))  {
+                response += "ERR unknown material\n";
+                return true;
+            }
+            filesystem::path path;
+            if (!resolveSpectrum(fileName, path))  {
+                response += "ERR spectrum file outside the server directory\n";
+                return true;
+            }
+            if (!loadSpectrum(session.spectrum, path.string()))  {
+                response += "ERR cannot read spectrum\n";
+                return true;
+            }
+            film.setspectralRange(session.spectrum.getspectralRange());
+            film.setnumberOfMaxima(session.counter.countMaxima(session.spectrum));
+            Fit_result result = cachedFit(session.fitter, session.spectrum, film, &tables,
+                filmIndex.find(material));
+            response += "OK ";
+            appendShortest(response, result.thickness);
+            response += ' ';
+            appendShortest(response, result.residual);
+            response += '\n';
+            return true;
+        }
+        default:
+            response += "ERR unknown request\n";
+            return true;
+    }
+}
+
+/**
+    waits for a ring between pipeline stages: spins briefly, then yields,
+    then sleeps, so an idle stage does not hold a core
+    @param attempts The failed attempts so far, reset by the caller on success
+*/
+static void pipelineBackoff(unsigned& attempts)  {
+    attempts++;
+    if (attempts < 64)  {
+        return;
+    }
+    if (attempts < 256)  {
+        this_thread::yield();
+        return;
+    }
+    this_thread::sleep_for(chrono::microseconds(50));
+}
+
+//pushes a slot number, waiting while the ring is full
+static void pushSlot(Spsc_ring<uint32_t>& ring, uint32_t slot)  {
+    unsigned attempts = 0;
+    while (!ring.push(slot)) {
+        pipelineBackoff(attempts);
+    }
+}
+
+//pops a slot number, waiting while the ring is empty
+static uint32_t popSlot(Spsc_ring<uint32_t>& ring)  {
+    unsigned attempts = 0;
+    uint32_t slot = 0;
+    while (!ring.pop(slot)) {
+        pipelineBackoff(attempts);
+    }
+    return slot;
+}
+
+Acquisition_pipeline::Acquisition_pipeline(const Thin_film& film, const Dispersion_tables* tables,
+    int pos, bool fitting, Result_sink& results) : film(film), tables(tables), pos(pos),
+    fitting(fitting), results(results), slots(ACQUIRE_SLOTS), freeSlots(ACQUIRE_SLOTS + 1),
+    acquired(ACQUIRE_SLOTS + 1), preprocessed(ACQUIRE_SLOTS + 1), computed(ACQUIRE_SLOTS + 1),
+    frames(0), dropped(0), rejected(0), written(0), malformed(false)  {
+    auto allocate = [](Slot& slot) {
+        slot.raw.resize(2 * ACQUIRE_MAX_SAMPLES);
+        slot.samples = 0;
+        slot.spectrum.wavelength.reserve(ACQUIRE_MAX_SAMPLES);
+        slot.spectrum.intensity.reserve(ACQUIRE_MAX_SAMPLES);
+        slot.valid = false;
+        slot.thickness = 0.0;
+    };
+    for (size_t i = 0; i < slots.size(); i++) {
+        allocate(slots[i]);
+        freeSlots.push(uint32_t(i));
+    }
+    allocate(overflow);
+}
+
+uint64_t Acquisition_pipeline::getFrames() const  {
+    return frames.load();
+}
+
+uint64_t Acquisition_pipeline::getDropped() const  {
+    return dropped.load();
+}
+
+uint64_t Acquisition_pipeline::getRejected() const  {
+    return rejected.load();
+}
+
+uint64_t Acquisition_pipeline::getWritten() const  {
+    return written.load();
+}
+
+bool Acquisition_pipeline::run(FILE* source, bool live)  {
+    thread preprocessing(&Acquisition_pipeline::preprocess, this);
+    thread computing(&Acquisition_pipeline::compute, this);
+    thread writing(&Acquisition_pipeline::sink, this);
+    acquire(source, live);
+    preprocessing.join();
+    computing.join();
+    writing.join();
+    return !malformed.load();
+}
+
+int Acquisition_pipeline::readFrame(FILE* source, Slot& slot)  {
+    char header[12];
+    size_t got = fread(header, 1, sizeof(header), source);
+    if (got == 0)  {
+        return 0;
+    }
+    uint32_t version = 0;
+    uint32_t samples = 0;
+    memcpy(&version, header + 4, 4);
+    memcpy(&samples, header + 8, 4);
+    if (got < sizeof(header) || memcmp(header, "TFSP", 4) != 0 || version != 1)  {
+        return -1;
+    }
+    //a frame too large for a slot is skipped and rejected
+    slot.samples = samples <= ACQUIRE_MAX_SAMPLES ? samples : 0;
+    size_t remaining = 2 * size_t(samples);
+    while (remaining > 0) {
+        size_t chunk = min(remaining, slot.raw.size());
+        if (fread(slot.raw.data(), sizeof(float), chunk, source) != chunk)  {
+            return -1;
+        }
+        remaining -= chunk;
+    }
+    return 1;
+}
+
+void Acquisition_pipeline::acquire(FILE* source, bool live)  {
+    while (true) {
+        uint32_t free = END;
+        if (live)  {
+            freeSlots.pop(free);
+        } else  {
+            free = popSlot(freeSlots);
+        }
+        Slot& slot = free != END ? slots[free] : overflow;
+        Stage_timer timer(STAGE_READ_SPECTRUM);
+        int frame = readFrame(source, slot);
+        if (frame <= 0)  {
+            timer.finish();
+            if (frame < 0)  {
+                cerr << "Malformed frame after " << frames.load() << " spectra.\n";
+                malformed = true;
+            }
+            break;
+        }
+        timer.addBytes(12 + 8 * slot.samples);
+        timer.finish();
+        frames++;
+        if (free == END)  {
+            dropped++;
+            continue;
+        }
+        slot.acquired = chrono::steady_clock::now();
+        pushSlot(acquired, free);
+    }
+    pushSlot(acquired, END);
+}
+
+void Acquisition_pipeline::preprocess()  {
+    for (uint32_t next = popSlot(acquired); next != END; next = popSlot(acquired)) {
+        Slot& slot = slots[next];
+        Stage_timer timer(STAGE_PREPROCESS);
+        size_t n = slot.samples;
+        //within the reserved capacity, so resizing does not allocate
+        slot.spectrum.wavelength.resize(n);
+        slot.spectrum.intensity.resize(n);
+        bool valid = n >= 3;
+        for (size_t i = 0; i < n; i++) {
+            slot.spectrum.wavelength[i] = slot.raw[i];
+            slot.spectrum.intensity[i] = slot.raw[n + i];
+            valid = valid && isfinite(slot.raw[i]) && isfinite(slot.raw[n + i]);
+        }
+        if (valid && slot.spectrum.wavelength.front() > slot.spectrum.wavelength.back())  {
+            reverse(slot.spectrum.wavelength.begin(), slot.spectrum.wavelength.end());
+            reverse(slot.spectrum.intensity.begin(), slot.spectrum.intensity.end());
+        }
+        for (size_t i = 1; valid && i < n; i++) {
+            valid = slot.spectrum.wavelength[i] > slot.spectrum.wavelength[i - 1];
+        }
+        slot.valid = valid;
+        timer.finish();
+        pushSlot(preprocessed, next);
+    }
+    pushSlot(preprocessed, END);
+}
+
+void Acquisition_pipeline::compute()  {
+    Thin_film measured = film;
+    for (uint32_t next = popSlot(preprocessed); next != END; next = popSlot(preprocessed)) {
+        Slot& slot = slots[next];
+        if (slot.valid)  {
+            measured.setspectralRange(slot.spectrum.getspectralRange());
+            measured.setnumberOfMaxima(counter.countMaxima(slot.spectrum));
+            {
+                Stage_timer timer(STAGE_COMPUTE);
+                slot.thickness = measured.getThickness();
+            }
+            if (fitting)  {
+                slot.thickness = cachedFit(fitter, slot.spectrum, measured, tables, pos).thickness;
+            }
+        }
+        pushSlot(computed, next);
+    }
+    pushSlot(computed, END);
+}
+
+void Acquisition_pipeline::sink()  {
+    const string& mat = film.getMat();
+    for (uint32_t next = popSlot(computed); next != END; next = popSlot(computed)) {
+        Slot& slot = slots[next];
+        if (slot.valid)  {
+            results.write(mat, film.getIndex(), slot.thickness);
+            written++;
+            if (getStatsEnabled())  {
+                recordStage(STAGE_PIPELINE, chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::steady_clock::now() - slot.acquired).count(), 1, 0);
+            }
+        }
+        else  {
+            rejected++;
+        }
+        pushSlot(freeSlots, next);
+    }
+}
+
+/**
+adds material to films.txt file
+    @param materialList The list of Thin Film objects
+    @param filmIndex The name index of the library
+    @param journal The journal of library edits
+*/
+void addMaterial(vector<Thin_film>& materialList, Film_index& filmIndex, Film_journal& journal);
+
+//films shown per page when the library is listed
+const size_t FILMS_PER_PAGE = 20;
+
+/**
+    Film_pager lists the library, or the films a search matches, one page
+    at a time, numbering every film by its library position so the number
+    selects it whatever page shows it. A search lists the names that start
+    with the text, through the sorted view of Film_index::findPrefix(), or
+    the fuzzy matches of Film_index::findFuzzy() if no name does. Only the
+    films of the page shown are looked up and formatted.
+*/
+class Film_pager  {
+public:
+    /**
+        starts at the first page of the whole library
+        @param materialList The list of films in the library
+        @param filmIndex The name index of the library
+    */
+    Film_pager(const vector<Thin_film>& materialList, const Film_index& filmIndex);
+
+    //prints the films of the page
+    void print() const;
+
+    //prints which films of how many the page shows
+    void printPosition() const;
+
+    /**
+        turns the page with + and -, lists the whole library again with *,
+        and searches the names for any other text
+        @param text The command
+        @return false if a search matched no film; the listing is kept
+    */
+    bool command(const string& text);
+
+private:
+    //looks up the page at first
+    void fill();
+
+    const vector<Thin_film>& materialList;
+    const Film_index& filmIndex;
+    //the search shown, empty for the whole library
+    string pattern;
+    size_t first;
+    size_t total;
+    vector<int> page;
+};
+
+/**
+    prints film library to terminal, a page at a time if it is longer than
+    one, with + and - to turn the page, text to search the names and q to stop
+    @param materialList The list of Thin Film objects
+    @param filmIndex The name index of the library
+*/
+void listFilms(const vector<Thin_film>& materialList, const Film_index& filmIndex);
+    
+/**
+    deletes a film from the film file
+    @param materialList The list of Thin Film objects
+    @param filmIndex The name index of the library
+    @param journal The journal of library edits
+    @param builtins The number of catalog films at the front, which cannot be deleted
+*/
+void deleteFilm(vector<Thin_film>& materialList, Film_index& filmIndex, Film_journal& journal,
+    size_t builtins);
+
+/**
+    gets the film "vector index" (not refractive index); the user may
+    type the number shown by listFilms() or the material name, and in a
+    library longer than a page turn the page or search the names
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+*/
+int getFilmIndex(vector<Thin_film>& materialList, const Film_index& filmIndex);
+
+/**
+    Loads the saved measurement results from a file in the data.txt layout
+    @param results Receives the measurements
+    @param fileName The name of the file from which to read
+*/
+void readFile(vector<Meas_record>& results, string fileName);
+
+/**
+    Calculates film thickness from arbitrary film or from library
+    @param list of the vector of the Thin Film objects
+    @param filmIndex The name index of the library
+    @param journal The journal of library edits
+*/
+void calculateThickness(vector<Thin_film>& materialList, Film_index& filmIndex,
+    Film_journal& journal);
+
+/**
+    Writes thin film data to output file, replacing it atomically
+    @param materialList The name of the file to which to write
+*/
+void saveData(const vector<Thin_film>& materialList, string filename);
+
+/**
+    Calculates the thickness of every measurement in a batch file without
+    prompting and appends the results to the output file in the data.txt
+    layout. Each non-blank line of the batch file holds
+        material,index,spectralRange,numberOfMaxima
+    an empty index is looked up in the library by material name. Lines
+    starting with '#' are comments.
+    @param library The film library
+    @param inFile The name of the batch file
+    @param outFile The name of the file to which results are appended
+    @param policy When the results are written to the file
+    @return the number of malformed lines
+*/
+int runBatch(Film_library& library, string inFile, string outFile, const Sink_policy& policy);
+
+/**
+    Counts the maxima in each spectrum file and prints the thickness of
+    the film in the print() layout
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param material Library material name or refractive index of the film
+    @param files The names of the spectrum files
+    @return the number of spectra that could not be processed
+*/
+int runSpectra(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    string material, const vector<string>& files);
+
+/**
+    Counts the maxima of every spectrum file in a directory in parallel
+    and appends the thicknesses to the output file in the data.txt layout,
+    in file name order
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param material Library material name or refractive index of the film
+    @param directory The directory holding one spectrum file per site
+    @param outFile The name of the file to which results are appended
+    @param policy When the results are written to the file
+    @return the number of files that could not be processed
+*/
+int runScan(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    string material, string directory, string outFile, const Sink_policy& policy);
+
+/**
+    Converts measurement history between the data.txt layout and a
+    columnar history file
+    @param inFile The file to convert
+    @param outFile The file to write; a text file is appended to
+    @param toColumnar Whether inFile is text and outFile columnar
+    @return the number of rows that could not be converted
+*/
+int runConvertHistory(string inFile, string outFile, bool toColumnar);
+
+/**
+    Prints every measurement of one material from a columnar history
+    file, scanning the mapped columns in place
+    @param fileName The columnar history file
+    @param material The material to report
+    @return 1 if the file cannot be read, 0 otherwise
+*/
+int runHistory(string fileName, string material);
+
+/**
+    Prints n and k of a library film on an instrument wavelength grid from
+    the precomputed dispersion tables
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param material The library material name
+    @return 1 if the material is not in the library, 0 otherwise
+*/
+int runOptics(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material);
+
+/**
+    Fits the thickness of a film on silicon to each spectrum file with the
+    transfer-matrix model, starting from the getThickness() estimate of the
+    counted maxima
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param material Library material name or refractive index of the film
+    @param files The names of the spectrum files
+    @return the number of spectra that could not be processed
+*/
+int runFit(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const vector<string>& files);
+
+/**
+    Estimates the thickness of a film on silicon from the fringe frequency
+    of each spectrum file with Fft_estimator, next to the fringe count
+    estimate of getThickness()
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param material Library material name or refractive index of the film
+    @param files The names of the spectrum files
+    @return the number of spectra that could not be processed
+*/
+int runFft(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const vector<string>& files);
+
+/**
+    Fits the thickness of every layer of a film stack on silicon to each
+    spectrum file
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param layers Comma separated material=thickness pairs, top layer first
+    @param files The names of the spectrum files
+    @return the number of spectra that could not be processed
+*/
+int runFitStack(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, const string& layers, const vector<string>& files);
+
+/**
+    Measures every site of a wafer map in parallel and appends one map
+    record per wafer. Each non-blank line of the grid file holds a site as
+        x,y,spectralRange,numberOfMaxima   counted fringes, computed with
+                                           the batched thickness kernel
+        x,y,spectrum file                  fitted with Reflectance_fit
+    spectrum paths are relative to the grid file, lines starting with '#'
+    and a header line are skipped, and a negative spectral range or count
+    makes the site malformed. The record holds the tab separated
+    fields
+        wafer material index sites mean min max sigma% x,y,t;x,y,t...
+    where the wafer is the grid file name without its extension.
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param material Library material name or refractive index of the film
+    @param gridFile The name of the site grid file
+    @param outFile The name of the file to which the map record is appended
+    @param policy Whether the record is synced to the disk
+    @return the number of sites that could not be measured, one more if
+    the record could not be written, or 1 if the grid could not be opened
+*/
+int runWaferMap(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const string& gridFile,
+    const string& outFile, const Sink_policy& policy);
+
+/**
+    Measures the spectra streamed by a spectrometer with an
+    Acquisition_pipeline and appends the results to a file
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param material Library material name or refractive index of the film
+    @param source The stream of frames, - for standard input
+    @param outFile The name of the file to which results are appended
+    @param fitting Whether to fit every spectrum after counting its fringes
+    @param policy When the results are written to the file
+    @return 1 if the stream cannot be read or holds a malformed frame, 0 otherwise
+*/
+int runAcquire(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const string& source,
+    const string& outFile, bool fitting, const Sink_policy& policy);
+
+//how many samples --uncertainty draws and for how long
+struct Uncertainty_options  {
+    //the number of Monte Carlo samples
+    size_t samples;
+    //the key of the random number generator
+    uint64_t seed;
+    //stop drawing samples after this many milliseconds, 0 for no limit
+    int budgetMillis;
+
+    Uncertainty_options();
+};
+
+//samples drawn per work item by --uncertainty with the closed form model
+const size_t UNCERTAINTY_BLOCK = 4096;
+//the most samples --uncertainty holds, 800MB of thicknesses
+const size_t UNCERTAINTY_MAX_SAMPLES = 100000000;
+//samples drawn per work item by --uncertainty with the fitter
+const size_t UNCERTAINTY_FIT_BLOCK = 8;
+
+/**
+    Propagates the uncertainty of the inputs of a thickness measurement
+    with Monte Carlo sampling on all cores and prints confidence intervals.
+    With three inputs, <material|index> <spectralRange> <maxima>, the
+    closed form model is sampled; with two, <material|index> <spectrum>,
+    the spectrum is refitted with Reflectance_fit for every sample, with
+    the index drawn from its distribution and noise at the residual of the
+    nominal fit added to the fitted model. Every input may carry a spread
+    as parsed by Input_distribution. Sample i only depends on the seed and
+    i, and the statistics use the samples in order, so a run is reproduced
+    exactly by the same seed and sample count on any number of threads.
+    Draws with an index of 1 or less, or a negative spectral range or
+    number of maxima, are dropped and counted. A time budget, off by
+    default, ends the run at the end of the finished blocks of samples,
+    and the report gives their count, with which the run is reproduced.
+    @param library The film library
+    @param inputs The inputs of the measurement
+    @param options The sample count, seed and time budget
+    @return 1 if the inputs are invalid, 0 otherwise
+*/
+int runUncertainty(Film_library& library, const vector<string>& inputs,
+    const Uncertainty_options& options);
+
+//films within this factor of the best coarse cost are refined by --identify
+const double IDENTIFY_PRUNE_RATIO = 4.0;
+//films whose coarse cost is below this fraction of the intensity variance
+//are refined whatever the best cost, which may be 0
+const double IDENTIFY_PRUNE_FLOOR = 0.01;
+//at most this many films are refined and listed
+const size_t IDENTIFY_MAX_FILMS = 16;
+//the best films combined into two-layer stacks with --pairs
+const size_t IDENTIFY_PAIR_FILMS = 4;
+
+/**
+    Fits a spectrum against every film of the library in parallel and ranks
+    the films by residual. Every film is first scanned coarsely around its
+    getThickness() estimate; only films whose scan comes within
+    IDENTIFY_PRUNE_RATIO of the best one, or below IDENTIFY_PRUNE_FLOOR of
+    the variance of the spectrum, are refined. With pairs the best
+    IDENTIFY_PAIR_FILMS films are also fitted as every two-layer stack
+    @param materialList The list of films in the library
+    @param tables The dispersion tables of the library
+    @param file The name of the spectrum file
+    @param pairs Whether to fit two-layer stacks as well
+    @return 1 if the spectrum cannot be read, 0 otherwise
+*/
+int runIdentify(const vector<Thin_film>& materialList, const Dispersion_tables& tables,
+    const string& file, bool pairs);
+
+/**
+    Serves thickness and fit requests with the library loaded once; see
+    Film_server for the protocol
+    @param materialList The list of films in the library
+    @param filmIndex The name index of the library
+    @param tables The dispersion tables of the library
+    @param address A Unix socket path, or host:port or :port for TCP on
+    the loopback interface
+    @return 0 once stopped by SIGINT or SIGTERM, 1 if the socket cannot be
+    opened or fails
+*/
+int runServe(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, const string& address);
+
+//prints the column headings of the print() layout
+void printResultHeader();
+
+//prints command line usage
+void printUsage(const char* program);
+
+//prints the stage statistics to standard error
+void printStats();
+
+//the library build of thinFilmCalc.h leaves the executable's entry point out
+#ifndef THINFILMCALC_LIBRARY
+/**
+    loads the library file if the films named by a material argument are
+    not all in the catalog; an index needs no library
+    @param library The film library
+    @param materials A material or index, or material=nm layers separated by commas
+*/
+static void prepareMaterials(Film_library& library, const string& materials)  {
+    size_t start = 0;
+    while (start <= materials.size() && !library.isLoaded()) {
+        size_t end = materials.find(',', start);
+        if (end == string::npos)  {
+            end = materials.size();
+        }
+        string material = materials.substr(start, end - start);
+        size_t equals = material.rfind('=');
+        if (equals != string::npos)  {
+            material.erase(equals);
+        }
+        double index = 0.0;
+        if (!parseNumber(material.data(), material.data() + material.size(), index))  {
+            library.find(material);
+        }
+        start = end + 1;
+    }
+}
+
+//menu items
+const int CAL_THICKNESS = 1;
+const int MATERIAL_LIST = 2;
+const int ADD_MATERIAL = 3;
+const int DEL_MATERIAL = 4;
+const int EXIT = 0;
+
+int main(int argc, char* argv[])  {
+    //global options may appear anywhere on the command line
+    vector<string> args;
+    Sink_policy policy;
+    Wavelength_grid grid;
+    Pipe_format pipeFormat = PIPE_TEXT;
+    size_t flushEvery = 0;
+    Uncertainty_options uncertainty;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 7, "--simd=") == 0)  {
+            string level = arg.substr(7);
+            if (level == "scalar")  {
+                setSimdLevel(SIMD_SCALAR);
+            } else if (level == "avx2")  {
+                setSimdLevel(SIMD_AVX2);
+            } else if (level == "avx512")  {
+                setSimdLevel(SIMD_AVX512);
+            } else if (level != "auto")  {
+                cerr << "Unknown SIMD level " << level << '\n';
+                return 1;
+            }
+        } else if (arg.compare(0, 14, "--flush-bytes=") == 0)  {
+            policy.flushBytes = strtoul(arg.c_str() + 14, 0, 10);
+        } else if (arg.compare(0, 11, "--flush-ms=") == 0)  {
+            policy.flushMillis = atoi(arg.c_str() + 11);
+        } else if (arg.compare(0, 7, "--grid=") == 0)  {
+            double first = 0.0;
+            double last = 0.0;
+            double step = 0.0;
+            if (sscanf(arg.c_str() + 7, "%lf:%lf:%lf", &first, &last, &step) != 3
+                || step <= 0.0 || last < first)  {
+                cerr << "The grid must be given as first:last:step in nm\n";
+                return 1;
+            }
+            grid = Wavelength_grid(first, last, step);
+        } else if (arg == "--fsync")  {
+            policy.durability = DURABILITY_FSYNC;
+        } else if (arg.compare(0, 9, "--format=") == 0)  {
+            string format = arg.substr(9);
+            if (format == "text")  {
+                pipeFormat = PIPE_TEXT;
+            } else if (format == "csv")  {
+                pipeFormat = PIPE_CSV;
+            } else if (format == "json")  {
+                pipeFormat = PIPE_JSON;
+            } else  {
+                cerr << "Unknown output format " << format << '\n';
+                return 1;
+            }
+        } else if (arg.compare(0, 14, "--flush-every=") == 0)  {
+            flushEvery = strtoul(arg.c_str() + 14, 0, 10);
+        } else if (arg.compare(0, 10, "--samples=") == 0)  {
+            //a value that is not a count is rejected by runUncertainty()
+            char* end = 0;
+            uncertainty.samples = strtoul(arg.c_str() + 10, &end, 10);
+            if (*end != 0 || arg.c_str()[10] == '-')  {
+                uncertainty.samples = 0;
+            }
+        } else if (arg.compare(0, 7, "--seed=") == 0)  {
+            uncertainty.seed = strtoull(arg.c_str() + 7, 0, 10);
+        } else if (arg.compare(0, 12, "--budget-ms=") == 0)  {
+            uncertainty.budgetMillis = atoi(arg.c_str() + 12);
+        } else if (arg.compare(0, 8, "--cache=") == 0)  {
+            fitCache().setFile(arg.substr(8));
+        } else if (arg.compare(0, 13, "--cache-size=") == 0)  {
+            fitCache().setCapacity(strtoul(arg.c_str() + 13, 0, 10));
+        } else if (arg == "--stats")  {
+            //a repeated --stats prints the statistics once
+            if (!getStatsEnabled())  {
+                setStatsEnabled(true);
+                atexit(printStats);
+            }
+        } else  {
+            args.push_back(arg);
+        }
+    }
+
+    //the catalog is built in, films.txt is only read when a film outside it is needed
+    Film_library library("films.txt", grid);
+    const vector<Thin_film>& materialList = library.getFilms();
+    const Film_index& filmIndex = library.getIndex();
+    const Dispersion_tables& tables = library.getTables();
+
+    //non-interactive modes
+    if (!args.empty())  {
+        string mode = args[0];
+        if ((mode == "--spectrum" || mode == "--scan" || mode == "--fit" || mode == "--fft"
+            || mode == "--fit-stack" || mode == "--wafer-map" || mode == "--nk"
+            || mode == "--acquire")
+            && args.size() >= 2)  {
+            prepareMaterials(library, args[1]);
+        }
+        if (mode == "--identify" || mode == "--serve")  {
+            library.load();
+        }
+        if (mode == "--batch" && args.size() >= 2)  {
+            string outFile = args.size() >= 3 ? args[2] : "data.txt";
+            return runBatch(library, args[1], outFile, policy) == 0 ? 0 : 2;
+        }
+        if (mode == "--scan" && args.size() >= 3)  {
+            string outFile = args.size() >= 4 ? args[3] : "data.txt";
+            return runScan(materialList, filmIndex, args[1], args[2], outFile, policy) == 0 ? 0 : 2;
+        }
+        if ((mode == "--to-columnar" || mode == "--from-columnar") && args.size() >= 3)  {
+            return runConvertHistory(args[1], args[2], mode == "--to-columnar") == 0 ? 0 : 2;
+        }
+        if (mode == "--fit" && args.size() >= 3)  {
+            vector<string> files(args.begin() + 2, args.end());
+            return runFit(materialList, filmIndex, tables, args[1], files) == 0 ? 0 : 2;
+        }
+        if (mode == "--fft" && args.size() >= 3)  {
+            vector<string> files(args.begin() + 2, args.end());
+            return runFft(materialList, filmIndex, tables, args[1], files) == 0 ? 0 : 2;
+        }
+        if (mode == "--fit-stack" && args.size() >= 3)  {
+            vector<string> files(args.begin() + 2, args.end());
+            return runFitStack(materialList, filmIndex, tables, args[1], files) == 0 ? 0 : 2;
+        }
+        if (mode == "--wafer-map" && args.size() >= 3)  {
+            string outFile = args.size() >= 4 ? args[3] : "maps.txt";
+            return runWaferMap(materialList, filmIndex, tables, args[1], args[2], outFile,
+                policy) == 0 ? 0 : 2;
+        }
+        if (mode == "--acquire" && args.size() >= 3)  {
+            bool fitting = args.back() == "--fit";
+            size_t count = args.size() - (fitting ? 1 : 0);
+            string outFile = count >= 4 ? args[3] : "data.txt";
+            return runAcquire(materialList, filmIndex, tables, args[1], args[2], outFile,
+                fitting, policy) == 0 ? 0 : 2;
+        }
+        if (mode == "--uncertainty" && args.size() >= 3)  {
+            vector<string> inputs(args.begin() + 1, args.end());
+            return runUncertainty(library, inputs, uncertainty);
+        }
+        if (mode == "--identify" && args.size() >= 2)  {
+            bool pairs = args.size() >= 3 && args[2] == "--pairs";
+            return runIdentify(materialList, tables, args[1], pairs);
+        }
+        if (mode == "--serve" && args.size() >= 2)  {
+            return runServe(materialList, filmIndex, tables, args[1]);
+        }
+        if (mode == "--material-stats" && args.size() >= 2)  {
+            return runMaterialStats(args[1], args.size() >= 3 ? args[2] : "data.txt");
+        }
+        if (mode == "--follow")  {
+            return runFollow(args.size() >= 2 ? args[1] : "data.txt", pipeFormat);
+        }
+        if (mode == "--pipe")  {
+            return runPipe(library, pipeFormat, flushEvery) == 0 ? 0 : 2;
+        }
+        if (mode == "--bench")  {
+            size_t maxFilms = args.size() >= 2 ? strtoul(args[1].c_str(), 0, 10) : BENCH_MAX_FILMS;
+            return runBench(maxFilms, args.size() >= 3 ? args[2] : "");
+        }
+        if (mode == "--nk" && args.size() >= 2)  {
+            return runOptics(materialList, filmIndex, tables, args[1]);
+        }
+        if (mode == "--history" && args.size() >= 3)  {
+            return runHistory(args[1], args[2]);
+        }
+        if (mode == "--spectrum" && args.size() >= 3)  {
+            vector<string> files(args.begin() + 2, args.end());
+            return runSpectra(materialList, filmIndex, args[1], files) == 0 ? 0 : 2;
+        }
+        printUsage(argv[0]);
+        return (mode == "--help" || mode == "-h") ? 0 : 1;
+    }
+        
     cout << endl <<"Thin Film Calculator\n";
     int choice = 1;
     while (choice != 0) {
@@ -323,175 +7977,2436 @@ int main()  {
         << DEL_MATERIAL << ". Delete a thin film from the library\n"
         << "Choice (0-4): ";
         cin >> choice;
+    //the menu lists and edits the whole library
+    if (choice >= CAL_THICKNESS && choice <= DEL_MATERIAL)  {
+        library.load();
+    }
     if (choice == CAL_THICKNESS) {
-        calculateThickness(materialList);
+        calculateThickness(library.getFilms(), library.getIndex(), library.getJournal());
     } else if (choice == MATERIAL_LIST) {
-        listFilms(materialList);
+        listFilms(library.getFilms(), library.getIndex());
     } else if (choice == ADD_MATERIAL) {
-        addMaterial();
+        addMaterial(library.getFilms(), library.getIndex(), library.getJournal());
     } else if (choice == DEL_MATERIAL)  {
-		deleteFilm(materialList);
+		deleteFilm(library.getFilms(), library.getIndex(), library.getJournal(),
+            library.getBuiltinCount());
+    }
+    //the tables follow library positions, which the edits shift
+    if (choice == CAL_THICKNESS || choice == ADD_MATERIAL || choice == DEL_MATERIAL)  {
+        library.updateTables();
+    }
+}
+cout << "\nGoodbye!\n";
+
+return 0;
+}
+#endif
+
+void calculateThickness(vector<Thin_film>& materialList, Film_index& filmIndex,
+    Film_journal& journal)    {
+    string repeat = "y";
+        while(repeat =="y") {
+            cout << "Read material data from library? (y/n): ";
+            string libFilm = "y";
+            cin >> libFilm;
+            if (libFilm == "y") {
+                int pos = getFilmIndex(materialList, filmIndex);
+                Thin_film film = materialList[pos];
+                cout << "Enter the spectral bandwidth over which the spectra was acquired in nm: ";
+                double newSpectralRange;
+                cin >> newSpectralRange;
+                film.setspectralRange(newSpectralRange);
+                cout << "Enter the number of maxima within the spectral range: ";
+                double newnumberOfMaxima;
+                cin >> newnumberOfMaxima;
+                film.setnumberOfMaxima(newnumberOfMaxima);
+                cout << endl;
+                printResultHeader();
+                film.print();
+                ofstream fout;
+                film.writeMeasResultFile(fout, "data.txt");
+            }
+              else  {
+                  Thin_film unknown;
+                  unknown.read();
+                  cout << endl;
+                  printResultHeader();
+                  unknown.print();
+                  cout << "Save material and index of this film (y/n)? ";
+                  string saveMatIndex = "y";
+                  cin >> saveMatIndex;
+                  if (saveMatIndex == "y" && filmIndex.findExact(unknown, materialList) < 0)  {
+                      materialList.push_back(unknown);
+                      filmIndex.addLast(materialList);
+                      journal.add(unknown);
+                      journal.compactIfNeeded();
+                  }
+              ofstream fout;
+              unknown.writeMeasResultFile(fout, "data.txt");
+              }
+        cout << "Enter another thin film? (y/n): ";
+        cin >> repeat;
+    }
+}
+
+void addMaterial(vector<Thin_film>& materialList, Film_index& filmIndex, Film_journal& journal)  {
+	Thin_film unknown;
+    cout << "Enter the name of the film: ";
+    cin >>ws;
+	string mat;
+    getline(cin, mat);
+	unknown.setMat(mat);
+    cout << "Enter the refractive index of the film: ";
+	double index = 0;
+    cin >> index;
+	unknown.setIndex(index);
+    cout << endl;
+    cout << setw(MATERIAL_WIDTH) << left << "Material"
+         << setw(INDEX_WIDTH) << right << "Index" << endl
+         << setw(MATERIAL_WIDTH) << left << mat
+         << setw(INDEX_WIDTH) << right << index <<endl;
+    cout << endl << "Save material and index of this film (y/n)? ";
+    string saveMatIndex = "n";
+    cin >> saveMatIndex;
+    if (saveMatIndex == "y" && filmIndex.findExact(unknown, materialList) < 0)  {
+        materialList.push_back(unknown);
+        filmIndex.addLast(materialList);
+        journal.add(unknown);
+        journal.compactIfNeeded();
+    }
+}
+
+void deleteFilm(vector<Thin_film>& materialList, Film_index& filmIndex, Film_journal& journal,
+    size_t builtins)  {
+	int pos = getFilmIndex(materialList, filmIndex);
+    if (size_t(pos) < builtins)  {
+        cout << materialList[pos].getMat() << " is built in and cannot be deleted.\n";
+        return;
+    }
+	journal.remove(materialList[pos]);
+    materialList.erase(materialList.begin() + pos);
+    filmIndex.build(materialList, false);
+    journal.compactIfNeeded();
+}
+
+//counts the lines of a mapped file so containers can be sized up front
+static size_t countLines(const Mapped_file& file)  {
+    size_t lines = 0;
+    const char* p = file.data();
+    const char* end = p + file.size();
+    while ((p = static_cast<const char*>(memchr(p, '\n', end - p))) != 0) {
+        lines++;
+        p++;
+    }
+    return lines + 1;
+}
+
+//returns the next line of a mapped file without the newline
+static bool nextLine(const char*& p, const char* end, const char*& lineBegin,
+    const char*& lineEnd)  {
+    if (p >= end)  {
+        return false;
+    }
+    lineBegin = p;
+    const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+    lineEnd = newline != 0 ? newline : end;
+    p = newline != 0 ? newline + 1 : end;
+    //trim the line
+    while (lineBegin < lineEnd && (isBlank(*lineBegin) || *lineBegin == '\f' || *lineBegin == '\v')) {
+        lineBegin++;
+    }
+    while (lineEnd > lineBegin && isBlank(lineEnd[-1])) {
+        lineEnd--;
+    }
+    return true;
+}
+
+void loadData(vector<Thin_film>& materialList, string fileName) {
+    Stage_timer timer(STAGE_LOAD_LIBRARY, 0);
+    Mapped_file file;
+    if (!file.open(fileName)) {
+        fail(cout, "File " + fileName + " failed to open.", 1);
+    }
+    timer.addBytes(file.size());
+    size_t loaded = materialList.size();
+    size_t lines = countLines(file);
+    materialList.reserve(materialList.size() + lines / 2);
+    materialNames().reserve(lines / 2);
+
+    //each film is a name line followed by an index line, blank lines are skipped
+    const char* p = file.data();
+    const char* end = p + file.size();
+    const char* lineBegin = 0;
+    const char* lineEnd = 0;
+    string mat;
+    int nameLine = 0;
+    int lineNumber = 0;
+    while (nextLine(p, end, lineBegin, lineEnd)) {
+        lineNumber++;
+        if (lineBegin == lineEnd)  {
+            continue;
+        }
+        if (nameLine == 0)  {
+            mat.assign(lineBegin, lineEnd);
+            nameLine = lineNumber;
+            continue;
+        }
+        Thin_film film;
+        if (parseOptics(lineBegin, lineEnd, film))  {
+            film.setMat(mat);
+            materialList.push_back(film);
+        }
+        else  {
+            warnings() << fileName << ":" << lineNumber << ": malformed index for "
+                << mat << ": " << string(lineBegin, lineEnd) << '\n';
+        }
+        nameLine = 0;
+    }
+    if (nameLine != 0)  {
+        warnings() << fileName << ":" << nameLine << ": missing index for " << mat << '\n';
+    }
+    timer.setItems(materialList.size() - loaded);
+}
+
+void readFile(vector<Meas_record>& results, string fileName)  {
+    Stage_timer timer(STAGE_PARSE, 0);
+    Mapped_file file;
+    if (!file.open(fileName, true)) {
+        cout << "Input file failed to open\n";
+        exit(-1);
+    }
+    timer.addBytes(file.size());
+    size_t parsed = results.size();
+    results.reserve(results.size() + countLines(file));
+
+    const char* p = file.data();
+    const char* end = p + file.size();
+    const char* lineBegin = 0;
+    const char* lineEnd = 0;
+    Meas_record record;
+    int lineNumber = 0;
+    while (nextLine(p, end, lineBegin, lineEnd)) {
+        lineNumber++;
+        if (lineBegin == lineEnd)  {
+            continue;
+        }
+        if (parseMeasRecord(lineBegin, lineEnd, record))  {
+            results.push_back(record);
+        }
+        else  {
+            cerr << fileName << ":" << lineNumber << ": malformed measurement: "
+                << string(lineBegin, lineEnd) << '\n';
+        }
+    }
+    timer.setItems(results.size() - parsed);
+}
+    
+Film_pager::Film_pager(const vector<Thin_film>& materialList, const Film_index& filmIndex)
+    : materialList(materialList), filmIndex(filmIndex), first(0), total(0)  {
+    fill();
+}
+
+void Film_pager::fill()  {
+    if (pattern.empty())  {
+        total = materialList.size();
+        page.clear();
+        for (size_t pos = first; pos < total && pos < first + FILMS_PER_PAGE; pos++) {
+            page.push_back(int(pos));
+        }
+        return;
+    }
+    total = filmIndex.findPrefix(materialList, pattern, first, FILMS_PER_PAGE, page);
+    if (total == 0)  {
+        total = filmIndex.findFuzzy(materialList, pattern, first, FILMS_PER_PAGE, page);
+    }
+}
+
+void Film_pager::print() const  {
+    cout << "\nTHIN FILM LIBRARY\n";
+    cout << setw(MATERIAL_WIDTH) << left << "Material"
+         << setw(INDEX_WIDTH + 4) << right << "Index" << endl;
+    //wide enough for the largest number, so the columns line up on every page
+    int width = int(max<size_t>(to_string(materialList.size()).size(), 2));
+    for (int pos : page) {
+        cout << setw(width) << right << (pos + 1) << " ";
+        materialList[pos].printLib();
+    }
+}
+
+void Film_pager::printPosition() const  {
+    cout << "Films " << (page.empty() ? first : first + 1) << "-" << first + page.size()
+         << " of " << total;
+    if (!pattern.empty())  {
+        cout << " matching " << pattern;
+    }
+    cout << '\n';
+}
+
+bool Film_pager::command(const string& text)  {
+    if (text == "+")  {
+        first = first + FILMS_PER_PAGE < total ? first + FILMS_PER_PAGE : first;
+    } else if (text == "-")  {
+        first = first >= FILMS_PER_PAGE ? first - FILMS_PER_PAGE : 0;
+    } else  {
+        string previous = pattern;
+        size_t previousFirst = first;
+        pattern = text == "*" ? "" : text;
+        first = 0;
+        fill();
+        if (total == 0)  {
+            pattern = previous;
+            first = previousFirst;
+            fill();
+            return false;
+        }
+        return true;
+    }
+    fill();
+    return true;
+}
+
+void listFilms(const vector<Thin_film>& materialList, const Film_index& filmIndex)   {
+    Film_pager pager(materialList, filmIndex);
+    pager.print();
+    while (materialList.size() > FILMS_PER_PAGE) {
+        pager.printPosition();
+        cout << "Enter + or - to turn the page, text to search the names or q to stop: ";
+        string command;
+        cin >> ws;
+        if (!getline(cin, command) || command == "q")  {
+            return;
+        }
+        if (!pager.command(command))  {
+            cout << "No film matches " << command << ".\n";
+            continue;
+        }
+        pager.print();
+    }
+}
+
+void saveData(const vector<Thin_film>& materialList, string fileName) {
+    Stage_timer timer(STAGE_SAVE_LIBRARY, materialList.size());
+    string contents = formatLibrary(materialList);
+    timer.addBytes(contents.size());
+    if (!replaceFile(fileName, contents)) {
+        cout << "Output file failed to open.\n";
+        exit(-1);
+    }
+}
+
+int getFilmIndex(vector<Thin_film>& materialList, const Film_index& filmIndex)   {
+    Film_pager pager(materialList, filmIndex);
+    pager.print();
+    bool paged = materialList.size() > FILMS_PER_PAGE;
+    while (true) {
+        if (paged)  {
+            pager.printPosition();
+            cout << "Enter the number preceeding the name of the thin film material or its name,\n"
+                 << "+ or - to turn the page or text to search the names: ";
+        } else  {
+            cout << "Enter the number preceeding the name of the thin film material or its name: ";
+        }
+        string choice;
+        cin >> ws;
+        getline(cin, choice);
+        double number = 0;
+        int pos = -1;
+        bool numbered = parseNumber(choice.data(), choice.data() + choice.size(), number);
+        if (numbered)  {
+            pos = int(number) - 1;
+        } else  {
+            pos = filmIndex.find(choice);
+        }
+        if (pos >= 0 && pos < int(materialList.size()))  {
+            return pos;
+        }
+        if (!cin.good())  {
+            cout << "\nGoodbye!\n";
+            exit(0);
+        }
+        if (!paged || numbered || !pager.command(choice))  {
+            cout << "There is no film " << choice << " in the library.\n";
+            continue;
+        }
+        pager.print();
+    }
+}
+
+/**
+    parses one batch line, material,index,spectralRange,numberOfMaxima, with
+    blanks around the fields ignored; an empty index is taken from the library
+    @param begin The first character of the line
+    @param end One past the last character of the line, without the newline
+    @param library The film library, loaded if a material is not in the catalog
+    @param mat Receives the material
+    @param index Receives the refractive index
+    @param spectralRange Receives the spectral range in nm
+    @param numberOfMaxima Receives the number of maxima
+    @param header Set if the index field holds text, as in a header row
+    @return false if the line is malformed
+*/
+static bool parseBatchLine(const char* begin, const char* end, Film_library& library,
+    string& mat, double& index, double& spectralRange, double& numberOfMaxima, bool& header)  {
+    const char* fieldBegin[4];
+    const char* fieldEnd[4];
+    int count = 0;
+    for (const char* p = begin; count < 5; count++) {
+        const char* comma = static_cast<const char*>(memchr(p, ',', end - p));
+        const char* last = comma != 0 ? comma : end;
+        if (count < 4)  {
+            fieldBegin[count] = p;
+            fieldEnd[count] = last;
+            while (fieldBegin[count] < last && isBlank(*fieldBegin[count])) {
+                fieldBegin[count]++;
+            }
+            while (fieldEnd[count] > fieldBegin[count] && isBlank(fieldEnd[count][-1])) {
+                fieldEnd[count]--;
+            }
+        }
+        if (comma == 0)  {
+            count++;
+            break;
+        }
+        p = comma + 1;
+    }
+    header = false;
+    if (count != 4 || fieldBegin[0] == fieldEnd[0])  {
+        return false;
+    }
+    mat.assign(fieldBegin[0], fieldEnd[0]);
+    if (fieldBegin[1] == fieldEnd[1])  {
+        int pos = library.find(mat);
+        if (pos < 0)  {
+            return false;
+        }
+        index = library.getFilms()[pos].getIndex();
+    }
+    else if (!parseNumber(fieldBegin[1], fieldEnd[1], index))  {
+        header = true;
+        return false;
+    }
+    return parseNumber(fieldBegin[2], fieldEnd[2], spectralRange)
+        && parseNumber(fieldBegin[3], fieldEnd[3], numberOfMaxima);
+}
+
+//parses a whole field as a number
+static bool parseNumber(const string& field, double& value)  {
+    return parseNumber(field.data(), field.data() + field.size(), value);
+}
+
+int runBatch(Film_library& library, string inFile, string outFile, const Sink_policy& policy)  {
+    ifstream fin(inFile.c_str());
+    if (fin.fail()) {
+        cerr << "Batch file " << inFile << " failed to open.\n";
+        exit(-1);
+    }
+    Result_sink results(outFile, policy);
+    if (!results.isOpen()) {
+        cerr << "Output file failed to open.\n";
+        exit(-1);
+    }
+
+    //rows are gathered into blocks and calculated by the bulk kernel
+    const size_t BLOCK_SIZE = 4096;
+    Film_batch batch;
+    batch.reserve(BLOCK_SIZE);
+    vector<string> mats(BLOCK_SIZE);
+
+    int lineNumber = 0;
+    int errors = 0;
+    long written = 0;
+    string line;
+    //parsing is timed per block, apart from the calculation and writing
+    Stage_timer parsing(STAGE_PARSE, BLOCK_SIZE);
+    while (getline(fin, line)) {
+        lineNumber++;
+        parsing.addBytes(line.size() + 1);
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#')  {
+            continue;
+        }
+        double index = 0.0;
+        double spectralRange = 0.0;
+        double numberOfMaxima = 0.0;
+        bool header = false;
+        if (!parseBatchLine(line.data(), line.data() + line.size(), library, mats[batch.size()],
+            index, spectralRange, numberOfMaxima, header))  {
+            //tolerate a header row
+            if (lineNumber == 1 && header)  {
+                continue;
+            }
+            cerr << inFile << ":" << lineNumber << ": malformed measurement: " << line << '\n';
+            errors++;
+            continue;
+        }
+        batch.add(index, spectralRange, numberOfMaxima);
+        if (batch.size() == BLOCK_SIZE)  {
+            parsing.finish();
+            const double* thickness = batch.calculateThickness();
+            for (size_t i = 0; i < batch.size(); i++) {
+                results.write(mats[i], batch.index[i], thickness[i]);
+            }
+            written += batch.size();
+            batch.clear();
+            parsing.restart();
+        }
+    }
+    parsing.setItems(batch.size());
+    parsing.finish();
+    const double* thickness = batch.calculateThickness();
+    for (size_t i = 0; i < batch.size(); i++) {
+        results.write(mats[i], batch.index[i], thickness[i]);
+    }
+    written += batch.size();
+    if (!results.commit()) {
+        exit(-1);
+    }
+    cout << written << " results written to " << outFile;
+    if (errors > 0)  {
+        cout << ", " << errors << " malformed lines skipped";
+    }
+    cout << '\n';
+    return errors;
+}
+
+void printUsage(const char* program)  {
+    cout << "Usage: " << program << "                          interactive menu\n"
+        << "       " << program << " --batch <file> [output]  calculate every material,index,\n"
+        << "           spectralRange,numberOfMaxima line of <file> and append the results\n"
+        << "           to [output] (default data.txt); leave index empty to use the library\n"
+        << "       " << program << " --spectrum <material|index> <file>...  count the maxima\n"
+        << "           of each spectrum file and print the film thickness\n"
+        << "       " << program << " --scan <material|index> <directory> [output]  process every\n"
+        << "           spectrum file of <directory> in parallel and append the results\n"
+        << "           to [output] (default data.txt) in file name order\n"
+        << "       " << program << " --to-columnar <data.txt> <history>  convert results to a\n"
+        << "           binary columnar history file\n"
+        << "       " << program << " --from-columnar <history> <data.txt>  append the rows of a\n"
+        << "           columnar history file to a results file\n"
+        << "       " << program << " --history <history> <material>  print the results of one\n"
+        << "           material from a columnar history file\n"
+        << "       " << program << " --fit <material|index> <file>...  fit the thickness of the\n"
+        << "           film on silicon to each spectrum with a transfer-matrix model\n"
+        << "       " << program << " --fft <material|index> <file>...  estimate the thickness from\n"
+        << "           the fringe frequency of each spectrum\n"
+        << "       " << program << " --fit-stack <material=nm>[,<material=nm>...] <file>...\n"
+        << "           fit the layers of a stack on silicon, top layer first, starting\n"
+        << "           from the given thicknesses\n"
+        << "       " << program << " --wafer-map <material|index> <grid> [output]  measure the\n"
+        << "           sites of a wafer map in parallel, print its uniformity and append\n"
+        << "           one map record to [output] (default maps.txt)\n"
+        << "       " << program << " --acquire <material|index> <stream|-> [output] [--fit]\n"
+        << "           measure the TFSP spectrum frames of a spectrometer stream as they\n"
+        << "           arrive and append the results to [output] (default data.txt)\n"
+        << "       " << program << " --uncertainty <material|index> <range> <maxima>  or\n"
+        << "       " << program << " --uncertainty <material|index> <file>  propagate input\n"
+        << "           spreads, written value+-sigma or value~halfwidth, through the closed\n"
+        << "           form or the fit with Monte Carlo samples and print confidence intervals\n"
+        << "       " << program << " --identify <file> [--pairs]  rank the library films, and with\n"
+        << "           --pairs two-layer stacks of the best ones, by how well they fit a spectrum\n"
+        << "       " << program << " --serve <socket path|host:port>  answer T (thickness) and\n"
+        << "           F (fit) requests over a socket with the library loaded once\n"
+        << "       " << program << " --material-stats <material> [data.txt]  print the mean,\n"
+        << "           spread, extremes and trend of a material's results\n"
+        << "       " << program << " --pipe  read batch lines from standard input and write the\n"
+        << "           thicknesses to standard output\n"
+        << "       " << program << " --follow [data.txt]  write results as stations append them,\n"
+        << "           with the running statistics of their material, until interrupted\n"
+        << "       " << program << " --bench [maxFilms] [output]  run the benchmarks with synthetic\n"
+        << "           libraries of up to maxFilms entries (default 10000000), JSON results\n"
+        << "       " << program << " --nk <material>  print n and k of a film on the wavelength grid\n"
+        << "Options: --simd=auto|scalar|avx2|avx512  kernel used for bulk thickness calculation\n"
+        << "         --flush-bytes=N  write results once N bytes are buffered (default 1048576)\n"
+        << "         --flush-ms=N     write buffered results at least every N ms (default 1000)\n"
+        << "         --fsync          sync every write of results to the disk\n"
+        << "         --format=text|csv|json  output layout of --pipe and --follow (default text)\n"
+        << "         --flush-every=N  write --pipe output every N records (default when full)\n"
+        << "         --samples=N      Monte Carlo samples of --uncertainty (default 1000000)\n"
+        << "         --seed=N         random seed of --uncertainty (default 1)\n"
+        << "         --budget-ms=N    stop --uncertainty sampling after N ms (default 0,\n"
+        << "                          no limit)\n"
+        << "         --cache=FILE     keep fit results in FILE as well, across runs\n"
+        << "         --cache-size=N   fit results held in memory (default 4096, 0 for none)\n"
+        << "         --stats          print stage timings and latency histograms at exit\n"
+        << "         --grid=first:last:step  instrument wavelength grid in nm (default 200:1100:1)\n";
+}
+
+bool resolveMaterial(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const string& material, Thin_film& film)  {
+    double index = 0.0;
+    if (parseNumber(material, index))  {
+        film.setMat("Unknown");
+        film.setIndex(index);
+        return true;
+    }
+    int pos = filmIndex.find(material);
+    if (pos < 0)  {
+        return false;
+    }
+    film = materialList[pos];
+    return true;
+}
+
+void printResultHeader()  {
+    string& line = lineBuffer();
+    formatResultHeader(line);
+    cout.write(line.data(), line.size());
+    cout << right;
+}
+
+int runSpectra(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    string material, const vector<string>& files)  {
+    Thin_film film;
+    if (!resolveMaterial(materialList, filmIndex, material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return files.size();
+    }
+    Fringe_counter counter;
+    Spectrum spectrum;
+    int errors = 0;
+    printResultHeader();
+    for (unsigned i = 0; i < files.size(); i++) {
+        if (!loadSpectrum(spectrum, files[i]))  {
+            cerr << "Spectrum " << files[i] << " could not be read.\n";
+            errors++;
+            continue;
+        }
+        film.setspectralRange(spectrum.getspectralRange());
+        film.setnumberOfMaxima(counter.countMaxima(spectrum));
+        film.print();
+    }
+    return errors;
+}
+
+int runScan(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    string material, string directory, string outFile, const Sink_policy& policy)  {
+    Thin_film film;
+    if (!resolveMaterial(materialList, filmIndex, material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return 1;
+    }
+    vector<string> files;
+    error_code error;
+    for (filesystem::directory_iterator entry(directory, error), end; !error && entry != end;
+        entry.increment(error)) {
+        if (entry->is_regular_file())  {
+            files.push_back(entry->path().string());
+        }
+    }
+    if (error)  {
+        cerr << "Directory " << directory << " failed to open.\n";
+        exit(-1);
+    }
+    sort(files.begin(), files.end());
+
+    //every worker keeps its own scratch space and result buffer
+    struct Site_result  {
+        size_t file;
+        double spectralRange;
+        double numberOfMaxima;
+    };
+    Work_pool pool;
+    vector<Fringe_counter> counters(pool.size());
+    vector<Spectrum> spectra(pool.size());
+    vector<vector<Site_result> > results(pool.size());
+    vector<vector<size_t> > failures(pool.size());
+    pool.run(files.size(), [&](size_t item, unsigned worker) {
+        if (!loadSpectrum(spectra[worker], files[item]))  {
+            failures[worker].push_back(item);
+            return;
+        }
+        Site_result result;
+        result.file = item;
+        result.spectralRange = spectra[worker].getspectralRange();
+        result.numberOfMaxima = counters[worker].countMaxima(spectra[worker]);
+        results[worker].push_back(result);
+    });
+
+    //merge the per-worker buffers back into file name order
+    vector<Site_result> merged;
+    vector<size_t> failed;
+    for (unsigned worker = 0; worker < pool.size(); worker++) {
+        merged.insert(merged.end(), results[worker].begin(), results[worker].end());
+        failed.insert(failed.end(), failures[worker].begin(), failures[worker].end());
+    }
+    sort(merged.begin(), merged.end(), [](const Site_result& a, const Site_result& b) {
+        return a.file < b.file;
+    });
+    sort(failed.begin(), failed.end());
+    for (unsigned i = 0; i < failed.size(); i++) {
+        cerr << "Spectrum " << files[failed[i]] << " could not be read.\n";
+    }
+
+    Film_batch batch;
+    batch.reserve(merged.size());
+    for (unsigned i = 0; i < merged.size(); i++) {
+        batch.add(film.getIndex(), merged[i].spectralRange, merged[i].numberOfMaxima);
+    }
+    const double* thickness = batch.calculateThickness();
+    Result_sink sink(outFile, policy);
+    if (!sink.isOpen()) {
+        cerr << "Output file failed to open.\n";
+        exit(-1);
+    }
+    for (unsigned i = 0; i < merged.size(); i++) {
+        sink.write(film.getMat(), batch.index[i], thickness[i]);
+    }
+    if (!sink.commit()) {
+        exit(-1);
+    }
+    cout << merged.size() << " results written to " << outFile;
+    if (!failed.empty())  {
+        cout << ", " << failed.size() << " files skipped";
+    }
+    cout << '\n';
+    return failed.size();
+}
+
+int runConvertHistory(string inFile, string outFile, bool toColumnar)  {
+    if (toColumnar)  {
+        vector<Meas_record> results;
+        readFile(results, inFile);
+        if (!writeColumnarHistory(results, vector<int64_t>(), outFile))  {
+            cerr << "Output file " << outFile << " could not be written.\n";
+            exit(-1);
+        }
+        cout << results.size() << " results written to " << outFile << '\n';
+        return 0;
+    }
+    Columnar_history history;
+    if (!history.open(inFile))  {
+        cerr << "Columnar history " << inFile << " could not be read.\n";
+        return 1;
+    }
+    Result_sink sink(outFile);
+    if (!sink.isOpen()) {
+        cerr << "Output file failed to open.\n";
+        exit(-1);
+    }
+    vector<string> materials(history.getMaterialCount());
+    for (size_t i = 0; i < materials.size(); i++) {
+        materials[i] = history.getMaterial(i);
+    }
+    const uint32_t* ids = history.getMaterials();
+    const double* indices = history.getIndices();
+    const double* thicknesses = history.getThicknesses();
+    int errors = 0;
+    for (size_t i = 0; i < history.size(); i++) {
+        if (ids[i] >= materials.size())  {
+            errors++;
+            continue;
+        }
+        sink.write(materials[ids[i]], indices[i], thicknesses[i]);
+    }
+    if (!sink.commit()) {
+        exit(-1);
+    }
+    cout << history.size() - errors << " results written to " << outFile << '\n';
+    return errors;
+}
+
+int runHistory(string fileName, string material)  {
+    Columnar_history history;
+    if (!history.open(fileName))  {
+        cerr << "Columnar history " << fileName << " could not be read.\n";
+        return 1;
+    }
+    uint32_t id = 0;
+    if (!history.findMaterial(material, id))  {
+        cout << "No results for " << material << '\n';
+        return 0;
+    }
+    const uint32_t* ids = history.getMaterials();
+    const double* indices = history.getIndices();
+    const double* thicknesses = history.getThicknesses();
+    const int64_t* timestamps = history.getTimestamps();
+    ostringstream out;
+    out.setf(ios::fixed);
+    out << setw(MATERIAL_WIDTH) << left << "Timestamp"
+        << setw(INDEX_WIDTH) << right << "Index"
+        << setw(THICKNESS_WIDTH) << "Thickness (nm)" << '\n';
+    for (size_t i = 0; i < history.size(); i++) {
+        if (ids[i] == id)  {
+            out << setw(MATERIAL_WIDTH) << left << timestamps[i]
+                << setw(INDEX_WIDTH) << right << setprecision(2) << indices[i]
+                << setw(THICKNESS_WIDTH) << setprecision(1) << thicknesses[i] << '\n';
+        }
+    }
+    cout << out.str();
+    return 0;
+}
+
+int runOptics(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material)  {
+    int pos = filmIndex.find(material);
+    if (pos < 0)  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return 1;
+    }
+    const Wavelength_grid& grid = tables.getGrid();
+    ostringstream out;
+    out.setf(ios::fixed);
+    out << materialList[pos].getMat() << ": " << formatOptics(materialList[pos]) << '\n'
+        << setw(INDEX_WIDTH) << right << "nm" << setw(INDEX_WIDTH) << "n"
+        << setw(INDEX_WIDTH) << "k" << '\n';
+    for (size_t i = 0; i < grid.count; i++) {
+        double wavelength = grid.getWavelength(i);
+        out << setw(INDEX_WIDTH) << setprecision(1) << wavelength
+            << setw(INDEX_WIDTH) << setprecision(4) << tables.getIndex(pos, wavelength)
+            << setw(INDEX_WIDTH) << setprecision(4) << tables.getExtinction(pos, wavelength) << '\n';
+    }
+    cout << out.str();
+    return 0;
+}
+
+int runFit(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const vector<string>& files)  {
+    Thin_film film;
+    if (!resolveMaterial(materialList, filmIndex, material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return files.size();
+    }
+    int pos = filmIndex.find(material);
+    Fringe_counter counter;
+    Reflectance_fit fitter;
+    Spectrum spectrum;
+    int errors = 0;
+    ostringstream out;
+    out.setf(ios::fixed);
+    out << setw(MATERIAL_WIDTH) << left << "Material"
+        << setw(INDEX_WIDTH) << right << "Index"
+        << setw(MAXIMA_WIDTH) << "# of maxima"
+        << setw(THICKNESS_WIDTH) << "Thickness (nm)"
+        << setw(THICKNESS_WIDTH) << "Fit (nm)"
+        << setw(MAXIMA_WIDTH) << "Residual" << '\n';
+    for (unsigned i = 0; i < files.size(); i++) {
+        if (!loadSpectrum(spectrum, files[i]))  {
+            cerr << "Spectrum " << files[i] << " could not be read.\n";
+            errors++;
+            continue;
+        }
+        film.setspectralRange(spectrum.getspectralRange());
+        int maxima = counter.countMaxima(spectrum);
+        film.setnumberOfMaxima(maxima);
+        Fit_result result = cachedFit(fitter, spectrum, film, &tables, pos);
+        out << setw(MATERIAL_WIDTH) << left << film.getMat()
+            << setw(INDEX_WIDTH) << right << setprecision(2) << film.getIndex()
+            << setw(MAXIMA_WIDTH) << setprecision(2) << double(maxima)
+            << setw(THICKNESS_WIDTH) << setprecision(1) << film.getThickness()
+            << setw(THICKNESS_WIDTH) << setprecision(1) << result.thickness
+            << setw(MAXIMA_WIDTH) << setprecision(5) << result.residual << '\n';
+    }
+    cout << out.str();
+    return errors;
+}
+
+int runFft(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const vector<string>& files)  {
+    Thin_film film;
+    if (!resolveMaterial(materialList, filmIndex, material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return files.size();
+    }
+    int pos = filmIndex.find(material);
+    Fringe_counter counter;
+    Fft_estimator estimator;
+    Spectrum spectrum;
+    int errors = 0;
+    string out;
+    formatResultHeader(out);
+    out.pop_back();
+    appendPadded(out, "FFT (nm)", THICKNESS_WIDTH, false);
+    out += '\n';
+    for (unsigned i = 0; i < files.size(); i++) {
+        if (!loadSpectrum(spectrum, files[i]))  {
+            cerr << "Spectrum " << files[i] << " could not be read.\n";
+            errors++;
+            continue;
+        }
+        int maxima = counter.countMaxima(spectrum);
+        film.setspectralRange(spectrum.getspectralRange());
+        film.setnumberOfMaxima(maxima);
+        double thickness = estimator.estimate(spectrum, film, &tables, pos);
+        if (thickness <= 0.0)  {
+            cerr << "Spectrum " << files[i] << " holds too few fringes for the FFT.\n";
+            errors++;
+            continue;
+        }
+        //the fringe count columns of print(), with the estimate appended
+        formatFilmResult(out, film.getMat(), film.getIndex(), maxima, film.getThickness());
+        out.pop_back();
+        appendFixed(out, thickness, THICKNESS_WIDTH, 1);
+        out += '\n';
+    }
+    cout << out;
+    return errors;
+}
+
+int runFitStack(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, const string& layers, const vector<string>& files)  {
+    Film_stack stack;
+    size_t start = 0;
+    while (start <= layers.size()) {
+        size_t end = layers.find(',', start);
+        end = end == string::npos ? layers.size() : end;
+        string layer = layers.substr(start, end - start);
+        size_t equals = layer.rfind('=');
+        Thin_film film;
+        double thickness = 0.0;
+        if (equals == string::npos || !parseNumber(layer.substr(equals + 1), thickness)
+            || thickness < 0.0)  {
+            cerr << "Layer " << layer << " must be given as material=thickness.\n";
+            return files.size();
+        }
+        string material = layer.substr(0, equals);
+        if (!resolveMaterial(materialList, filmIndex, material, film))  {
+            cerr << "Material " << material << " is not in the library.\n";
+            return files.size();
+        }
+        stack.addLayer(film, thickness, &tables, filmIndex.find(material));
+        start = end + 1;
+    }
+    Stack_fit fitter;
+    Spectrum spectrum;
+    int errors = 0;
+    ostringstream out;
+    out.setf(ios::fixed);
+    out << setw(MATERIAL_WIDTH) << left << "Spectrum" << right;
+    for (unsigned j = 0; j < stack.getLayerCount(); j++) {
+        out << setw(THICKNESS_WIDTH) << stack.getFilm(j).getMat() + " (nm)";
+    }
+    out << setw(MAXIMA_WIDTH) << "Residual" << '\n';
+    for (unsigned i = 0; i < files.size(); i++) {
+        if (!loadSpectrum(spectrum, files[i]))  {
+            cerr << "Spectrum " << files[i] << " could not be read.\n";
+            errors++;
+            continue;
+        }
+        fitter.prepare(spectrum, stack);
+        Stack_fit_result result = fitter.fit();
+        out << setw(MATERIAL_WIDTH) << left << files[i] << right << setprecision(1);
+        for (unsigned j = 0; j < result.thickness.size(); j++) {
+            out << setw(THICKNESS_WIDTH) << result.thickness[j];
+        }
+        out << setw(MAXIMA_WIDTH) << setprecision(5) << result.residual << '\n';
+    }
+    cout << out.str();
+    return errors;
+}
+
+int runServe(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, const string& address)  {
+    Film_server server(materialList, filmIndex, tables);
+    setStatsEnabled(true);
+    if (!server.listen(address))  {
+        return 1;
+    }
+    cerr << "Serving " << materialList.size() << " films on " << address << '\n';
+    return server.run() ? 0 : 1;
+}
+
+/**
+    times a task
+    @param task The work to time
+    @param repeats How often to run it
+    @return the best time in seconds
+*/
+static double bestTime(const function<void()>& task, int repeats)  {
+    double best = 1e300;
+    for (int i = 0; i < repeats; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        task();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = seconds < best ? seconds : best;
+    }
+    return best;
+}
+
+//builds a spectrum of a film on silicon from the reflectance model
+static void syntheticSpectrum(Film_stack& stack, Spectrum& spectrum, size_t points)  {
+    spectrum.wavelength.resize(points);
+    for (size_t i = 0; i < points; i++) {
+        spectrum.wavelength[i] = 400.0 + 600.0 * i / (points - 1);
+    }
+    stack.prepare(spectrum.wavelength);
+    const double* r = stack.reflectance();
+    spectrum.intensity.resize(points);
+    for (size_t i = 0; i < points; i++) {
+        //a deterministic ripple stands in for noise
+        spectrum.intensity[i] = 0.8 * r[i] + 0.05 + 0.002 * sin(i * 12.9898);
+    }
+}
+
+int runBench(size_t maxFilms, const string& outFile)  {
+    vector<Bench_result> results;
+    auto record = [&results](const string& name, size_t items, double seconds) {
+        Bench_result result;
+        result.name = name;
+        result.items = items;
+        result.seconds = seconds;
+        results.push_back(result);
+        cerr << setw(MATERIAL_WIDTH) << left << name << right << setw(THICKNESS_WIDTH)
+            << fixed << setprecision(1) << seconds * 1e9 / items << " ns/item\n";
+    };
+    error_code error;
+    filesystem::path directory = filesystem::temp_directory_path(error)
+        / ("thinFilmCalc-bench-" + to_string(chrono::steady_clock::now().time_since_epoch().count()));
+    filesystem::create_directories(directory, error);
+    if (error)  {
+        cerr << "Cannot create " << directory.string() << '\n';
+        return 1;
+    }
+
+    //thickness of single films and of the bulk kernels
+    const size_t KERNEL_ITEMS = 1 << 20;
+    vector<Thin_film> films(KERNEL_ITEMS);
+    Film_batch batch;
+    batch.reserve(KERNEL_ITEMS);
+    for (size_t i = 0; i < KERNEL_ITEMS; i++) {
+        films[i].setIndex(1.3 + (i % 97) * 0.01);
+        films[i].setspectralRange(300 + i % 700);
+        films[i].setnumberOfMaxima(1 + i % 40);
+        batch.add(films[i].getIndex(), films[i].getspectralRange(), 1 + i % 40);
+    }
+    volatile double sink = 0.0;
+    record("thickness_film", KERNEL_ITEMS, bestTime([&] {
+        double sum = 0.0;
+        for (size_t i = 0; i < KERNEL_ITEMS; i++) {
+            sum += films[i].getThickness();
+        }
+        sink = sink + sum;
+    }, 5));
+    Simd_level level = getSimdLevel();
+    Simd_level levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+    for (Simd_level candidate : levels) {
+        if (candidate > detectSimdLevel())  {
+            continue;
+        }
+        setSimdLevel(candidate);
+        record(string("thickness_batch_") + simdLevelName(candidate), KERNEL_ITEMS,
+            bestTime([&] { batch.calculateThickness(); }, 10));
+    }
+    //Philox counters for the Monte Carlo uncertainty, 4 words each
+    Counter_rng rng(1);
+    vector<uint32_t> words(4 * UNCERTAINTY_BLOCK);
+    for (Simd_level candidate : levels) {
+        if (candidate > SIMD_AVX2 || candidate > detectSimdLevel())  {
+            continue;
+        }
+        setSimdLevel(candidate);
+        record(string("philox_") + simdLevelName(candidate), KERNEL_ITEMS, bestTime([&] {
+            for (size_t first = 0; first < KERNEL_ITEMS; first += UNCERTAINTY_BLOCK) {
+                rng.generate(first, 0, UNCERTAINTY_BLOCK, words.data());
+                sink = sink + words[0];
+            }
+        }, 5));
+    }
+    setSimdLevel(level);
+
+    //library load and save
+    for (size_t count = 1000; count <= maxFilms; count *= 10) {
+        vector<Thin_film> library(count);
+        for (size_t i = 0; i < count; i++) {
+            library[i].setMat("Film" + to_string(i));
+            library[i].setIndex(1.3 + (i % 97) * 0.01);
+        }
+        string fileName = (directory / ("films" + to_string(count) + ".txt")).string();
+        int repeats = count >= 1000000 ? 1 : 3;
+        record("save_films_" + to_string(count), count,
+            bestTime([&] { saveData(library, fileName); }, repeats));
+        record("load_films_" + to_string(count), count, bestTime([&] {
+            vector<Thin_film> loaded;
+            loadData(loaded, fileName);
+        }, repeats));
+        record("index_films_" + to_string(count), count, bestTime([&] {
+            Film_index index;
+            index.build(library, false);
+        }, repeats));
+        //only one synthetic library is on the disk at a time
+        filesystem::remove(fileName, error);
+    }
+
+    //result writing, one open and close per result as the interactive menu does
+    const size_t APPEND_ITEMS = 10000;
+    string dataName = (directory / "data.txt").string();
+    record("append_result_file", APPEND_ITEMS, bestTime([&] {
+        for (size_t i = 0; i < APPEND_ITEMS; i++) {
+            ofstream fout(dataName, ios::app);
+            films[i].writeMeasResult(fout);
+        }
+    }, 3));
+
+    //result writing through the sink at several policies
+    struct Bench_policy  {
+        const char* name;
+        size_t flushBytes;
+        Durability durability;
+        size_t items;
+    };
+    const Bench_policy policies[] = {
+        { "sink_buffered", 1 << 20, DURABILITY_NONE, KERNEL_ITEMS },
+        { "sink_64k", 1 << 16, DURABILITY_NONE, KERNEL_ITEMS },
+        { "sink_every_record", 0, DURABILITY_NONE, 100000 },
+        { "sink_buffered_fsync", 1 << 20, DURABILITY_FSYNC, KERNEL_ITEMS },
+        { "sink_every_record_fsync", 0, DURABILITY_FSYNC, 1000 },
+    };
+    for (const Bench_policy& benchPolicy : policies) {
+        Sink_policy policy;
+        policy.flushBytes = benchPolicy.flushBytes;
+        policy.durability = benchPolicy.durability;
+        record(benchPolicy.name, benchPolicy.items, bestTime([&] {
+            filesystem::remove(dataName, error);
+            Result_sink output(dataName, policy);
+            for (size_t i = 0; i < benchPolicy.items; i++) {
+                output.write("SiO2", batch.index[i], batch.thickness[i]);
+            }
+            output.commit();
+        }, 3));
+    }
+
+    //fringe counting and fits of synthetic 4096 point spectra
+    Thin_film oxide;
+    oxide.setMat("SiO2");
+    oxide.setIndex(1.46);
+    Film_stack single;
+    single.addLayer(oxide, 1500.0);
+    Spectrum spectrum;
+    syntheticSpectrum(single, spectrum, 4096);
+    Fringe_counter counter;
+    const size_t FRINGE_ITEMS = 1000;
+    record("fringe_count_4096", FRINGE_ITEMS, bestTime([&] {
+        for (size_t i = 0; i < FRINGE_ITEMS; i++) {
+            sink = sink + counter.countMaxima(spectrum);
+        }
+    }, 3));
+    Fft_estimator estimator;
+    record("fft_estimate_4096", FRINGE_ITEMS, bestTime([&] {
+        for (size_t i = 0; i < FRINGE_ITEMS; i++) {
+            sink = sink + estimator.estimate(spectrum, oxide);
+        }
+    }, 3));
+    Reflectance_fit fitter;
+    const size_t FIT_ITEMS = 100;
+    record("fit_single_4096", FIT_ITEMS, bestTime([&] {
+        for (size_t i = 0; i < FIT_ITEMS; i++) {
+            fitter.prepare(spectrum, oxide);
+            sink = sink + fitter.fit(1300.0).thickness;
+        }
+    }, 3));
+    Thin_film nitride;
+    nitride.setMat("SiN");
+    nitride.setIndex(2.0);
+    Film_stack stack;
+    stack.addLayer(nitride, 120.0);
+    stack.addLayer(oxide, 1000.0);
+    syntheticSpectrum(stack, spectrum, 4096);
+    stack.setThickness(0, 110.0);
+    stack.setThickness(1, 950.0);
+    Stack_fit stackFitter;
+    const size_t STACK_ITEMS = 10;
+    record("fit_stack2_4096", STACK_ITEMS, bestTime([&] {
+        for (size_t i = 0; i < STACK_ITEMS; i++) {
+            stackFitter.prepare(spectrum, stack);
+            sink = sink + stackFitter.fit().thickness[0];
+        }
+    }, 3));
+
+    //server requests without the socket
+    vector<Thin_film> library(1, oxide);
+    Film_index libraryIndex;
+    libraryIndex.build(library, false);
+    Dispersion_tables tables;
+    tables.build(library, Wavelength_grid());
+    Film_server server(library, libraryIndex, tables);
+    Film_server::Session session;
+    const char request[] = "T SiO2 600 7";
+    string response;
+    const size_t REQUEST_ITEMS = 1000000;
+    record("server_thickness_request", REQUEST_ITEMS, bestTime([&] {
+        for (size_t i = 0; i < REQUEST_ITEMS; i++) {
+            response.clear();
+            server.handle(session, request, request + sizeof(request) - 1, response);
+        }
+    }, 3));
+    filesystem::remove_all(directory, error);
+
+    string json = "{\"version\":1,\"simd\":\"";
+    json += simdLevelName(getSimdLevel());
+    json += "\",\"threads\":";
+    json += to_string(thread::hardware_concurrency());
+    json += ",\"results\":[";
+    for (unsigned i = 0; i < results.size(); i++) {
+        json += i > 0 ? ",\n" : "\n";
+        json += "{\"name\":\"" + results[i].name + "\",\"items\":" + to_string(results[i].items)
+            + ",\"seconds\":";
+        appendShortest(json, results[i].seconds);
+        json += ",\"ns_per_item\":";
+        appendShortest(json, results[i].seconds * 1e9 / results[i].items);
+        json += '}';
+    }
+    json += "\n]}\n";
+    if (outFile.empty())  {
+        cout << json;
+        return 0;
+    }
+    if (!replaceFile(outFile, json))  {
+        cerr << "Output file " << outFile << " failed to open.\n";
+        return 1;
+    }
+    return 0;
+}
+
+void printStats()  {
+    cerr << formatStats();
+}
+
+//reads what standard input has available, at most size bytes; 0 at the end
+static size_t readInput(char* buffer, size_t size)  {
+#ifdef THIN_FILM_POSIX
+    while (true) {
+        ssize_t got = read(0, buffer, size);
+        if (got < 0 && errno == EINTR)  {
+            continue;
+        }
+        return got > 0 ? size_t(got) : 0;
+    }
+#else
+    return fread(buffer, 1, size, stdin);
+#endif
+}
+
+//whether standard input can be read without waiting
+static bool inputReady()  {
+#ifdef THIN_FILM_POSIX
+    pollfd in = { 0, POLLIN, 0 };
+    while (true) {
+        int ready = poll(&in, 1, 0);
+        if (ready < 0 && errno == EINTR)  {
+            continue;
+        }
+        return ready != 0;
+    }
+#else
+    return false;
+#endif
+}
+
+//writes the output buffer to standard output
+static bool writeOutput(string& output)  {
+    bool ok = fwrite(output.data(), 1, output.size(), stdout) == output.size()
+        && fflush(stdout) == 0;
+    output.clear();
+    return ok;
+}
+
+//appends a string as a JSON string literal
+static void appendJsonString(string& out, const string& text)  {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\')  {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20)  {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else  {
+            out += c;
+        }
     }
+    out += '"';
 }
-cout << "\nGoodbye!\n";
 
-return 0;
+//appends a number as JSON, which has no NaN or infinity
+static void appendJsonNumber(string& out, double value)  {
+    if (isfinite(value))  {
+        appendShortest(out, value);
+    } else  {
+        out += "null";
+    }
 }
 
-void calculateThickness(vector<Thin_film>& materialList)    {
-    string repeat = "y";
-        while(repeat =="y") {
-            cout << "Read material data from library? (y/n): ";
-            string libFilm = "y";
-            cin >> libFilm;
-            if (libFilm == "y") {
-                int pos = getFilmIndex(materialList);
-                Thin_film film = materialList[pos];
-                materialList.push_back(film);
-                cout << "Enter the spectral bandwidth over which the spectra was acquired in nm: ";
-                double newSpectralRange;
-                cin >> newSpectralRange;
-                film.setspectralRange(newSpectralRange);
-                cout << "Enter the number of maxima within the spectral range: ";
-                double newnumberOfMaxima;
-                cin >> newnumberOfMaxima;
-                film.setnumberOfMaxima(newnumberOfMaxima);
-                cout << endl;
-                cout << setw(MATERIAL_WIDTH) << left << "Material"
-                    << setw(INDEX_WIDTH) << right << "Index"
-                    << setw(MAXIMA_WIDTH) << right << "# of maxima"
-                    << setw(THICKNESS_WIDTH) << "Thickness (nm)" << endl;
-                film.print();
-                ofstream fout;
-                film.writeMeasResultFile(fout, "data.txt");
+int runPipe(Film_library& library, Pipe_format format, size_t flushEvery)  {
+    const size_t BUFFER_SIZE = 1 << 20;
+    const size_t BLOCK_SIZE = 4096;
+    vector<char> input(BUFFER_SIZE);
+    string output;
+    output.reserve(BUFFER_SIZE + 4096);
+    Film_batch batch;
+    batch.reserve(BLOCK_SIZE);
+    vector<string> mats(BLOCK_SIZE);
+    long lineNumber = 0;
+    int errors = 0;
+    size_t unflushed = 0;
+    bool failed = false;
+    if (format == PIPE_TEXT)  {
+        formatResultHeader(output);
+    } else if (format == PIPE_CSV)  {
+        output += "material,index,spectralRange,numberOfMaxima,thickness\n";
+    }
+
+    //calculates the gathered rows and formats them
+    auto drain = [&]() {
+        const double* thickness = batch.calculateThickness();
+        Stage_timer timer(STAGE_FORMAT_RESULTS, batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            switch (format) {
+                case PIPE_TEXT:
+                    formatFilmResult(output, mats[i], batch.index[i], batch.numberOfMaxima[i],
+                        thickness[i]);
+                    break;
+                case PIPE_CSV:
+                    formatCsvResult(output, mats[i], batch.index[i], batch.spectralRange[i],
+                        batch.numberOfMaxima[i], thickness[i]);
+                    break;
+                case PIPE_JSON:
+                    output += "{\"material\":";
+                    appendJsonString(output, mats[i]);
+                    output += ",\"index\":";
+                    appendJsonNumber(output, batch.index[i]);
+                    output += ",\"spectralRange\":";
+                    appendJsonNumber(output, batch.spectralRange[i]);
+                    output += ",\"numberOfMaxima\":";
+                    appendJsonNumber(output, batch.numberOfMaxima[i]);
+                    output += ",\"thickness\":";
+                    appendJsonNumber(output, thickness[i]);
+                    output += "}\n";
+                    break;
             }
-              else  {
-                  Thin_film unknown;
-                  unknown.read();
-                  materialList.push_back(unknown);
-                  cout << endl;
-                  cout << setw(MATERIAL_WIDTH) << left << "Material"
-                    << setw(INDEX_WIDTH) << right << "Index"
-                    << setw(MAXIMA_WIDTH) << right << "# of maxima"
-                    << setw(THICKNESS_WIDTH) << "Thickness (nm)" << endl;
-                  unknown.print();
-                  cout << "Save material and index of this film (y/n)? ";
-                  string saveMatIndex = "y";
-                  cin >> saveMatIndex;
-                  if (saveMatIndex == "y")  {
-                      saveData(materialList, "films.txt");
-                  }
-              ofstream fout;
-              unknown.writeMeasResultFile(fout, "data.txt");
-              }
-        cout << "Enter another thin film? (y/n): ";
-        cin >> repeat;
+            unflushed++;
+            if ((flushEvery > 0 && unflushed >= flushEvery) || output.size() >= BUFFER_SIZE)  {
+                failed = !writeOutput(output) || failed;
+                unflushed = 0;
+            }
+        }
+        batch.clear();
+    };
+
+    size_t filled = 0;
+    bool more = true;
+    while (more) {
+        if (filled == input.size())  {
+            //a line longer than the buffer
+            input.resize(input.size() * 2);
+        }
+        //rows never wait in the buffer while the producer is quiet
+        if (!output.empty() && !inputReady())  {
+            failed = !writeOutput(output) || failed;
+            unflushed = 0;
+        }
+        size_t got = readInput(input.data() + filled, input.size() - filled);
+        more = got > 0;
+        filled += got;
+        Stage_timer parsing(STAGE_PARSE, 0);
+        parsing.addBytes(got);
+        size_t rows = 0;
+        //complete lines only, unless the input ended
+        const char* p = input.data();
+        const char* end = p + filled;
+        if (more)  {
+            while (end > p && end[-1] != '\n') {
+                end--;
+            }
+        }
+        const char* lineBegin = 0;
+        const char* lineEnd = 0;
+        while (nextLine(p, end, lineBegin, lineEnd)) {
+            lineNumber++;
+            if (lineBegin == lineEnd || *lineBegin == '#')  {
+                continue;
+            }
+            double index = 0.0;
+            double spectralRange = 0.0;
+            double numberOfMaxima = 0.0;
+            bool header = false;
+            if (!parseBatchLine(lineBegin, lineEnd, library, mats[batch.size()],
+                index, spectralRange, numberOfMaxima, header))  {
+                //tolerate a header row
+                if (lineNumber == 1 && header)  {
+                    continue;
+                }
+                cerr << "<stdin>:" << lineNumber << ": malformed measurement: "
+                    << string(lineBegin, lineEnd) << '\n';
+                errors++;
+                continue;
+            }
+            batch.add(index, spectralRange, numberOfMaxima);
+            rows++;
+            if (batch.size() == BLOCK_SIZE)  {
+                drain();
+            }
+        }
+        parsing.setItems(rows);
+        parsing.finish();
+        //rows never wait for more lines
+        drain();
+        size_t consumed = end - input.data();
+        memmove(input.data(), input.data() + consumed, filled - consumed);
+        filled -= consumed;
+    }
+    if (!output.empty())  {
+        failed = !writeOutput(output) || failed;
+    }
+    if (failed)  {
+        cerr << "Standard output could not be written.\n";
+        exit(-1);
     }
+    return errors;
 }
 
-void addMaterial()  {
-	Thin_film unknown;
-    cout << "Enter the name of the film: ";
-    cin >>ws;
-	string mat;
-    getline(cin, mat);
-	unknown.setMat(mat);
-    cout << "Enter the refractive index of the film: ";
-	double index = 0;
-    cin >> index;
-	unknown.setIndex(index);
-    cout << endl;
-    cout << setw(MATERIAL_WIDTH) << left << "Material"
-         << setw(INDEX_WIDTH) << right << "Index" << endl
-         << setw(MATERIAL_WIDTH) << left << mat
-         << setw(INDEX_WIDTH) << right << index <<endl;
-    cout << endl << "Save material and index of this film (y/n)? ";
-    string saveMatIndex = "n";
-    cin >> saveMatIndex;
-    if (saveMatIndex == "y")  {
-        ofstream fout("films.txt", ios::app);
-        if (fout.fail()) {
-            cout << "Output file failed to open.\n";
-            exit(-1);
+/**
+    saves the sidecar of a results file under the lock the stations append
+    under; the lock is taken on the existing file, so a rotated file is not
+    created again
+    @param stats The statistics of the results file
+    @param fileName The name of the results file
+    @param catchUp Whether to take in results appended before the lock first
+    @return false if the sidecar was not saved
+*/
+static bool saveStats(Stats_index& stats, const string& fileName, bool catchUp)  {
+    bool saved = false;
+#ifdef THIN_FILM_POSIX
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)  {
+        return false;
+    }
+    {
+        File_lock exclusive(fd);
+        if (exclusive.isLocked() && (!catchUp || stats.refresh()))  {
+            saved = stats.save();
         }
-        fout << mat << endl << index << endl;
-        fout.close();
     }
+    close(fd);
+#endif
+    return saved;
 }
 
-void deleteFilm(vector<Thin_film>& materialList)  {
-	Thin_film film;
-	int pos = getFilmIndex(materialList);
-	    for (unsigned i = pos; i < materialList.size() - 1; i++) {
-        materialList[i] = materialList[i + 1];
+int runMaterialStats(const string& material, const string& fileName)  {
+    Stats_index index(fileName);
+    uint64_t covered = index.getCovered();
+    //a missing or stale sidecar is rebuilt before the lock is taken
+    if (!index.refresh())  {
+        cerr << "Results file " << fileName << " failed to open.\n";
+        return 1;
     }
-    materialList.pop_back();
-	saveData(materialList, "films.txt");
+    if (index.getCovered() != covered && filesystem::path(fileName).filename() == "data.txt")  {
+        saveStats(index, fileName, true);
+    }
+    const Thickness_stats* stats = index.find(material);
+    if (stats == 0)  {
+        cerr << "There are no results for " << material << " in " << fileName << ".\n";
+        return 1;
+    }
+    static const string columns[] = { "Material", "Results", "Mean (nm)", "Stddev (nm)",
+        "Min (nm)", "Max (nm)", "Trend (nm/result)" };
+    string out;
+    appendPadded(out, columns[0], MATERIAL_WIDTH, true);
+    appendPadded(out, columns[1], INDEX_WIDTH, false);
+    for (int i = 2; i < 7; i++) {
+        appendPadded(out, columns[i], THICKNESS_WIDTH, false);
+    }
+    out += '\n';
+    appendPadded(out, material, MATERIAL_WIDTH, true);
+    appendPadded(out, to_string(stats->count), INDEX_WIDTH, false);
+    appendFixed(out, stats->mean, THICKNESS_WIDTH, 1);
+    appendFixed(out, stats->getStddev(), THICKNESS_WIDTH, 1);
+    appendFixed(out, stats->min, THICKNESS_WIDTH, 1);
+    appendFixed(out, stats->max, THICKNESS_WIDTH, 1);
+    appendFixed(out, stats->getTrend(), THICKNESS_WIDTH, 2);
+    out += "\nLatest results (nm):";
+    for (int i = 0; i < stats->recentCount; i++) {
+        out += ' ';
+        appendFixed(out, stats->recent[i], 0, 1);
+    }
+    out += '\n';
+    cout << out;
+    return 0;
 }
 
-void loadData(vector<Thin_film>& materialList, string fileName) {
-    Thin_film film;
+//set by SIGINT and SIGTERM to end --follow
+static volatile sig_atomic_t followStopped = 0;
 
-    ifstream fin(fileName.c_str());
-    if (fin.fail()) {
-        cout << "File " << fileName << " failed to open.\n";
-        exit(1);
+static void stopFollowing(int)  {
+    followStopped = 1;
+}
+
+/**
+    appends one followed result with the running statistics of its material
+    @param out The output
+    @param format The output layout
+    @param mat The material
+    @param record The result
+    @param stats The statistics of the material including the result
+*/
+static void appendFollowedResult(string& out, Pipe_format format, const string& mat,
+    const Meas_record& record, const Thickness_stats& stats)  {
+    switch (format) {
+        case PIPE_TEXT:
+            appendPadded(out, mat, MATERIAL_WIDTH, true);
+            appendFixed(out, record.index, INDEX_WIDTH, 2);
+            appendFixed(out, record.thickness, THICKNESS_WIDTH, 1);
+            appendPadded(out, to_string(stats.count), INDEX_WIDTH, false);
+            appendFixed(out, stats.mean, THICKNESS_WIDTH, 1);
+            appendFixed(out, stats.getStddev(), THICKNESS_WIDTH, 1);
+            out += '\n';
+            break;
+        case PIPE_CSV:
+            out += mat;
+            out += ',';
+            appendShortest(out, record.index);
+            out += ',';
+            appendShortest(out, record.thickness);
+            out += ',' + to_string(stats.count) + ',';
+            appendShortest(out, stats.mean);
+            out += ',';
+            appendShortest(out, stats.getStddev());
+            out += '\n';
+            break;
+        case PIPE_JSON:
+            out += "{\"material\":";
+            appendJsonString(out, mat);
+            out += ",\"index\":";
+            appendJsonNumber(out, record.index);
+            out += ",\"thickness\":";
+            appendJsonNumber(out, record.thickness);
+            out += ",\"results\":" + to_string(stats.count) + ",\"mean\":";
+            appendJsonNumber(out, stats.mean);
+            out += ",\"stddev\":";
+            appendJsonNumber(out, stats.getStddev());
+            out += "}\n";
+            break;
     }
+}
 
-    while(fin.good()) {
-        film.read(fin);
-        if (fin.good()) {
-            materialList.push_back(film);
+int runFollow(const string& fileName, Pipe_format format)  {
+    Stats_index stats(fileName);
+    if (!stats.refresh())  {
+        cerr << "Results file " << fileName << " failed to open.\n";
+        return 1;
+    }
+    bool dirty = true;
+    Result_follower follower(fileName, stats.getCovered());
+    if (follower.getOffset() != stats.getCovered())  {
+        //rewritten since the refresh
+        stats.clear();
+    }
+    string output;
+    if (format == PIPE_TEXT)  {
+        static const string columns[] = { "Material", "Index", "Thickness (nm)", "Results",
+            "Mean (nm)", "Stddev (nm)" };
+        appendPadded(output, columns[0], MATERIAL_WIDTH, true);
+        appendPadded(output, columns[1], INDEX_WIDTH, false);
+        appendPadded(output, columns[2], THICKNESS_WIDTH, false);
+        appendPadded(output, columns[3], INDEX_WIDTH, false);
+        appendPadded(output, columns[4], THICKNESS_WIDTH, false);
+        appendPadded(output, columns[5], THICKNESS_WIDTH, false);
+        output += '\n';
+    } else if (format == PIPE_CSV)  {
+        output += "material,index,thickness,results,mean,stddev\n";
+    }
+    Meas_record record;
+    follower.subscribe([&](const char* begin, const char* end) {
+        for (const char* p = begin; p < end;) {
+            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+            stats.addLines(p, lineEnd + 1);
+            if (parseMeasRecord(p, lineEnd, record) && isfinite(record.thickness))  {
+                const string& mat = materialNames().get(record.mat);
+                appendFollowedResult(output, format, mat, record, *stats.find(mat));
+            }
+            p = lineEnd + 1;
+        }
+        dirty = true;
+    }, [&]() {
+        cerr << "Results file " << fileName << " was rotated or rewritten, following it from the start.\n";
+        stats.clear();
+        dirty = true;
+    });
+#ifdef THIN_FILM_POSIX
+    signal(SIGINT, stopFollowing);
+    signal(SIGTERM, stopFollowing);
+#endif
+    //the follower hands the lines out, so the sidecar is only saved while
+    //it has caught up, once a rotated file has been created again
+    bool indexed = filesystem::path(fileName).filename() == "data.txt";
+    auto save = [&]() {
+        dirty = indexed && !saveStats(stats, fileName, false);
+    };
+    chrono::steady_clock::time_point saved = chrono::steady_clock::now();
+    while (!followStopped) {
+        follower.poll();
+        if (!output.empty() && !writeOutput(output))  {
+            return 1;
+        }
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (dirty && now - saved >= chrono::seconds(1))  {
+            save();
+            saved = now;
+        }
+        follower.wait(FOLLOW_POLL_MILLIS);
+    }
+    if (dirty)  {
+        save();
+    }
+    return 0;
+}
+
+int runIdentify(const vector<Thin_film>& materialList, const Dispersion_tables& tables,
+    const string& file, bool pairs)  {
+    Spectrum spectrum;
+    if (!loadSpectrum(spectrum, file))  {
+        cerr << "Spectrum " << file << " could not be read.\n";
+        return 1;
+    }
+    Fringe_counter counter;
+    double maxima = counter.countMaxima(spectrum);
+    double range = spectrum.getspectralRange();
+
+    //coarse scan of every film around its fringe count estimate; films the
+    //estimate rules out (index 1 or below) are not scanned at all, and films
+    //without dispersion share one candidate per index since they fit alike
+    struct Candidate  {
+        vector<size_t> films;
+        size_t pos;
+        double start;
+        double cost;
+        Fit_result result;
+    };
+    vector<Candidate> candidates;
+    unordered_map<double, size_t> byIndex;
+    for (size_t i = 0; i < materialList.size(); i++) {
+        Thin_film film = materialList[i];
+        film.setspectralRange(range);
+        film.setnumberOfMaxima(maxima);
+        double estimate = film.getThickness();
+        if (!(estimate > 0.0 && estimate < 1e9))  {
+            continue;
+        }
+        if (film.getDispersion() == 0)  {
+            unordered_map<double, size_t>::iterator found = byIndex.find(film.getIndex());
+            if (found != byIndex.end())  {
+                candidates[found->second].films.push_back(i);
+                continue;
+            }
+            byIndex[film.getIndex()] = candidates.size();
+        }
+        Candidate candidate;
+        candidate.films.push_back(i);
+        candidate.pos = i;
+        candidate.start = estimate;
+        candidate.cost = 1e300;
+        candidates.push_back(candidate);
+    }
+    Work_pool pool;
+    vector<Reflectance_fit> fitters(pool.size());
+    pool.run(candidates.size(), [&](size_t item, unsigned worker) {
+        Candidate& candidate = candidates[item];
+        Reflectance_fit& fitter = fitters[worker];
+        fitter.prepare(spectrum, materialList[candidate.pos], &tables, int(candidate.pos));
+        candidate.start = fitter.scan(candidate.start, candidate.cost);
+    });
+    sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.cost < b.cost;
+    });
+    //the absolute floor keeps close fits when the best one is exact
+    double mean = 0.0;
+    double variance = 0.0;
+    for (size_t i = 0; i < spectrum.intensity.size(); i++) {
+        double delta = spectrum.intensity[i] - mean;
+        mean += delta / double(i + 1);
+        variance += delta * (spectrum.intensity[i] - mean);
+    }
+    if (!spectrum.intensity.empty())  {
+        variance /= double(spectrum.intensity.size());
+    }
+    double cutoff = candidates.empty() ? 0.0 : IDENTIFY_PRUNE_RATIO * candidates[0].cost;
+    cutoff = max(cutoff, IDENTIFY_PRUNE_FLOOR * variance);
+    size_t kept = 0;
+    while (kept < candidates.size() && kept < IDENTIFY_MAX_FILMS
+        && (kept == 0 || candidates[kept].cost <= cutoff)) {
+        kept++;
+    }
+    candidates.resize(kept);
+
+    //refine the survivors and rank them by the full residual
+    pool.run(candidates.size(), [&](size_t item, unsigned worker) {
+        Candidate& candidate = candidates[item];
+        Reflectance_fit& fitter = fitters[worker];
+        fitter.prepare(spectrum, materialList[candidate.pos], &tables, int(candidate.pos));
+        candidate.result = fitter.refine(candidate.start);
+    });
+    sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.result.residual < b.result.residual;
+    });
+    string out;
+    appendPadded(out, "Material", MATERIAL_WIDTH, true);
+    appendPadded(out, "Index", INDEX_WIDTH, false);
+    appendPadded(out, "Fit (nm)", THICKNESS_WIDTH, false);
+    appendPadded(out, "Residual", MAXIMA_WIDTH, false);
+    out += '\n';
+    size_t rows = 0;
+    for (size_t i = 0; i < candidates.size() && rows < IDENTIFY_MAX_FILMS; i++) {
+        for (size_t j = 0; j < candidates[i].films.size() && rows < IDENTIFY_MAX_FILMS; j++) {
+            const Thin_film& film = materialList[candidates[i].films[j]];
+            appendPadded(out, film.getMat(), MATERIAL_WIDTH, true);
+            appendFixed(out, film.getIndex(), INDEX_WIDTH, 2);
+            appendFixed(out, candidates[i].result.thickness, THICKNESS_WIDTH, 1);
+            appendFixed(out, candidates[i].result.residual, MAXIMA_WIDTH, 5);
+            out += '\n';
+            rows++;
         }
     }
 
-    fin.close();
+    //every ordered two-layer stack of the best films, each layer starting
+    //from half of its single-layer thickness
+    if (pairs && candidates.size() >= 2)  {
+        size_t films = min(candidates.size(), IDENTIFY_PAIR_FILMS);
+        vector<pair<size_t, size_t> > stacks;
+        for (size_t top = 0; top < films; top++) {
+            for (size_t bottom = 0; bottom < films; bottom++) {
+                if (top != bottom)  {
+                    stacks.push_back(make_pair(top, bottom));
+                }
+            }
+        }
+        vector<Stack_fit> stackFitters(pool.size());
+        vector<Stack_fit_result> results(stacks.size());
+        pool.run(stacks.size(), [&](size_t item, unsigned worker) {
+            Film_stack stack;
+            const Candidate* layers[2] = { &candidates[stacks[item].first],
+                &candidates[stacks[item].second] };
+            for (int j = 0; j < 2; j++) {
+                stack.addLayer(materialList[layers[j]->pos], 0.5 * layers[j]->result.thickness,
+                    &tables, int(layers[j]->pos));
+            }
+            stackFitters[worker].prepare(spectrum, stack);
+            results[item] = stackFitters[worker].fit();
+        });
+        vector<size_t> order(stacks.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return results[a].residual < results[b].residual;
+        });
+        out += "\n";
+        appendPadded(out, "Top", MATERIAL_WIDTH, true);
+        appendPadded(out, "Bottom", MATERIAL_WIDTH, true);
+        appendPadded(out, "Top (nm)", THICKNESS_WIDTH, false);
+        appendPadded(out, "Bottom (nm)", THICKNESS_WIDTH, false);
+        appendPadded(out, "Residual", MAXIMA_WIDTH, false);
+        out += '\n';
+        for (size_t i = 0; i < order.size(); i++) {
+            const Stack_fit_result& result = results[order[i]];
+            appendPadded(out, materialList[candidates[stacks[order[i]].first].pos].getMat(),
+                MATERIAL_WIDTH, true);
+            appendPadded(out, materialList[candidates[stacks[order[i]].second].pos].getMat(),
+                MATERIAL_WIDTH, true);
+            appendFixed(out, result.thickness[0], THICKNESS_WIDTH, 1);
+            appendFixed(out, result.thickness[1], THICKNESS_WIDTH, 1);
+            appendFixed(out, result.residual, MAXIMA_WIDTH, 5);
+            out += '\n';
+        }
+    }
+    cout << out;
+    return 0;
 }
-    
-void readFile(vector<Thin_film>& materialList, string films)  {
-    ifstream fin(films.c_str());
-    if (fin.fail()) {
-        cout << "Input file failed to open\n";
-        exit(-1);
+
+//one site of a wafer map
+struct Wafer_site  {
+    double x;
+    double y;
+    //counted fringes, used when there is no spectrum file
+    double spectralRange;
+    double numberOfMaxima;
+    string spectrum;
+    double thickness;
+    bool measured;
+};
+
+//splits a line into trimmed comma separated fields
+static size_t splitFields(const char* begin, const char* end, const char** fieldBegin,
+    const char** fieldEnd, size_t maxFields)  {
+    size_t count = 0;
+    for (const char* p = begin; count < maxFields; ) {
+        const char* comma = static_cast<const char*>(memchr(p, ',', end - p));
+        const char* last = comma != 0 ? comma : end;
+        fieldBegin[count] = p;
+        fieldEnd[count] = last;
+        while (fieldBegin[count] < last && isBlank(*fieldBegin[count])) {
+            fieldBegin[count]++;
+        }
+        while (fieldEnd[count] > fieldBegin[count] && isBlank(fieldEnd[count][-1])) {
+            fieldEnd[count]--;
+        }
+        count++;
+        if (comma == 0)  {
+            return count;
+        }
+        p = comma + 1;
+    }
+    return maxFields + 1;
+}
+
+int runWaferMap(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const string& gridFile,
+    const string& outFile, const Sink_policy& policy)  {
+    Thin_film film;
+    if (!resolveMaterial(materialList, filmIndex, material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return 1;
+    }
+    int pos = filmIndex.find(material);
+    Mapped_file file;
+    if (!file.open(gridFile))  {
+        cerr << "Site grid " << gridFile << " failed to open.\n";
+        return 1;
+    }
+    filesystem::path directory = filesystem::path(gridFile).parent_path();
+
+    vector<Wafer_site> sites;
+    vector<size_t> counted;
+    vector<size_t> fitted;
+    const char* p = file.data();
+    const char* end = p + file.size();
+    const char* lineBegin = 0;
+    const char* lineEnd = 0;
+    int lineNumber = 0;
+    int errors = 0;
+    while (nextLine(p, end, lineBegin, lineEnd)) {
+        lineNumber++;
+        if (lineBegin == lineEnd || *lineBegin == '#')  {
+            continue;
+        }
+        const char* fieldBegin[4];
+        const char* fieldEnd[4];
+        size_t fields = splitFields(lineBegin, lineEnd, fieldBegin, fieldEnd, 4);
+        Wafer_site site;
+        site.spectralRange = 0.0;
+        site.numberOfMaxima = 0.0;
+        site.thickness = 0.0;
+        site.measured = false;
+        bool position = fields >= 3 && parseNumber(fieldBegin[0], fieldEnd[0], site.x)
+            && parseNumber(fieldBegin[1], fieldEnd[1], site.y);
+        if (!position && sites.empty() && errors == 0)  {
+            //a header line
+            continue;
+        }
+        //a counted site needs a spectral range and a count that are not negative
+        if (position && fields == 4 && parseNumber(fieldBegin[2], fieldEnd[2], site.spectralRange)
+            && parseNumber(fieldBegin[3], fieldEnd[3], site.numberOfMaxima)
+            && site.spectralRange >= 0.0 && site.numberOfMaxima >= 0.0)  {
+            counted.push_back(sites.size());
+        } else if (position && fields == 3 && fieldBegin[2] != fieldEnd[2])  {
+            site.spectrum = (directory / string(fieldBegin[2], fieldEnd[2])).string();
+            fitted.push_back(sites.size());
+        } else  {
+            cerr << gridFile << ":" << lineNumber << ": malformed site: "
+                << string(lineBegin, lineEnd) << '\n';
+            errors++;
+            continue;
+        }
+        sites.push_back(site);
+    }
+
+    //counted sites go through the batched kernel in one call
+    Film_batch batch;
+    batch.reserve(counted.size());
+    for (size_t i = 0; i < counted.size(); i++) {
+        const Wafer_site& site = sites[counted[i]];
+        batch.add(film.getIndex(), site.spectralRange, site.numberOfMaxima);
+    }
+    const double* thickness = batch.calculateThickness();
+    for (size_t i = 0; i < counted.size(); i++) {
+        sites[counted[i]].thickness = thickness[i];
+        sites[counted[i]].measured = true;
+    }
+
+    //spectra are fitted in parallel, every worker with its own scratch space
+    if (!fitted.empty())  {
+        Work_pool pool;
+        vector<Fringe_counter> counters(pool.size());
+        vector<Reflectance_fit> fitters(pool.size());
+        vector<Spectrum> spectra(pool.size());
+        pool.run(fitted.size(), [&](size_t item, unsigned worker) {
+            Wafer_site& site = sites[fitted[item]];
+            Spectrum& spectrum = spectra[worker];
+            if (!loadSpectrum(spectrum, site.spectrum))  {
+                return;
+            }
+            Thin_film measured = film;
+            measured.setspectralRange(spectrum.getspectralRange());
+            measured.setnumberOfMaxima(counters[worker].countMaxima(spectrum));
+            site.thickness = cachedFit(fitters[worker], spectrum, measured, &tables,
+                pos).thickness;
+            site.measured = true;
+        });
+        for (size_t i = 0; i < fitted.size(); i++) {
+            if (!sites[fitted[i]].measured)  {
+                cerr << "Spectrum " << sites[fitted[i]].spectrum << " could not be read.\n";
+                errors++;
+            }
+        }
+    }
+
+    //uniformity over the measured sites
+    size_t count = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+    double low = 0.0;
+    double high = 0.0;
+    for (size_t i = 0; i < sites.size(); i++) {
+        if (!sites[i].measured)  {
+            continue;
+        }
+        double t = sites[i].thickness;
+        low = count == 0 || t < low ? t : low;
+        high = count == 0 || t > high ? t : high;
+        count++;
+        double delta = t - mean;
+        mean += delta / count;
+        m2 += delta * (t - mean);
+    }
+    if (count == 0)  {
+        cerr << "Site grid " << gridFile << " holds no sites that could be measured.\n";
+        return errors > 0 ? errors : 1;
+    }
+    double sigma = count > 1 ? sqrt(m2 / (count - 1)) : 0.0;
+    double sigmaPercent = mean != 0.0 ? 100.0 * sigma / mean : 0.0;
+
+    string wafer = filesystem::path(gridFile).stem().string();
+    string record;
+    record.reserve(64 + 24 * count);
+    record += wafer;
+    record += '\t';
+    record += film.getMat();
+    record += '\t';
+    appendShortest(record, film.getIndex());
+    record += '\t';
+    record += to_string(count);
+    const double metrics[] = { mean, low, high, sigmaPercent };
+    for (int i = 0; i < 4; i++) {
+        record += '\t';
+        appendFixed(record, metrics[i], 0, i < 3 ? 1 : 2);
+    }
+    record += '\t';
+    bool first = true;
+    for (size_t i = 0; i < sites.size(); i++) {
+        if (!sites[i].measured)  {
+            continue;
+        }
+        if (!first)  {
+            record += ';';
+        }
+        first = false;
+        appendShortest(record, sites[i].x);
+        record += ',';
+        appendShortest(record, sites[i].y);
+        record += ',';
+        appendFixed(record, sites[i].thickness, 0, 1);
+    }
+    record += '\n';
+
+    FILE* out = fopen(outFile.c_str(), "ab");
+    if (out == 0)  {
+        cerr << "Output file failed to open.\n";
+        return errors + 1;
+    }
+    bool written = fwrite(record.data(), 1, record.size(), out) == record.size()
+        && fflush(out) == 0;
+#ifdef THIN_FILM_POSIX
+    written = written && (policy.durability != DURABILITY_FSYNC || fdatasync(fileno(out)) == 0);
+#endif
+    if (fclose(out) != 0 || !written)  {
+        cerr << "Output file " << outFile << " could not be written.\n";
+        return errors + 1;
+    }
+
+    string summary;
+    static const string columns[] = { "Wafer", "Sites", "Mean (nm)", "Min (nm)", "Max (nm)",
+        "Range (nm)", "1-sigma %" };
+    appendPadded(summary, columns[0], MATERIAL_WIDTH, true);
+    appendPadded(summary, columns[1], INDEX_WIDTH, false);
+    for (int i = 2; i < 7; i++) {
+        appendPadded(summary, columns[i], MAXIMA_WIDTH, false);
     }
-    while (fin.good()) {
-        Thin_film temp;
-        temp.readFilm(fin);
-        if (fin.good()) {
-            materialList.push_back(temp);
+    summary += '\n';
+    appendPadded(summary, wafer, MATERIAL_WIDTH, true);
+    appendPadded(summary, to_string(count), INDEX_WIDTH, false);
+    appendFixed(summary, mean, MAXIMA_WIDTH, 1);
+    appendFixed(summary, low, MAXIMA_WIDTH, 1);
+    appendFixed(summary, high, MAXIMA_WIDTH, 1);
+    appendFixed(summary, high - low, MAXIMA_WIDTH, 1);
+    appendFixed(summary, sigmaPercent, MAXIMA_WIDTH, 2);
+    summary += '\n';
+    cout << summary;
+    return errors;
+}
+
+Uncertainty_options::Uncertainty_options()  {
+    samples = 1000000;
+    seed = 1;
+    budgetMillis = 0;
+}
+
+/**
+    runs task(first, count, worker) over consecutive blocks of samples on
+    every worker until every sample is drawn or the time budget runs out
+    @param pool The workers
+    @param samples The number of samples
+    @param block The number of samples per task
+    @param budgetMillis The time budget, 0 for no limit
+    @param task The function drawing the samples [first, first + count)
+    @return the number of samples in the blocks finished before the first
+    unfinished one
+*/
+static size_t sampleBlocks(Work_pool& pool, size_t samples, size_t block, int budgetMillis,
+    const function<void(size_t, size_t, unsigned)>& task)  {
+    size_t blocks = (samples + block - 1) / block;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now()
+        + chrono::milliseconds(budgetMillis);
+    //blocks are claimed in order, so the finished ones form a prefix except for a few in flight
+    vector<char> finished(blocks, 0);
+    atomic<size_t> next(0);
+    pool.run(pool.size(), [&](size_t, unsigned worker) {
+        for (size_t b = next++; b < blocks; b = next++) {
+            if (budgetMillis > 0 && chrono::steady_clock::now() >= deadline)  {
+                return;
+            }
+            size_t first = b * block;
+            task(first, min(block, samples - first), worker);
+            finished[b] = 1;
         }
+    });
+    size_t done = 0;
+    while (done < blocks && finished[done])  {
+        done++;
     }
-    fin.close();
+    return min(done * block, samples);
 }
-    
-void listFilms(vector<Thin_film>& materialList)   {
-    cout << "\nTHIN FILM LIBRARY\n";
-    cout << setw(MATERIAL_WIDTH) << left << "Material"
-         << setw(INDEX_WIDTH + 4) << right << "Index" << endl;
-    for (unsigned num = 0; num < materialList.size(); num++) {
-        cout << setw(2) << right << (num + 1) << " ";
-        materialList[num].printLib();
+
+//appends one line of the --uncertainty report
+static void appendReportLine(string& out, const string& label, const string& value)  {
+    appendPadded(out, label, MATERIAL_WIDTH, true);
+    out += value;
+    out += '\n';
+}
+
+//formats a thickness, or a pair of them, for the --uncertainty report
+static string formatNanometres(double value, double other = NAN)  {
+    string text;
+    appendFixed(text, value, 0, 1);
+    if (!isnan(other))  {
+        text += " - ";
+        appendFixed(text, other, 0, 1);
     }
+    return text;
 }
 
-void saveData(const vector<Thin_film>& materialList, string fileName) {
-    ofstream fout(fileName.c_str());
-    if (fout.fail()) {
-        cout << "Output file failed to open.\n";
+//returns the q quantile of sorted samples, interpolating between neighbours
+static double sortedQuantile(const vector<double>& sorted, double q)  {
+    double position = q * double(sorted.size() - 1);
+    size_t below = size_t(position);
+    if (below + 1 >= sorted.size())  {
+        return sorted.back();
+    }
+    double fraction = position - double(below);
+    return sorted[below] + fraction * (sorted[below + 1] - sorted[below]);
+}
+
+int runUncertainty(Film_library& library, const vector<string>& inputs,
+    const Uncertainty_options& options)  {
+    if (inputs.size() != 2 && inputs.size() != 3)  {
+        cerr << "--uncertainty needs <material|index> <spectralRange> <maxima> or"
+            " <material|index> <spectrum>\n";
+        return 1;
+    }
+    if (options.samples < 2 || options.samples > UNCERTAINTY_MAX_SAMPLES)  {
+        cerr << "--samples must be from 2 to " << UNCERTAINTY_MAX_SAMPLES << ".\n";
+        return 1;
+    }
+    bool fitting = inputs.size() == 2;
+    Input_distribution index;
+    Input_distribution spectralRange;
+    Input_distribution maxima;
+    string material;
+    if (!index.parse(inputs[0], material))  {
+        cerr << "Bad spread in " << inputs[0] << '\n';
+        return 1;
+    }
+    double number = 0.0;
+    if (!parseNumber(material.data(), material.data() + material.size(), number))  {
+        library.find(material);
+    }
+    Thin_film film;
+    if (!resolveMaterial(library.getFilms(), library.getIndex(), material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return 1;
+    }
+    int pos = library.getIndex().find(material);
+    index.value = film.getIndex();
+    if (fitting && index.shape != INPUT_FIXED && film.getDispersion() != 0)  {
+        cerr << "The index of " << material << " follows a dispersion model and cannot"
+            " be varied.\n";
+        return 1;
+    }
+
+    Spectrum spectrum;
+    Fit_result nominal;
+    vector<double> model;
+    if (fitting)  {
+        if (!loadSpectrum(spectrum, inputs[1]))  {
+            cerr << "Spectrum " << inputs[1] << " could not be read.\n";
+            return 1;
+        }
+        Fringe_counter counter;
+        film.setspectralRange(spectrum.getspectralRange());
+        film.setnumberOfMaxima(counter.countMaxima(spectrum));
+        Reflectance_fit fitter;
+        fitter.prepare(spectrum, film, &library.getTables(), pos);
+        nominal = fitter.fit(film.getThickness());
+        const double* reflectance = fitter.reflectance(nominal.thickness);
+        model.resize(fitter.size());
+        for (size_t j = 0; j < model.size(); j++) {
+            model[j] = nominal.scale * reflectance[j] + nominal.offset;
+        }
+    }
+    else  {
+        string text;
+        if (!spectralRange.parse(inputs[1], text)
+            || !parseNumber(text.data(), text.data() + text.size(), spectralRange.value)
+            || !maxima.parse(inputs[2], text)
+            || !parseNumber(text.data(), text.data() + text.size(), maxima.value))  {
+            cerr << "The spectral range and maxima must be numbers with an optional"
+                " +-sigma or ~halfwidth\n";
+            return 1;
+        }
+        film.setspectralRange(spectralRange.value);
+        film.setnumberOfMaxima(maxima.value);
+        nominal.thickness = film.getThickness();
+    }
+
+    Counter_rng rng(options.seed);
+    Work_pool pool;
+    vector<double> thickness(options.samples);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t drawn = 0;
+    if (!fitting)  {
+        //stream 0 holds the index and range words of a sample, stream 1 the maxima words
+        struct Scratch  {
+            vector<uint32_t> words;
+            vector<double> index;
+            vector<double> spectralRange;
+            vector<double> numberOfMaxima;
+        };
+        vector<Scratch> scratch(pool.size());
+        drawn = sampleBlocks(pool, options.samples, UNCERTAINTY_BLOCK, options.budgetMillis,
+            [&](size_t first, size_t count, unsigned worker) {
+            Scratch& own = scratch[worker];
+            own.words.resize(8 * count);
+            own.index.resize(count);
+            own.spectralRange.resize(count);
+            own.numberOfMaxima.resize(count);
+            const uint32_t* w = own.words.data();
+            rng.generate(first, 0, count, own.words.data());
+            rng.generate(first, 1, count, own.words.data() + 4 * count);
+            for (size_t i = 0; i < count; i++) {
+                own.index[i] = index.sample(w[i], w[count + i]);
+                own.spectralRange[i] = spectralRange.sample(w[2 * count + i], w[3 * count + i]);
+                own.numberOfMaxima[i] = maxima.sample(w[4 * count + i], w[5 * count + i]);
+            }
+            calculateThickness(own.index.data(), own.spectralRange.data(),
+                own.numberOfMaxima.data(), thickness.data() + first, count);
+            for (size_t i = 0; i < count; i++) {
+                if (own.index[i] <= 1.0 || own.spectralRange[i] < 0.0 || own.numberOfMaxima[i] < 0.0)  {
+                    thickness[first + i] = NAN;
+                }
+            }
+        });
+    }
+    else  {
+        //stream 0 holds the index words of a sample, stream 2 + i the noise words of sample i
+        struct Scratch  {
+            vector<uint32_t> words;
+            Spectrum spectrum;
+            Reflectance_fit fitter;
+        };
+        vector<Scratch> scratch(pool.size());
+        double rms = nominal.residual;
+        drawn = sampleBlocks(pool, options.samples, UNCERTAINTY_FIT_BLOCK, options.budgetMillis,
+            [&](size_t first, size_t count, unsigned worker) {
+            Scratch& own = scratch[worker];
+            uint32_t indexWords[4 * UNCERTAINTY_FIT_BLOCK];
+            rng.generate(first, 0, count, indexWords);
+            own.spectrum = spectrum;
+            size_t pairs = (model.size() + 1) / 2;
+            own.words.resize(4 * pairs);
+            const uint32_t* w = own.words.data();
+            for (size_t i = 0; i < count; i++) {
+                rng.generate(0, 2 + first + i, pairs, own.words.data());
+                for (size_t j = 0; j < model.size(); j++) {
+                    size_t c = j / 2;
+                    size_t word = j % 2 == 0 ? 0 : 2;
+                    own.spectrum.intensity[j] = model[j]
+                        + rms * Counter_rng::normal(w[word * pairs + c], w[(word + 1) * pairs + c]);
+                }
+                Thin_film sample = film;
+                double start = nominal.thickness;
+                if (index.shape == INPUT_FIXED)  {
+                    own.fitter.prepare(own.spectrum, sample, &library.getTables(), pos);
+                }
+                else  {
+                    //the tables hold the library index, a drawn one is used directly
+                    sample.setIndex(index.sample(indexWords[i], indexWords[count + i]));
+                    if (sample.getIndex() <= 1.0)  {
+                        thickness[first + i] = NAN;
+                        continue;
+                    }
+                    start *= index.value / sample.getIndex();
+                    own.fitter.prepare(own.spectrum, sample);
+                }
+                thickness[first + i] = own.fitter.refine(start).thickness;
+            }
+        });
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    //draws without a physical thickness are dropped
+    thickness.resize(drawn);
+    size_t kept = 0;
+    for (size_t i = 0; i < thickness.size(); i++) {
+        if (isfinite(thickness[i]))  {
+            thickness[kept++] = thickness[i];
+        }
+    }
+    thickness.resize(kept);
+    if (thickness.size() < 2)  {
+        cerr << "Too few valid samples were drawn.\n";
+        return 1;
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < thickness.size(); i++) {
+        sum += thickness[i];
+    }
+    double mean = sum / double(thickness.size());
+    double squares = 0.0;
+    for (size_t i = 0; i < thickness.size(); i++) {
+        squares += (thickness[i] - mean) * (thickness[i] - mean);
+    }
+    double sigma = sqrt(squares / double(thickness.size() - 1));
+    sort(thickness.begin(), thickness.end());
+
+    string out;
+    appendReportLine(out, "Material", film.getMat() + " " + index.format());
+    if (fitting)  {
+        string residual;
+        appendFixed(residual, nominal.residual, 0, 5);
+        appendReportLine(out, "Spectrum", inputs[1] + ", noise " + residual);
+    }
+    else  {
+        appendReportLine(out, "Spectral range (nm)", spectralRange.format());
+        appendReportLine(out, "Maxima", maxima.format());
+    }
+    string count = to_string(thickness.size()) + " (seed " + to_string(options.seed) + ", ";
+    appendFixed(count, seconds, 0, 2);
+    count += " s)";
+    appendReportLine(out, "Samples", count);
+    if (drawn < options.samples)  {
+        appendReportLine(out, "Time budget reached after", to_string(drawn) + " of "
+            + to_string(options.samples) + " samples, --samples=" + to_string(drawn)
+            + " reproduces them");
+    }
+    if (kept < drawn)  {
+        appendReportLine(out, "Dropped, invalid draws", to_string(drawn - kept));
+    }
+    appendReportLine(out, "Nominal (nm)", formatNanometres(nominal.thickness));
+    appendReportLine(out, "Mean (nm)", formatNanometres(mean));
+    string deviation;
+    appendFixed(deviation, sigma, 0, 2);
+    appendReportLine(out, "Standard deviation (nm)", deviation);
+    appendReportLine(out, "Median (nm)", formatNanometres(sortedQuantile(thickness, 0.5)));
+    appendReportLine(out, "68.3% interval (nm)", formatNanometres(
+        sortedQuantile(thickness, 0.158655), sortedQuantile(thickness, 0.841345)));
+    appendReportLine(out, "95% interval (nm)", formatNanometres(
+        sortedQuantile(thickness, 0.025), sortedQuantile(thickness, 0.975)));
+    cout << out;
+    return 0;
+}
+
+int runAcquire(const vector<Thin_film>& materialList, const Film_index& filmIndex,
+    const Dispersion_tables& tables, string material, const string& source,
+    const string& outFile, bool fitting, const Sink_policy& policy)  {
+    Thin_film film;
+    if (!resolveMaterial(materialList, filmIndex, material, film))  {
+        cerr << "Material " << material << " is not in the library.\n";
+        return 1;
+    }
+    int pos = filmIndex.find(material);
+    FILE* stream = source == "-" ? stdin : fopen(source.c_str(), "rb");
+    if (stream == 0)  {
+        cerr << "Spectrum stream " << source << " failed to open.\n";
+        return 1;
+    }
+    Result_sink results(outFile, policy);
+    if (!results.isOpen()) {
+        cerr << "Output file failed to open.\n";
+        exit(-1);
+    }
+    struct stat info;
+    bool live = fstat(fileno(stream), &info) != 0 || !S_ISREG(info.st_mode);
+    Acquisition_pipeline pipeline(film, &tables, pos, fitting, results);
+    bool ok = pipeline.run(stream, live);
+    if (stream != stdin)  {
+        fclose(stream);
+    }
+    if (!results.commit()) {
         exit(-1);
     }
+    cerr << pipeline.getFrames() << " spectra acquired, " << pipeline.getWritten()
+        << " results written to " << outFile;
+    if (pipeline.getDropped() > 0)  {
+        cerr << ", " << pipeline.getDropped() << " dropped with no free slot";
+    }
+    if (pipeline.getRejected() > 0)  {
+        cerr << ", " << pipeline.getRejected() << " rejected";
+    }
+    cerr << '\n';
+    return ok ? 0 : 1;
+}
+
+//the film library behind a tfc_library handle, with scratch space per worker
+struct tfc_library  {
+    Film_library library;
+    Work_pool pool;
+    vector<Fringe_counter> counters;
+    vector<Reflectance_fit> fitters;
+    //one measurement at a time uses the pool
+    mutex lock;
+
+    explicit tfc_library(const string& fileName)
+        : library(fileName, Wavelength_grid()), counters(pool.size()), fitters(pool.size())  {
+    }
+};
+
+//the description of the last error of each thread calling the C interface
+static thread_local string abiError;
+
+//records an error for tfc_last_error() and returns its code
+static int abiFail(int code, const string& message)  {
+    abiError = message;
+    return code;
+}
+
+int tfc_abi_version(void)  {
+    return TFC_ABI_VERSION;
+}
+
+const char* tfc_last_error(void)  {
+    return abiError.c_str();
+}
 
-    for (unsigned i = 0; i < materialList.size(); i++) {
-        materialList[i].writeFile(fout);
+tfc_library* tfc_library_open(const char* films_file)  {
+    abiError.clear();
+    try  {
+        //the handle is freed if loading throws
+        unique_ptr<tfc_library> library(new tfc_library(films_file != 0 ? films_file : ""));
+        library->library.load();
+        return library.release();
+    } catch (const exception& error)  {
+        abiFail(TFC_ERROR_INTERNAL, error.what());
+        return 0;
     }
+}
 
-    fout.close();
+void tfc_library_close(tfc_library* library)  {
+    delete library;
+}
+
+int tfc_material_index(tfc_library* library, const char* material, double* index)  {
+    abiError.clear();
+    if (library == 0 || material == 0 || index == 0)  {
+        return abiFail(TFC_ERROR_ARGUMENT, "null argument");
+    }
+    int pos = library->library.getIndex().find(material);
+    if (pos < 0)  {
+        return abiFail(TFC_ERROR_MATERIAL, string("unknown material ") + material);
+    }
+    *index = library->library.getFilms()[pos].getIndex();
+    return TFC_OK;
+}
+
+int tfc_thickness(const double* index, const double* spectral_range,
+    const double* maxima, double* thickness, size_t count)  {
+    abiError.clear();
+    if (count > 0 && (index == 0 || spectral_range == 0 || maxima == 0 || thickness == 0))  {
+        return abiFail(TFC_ERROR_ARGUMENT, "null array");
+    }
+    calculateThickness(index, spectral_range, maxima, thickness, count);
+    return TFC_OK;
 }
 
-int getFilmIndex(vector<Thin_film>& materialList)   {
-    listFilms(materialList);
-    cout << "Enter the number preceeding the name of the thin film material: ";
-                int pos = 0;
-                cin >> pos;
-                return pos - 1;
+int tfc_measure_spectra(tfc_library* library, const char* material,
+    const double* wavelength, const double* intensity, const size_t* offsets, size_t count,
+    int fit, double* maxima, double* thickness, double* residual)  {
+    abiError.clear();
+    if (library == 0 || material == 0 || offsets == 0 || thickness == 0)  {
+        return abiFail(TFC_ERROR_ARGUMENT, "null argument");
+    }
+    if (count > 0 && offsets[count] > offsets[0] && (wavelength == 0 || intensity == 0))  {
+        return abiFail(TFC_ERROR_ARGUMENT, "null spectrum arrays");
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (offsets[i + 1] < offsets[i])  {
+            return abiFail(TFC_ERROR_ARGUMENT, "offsets must not descend");
+        }
+    }
+    const Film_library& films = library->library;
+    Thin_film film;
+    if (!resolveMaterial(films.getFilms(), films.getIndex(), material, film))  {
+        return abiFail(TFC_ERROR_MATERIAL, string("unknown material ") + material);
+    }
+    int pos = films.getIndex().find(material);
+    const double NOT_MEASURED = numeric_limits<double>::quiet_NaN();
+    atomic<int> failed(0);
+    try  {
+        lock_guard<mutex> guard(library->lock);
+        library->pool.run(count, [&](size_t item, unsigned worker) {
+            const double* w = wavelength + offsets[item];
+            const double* y = intensity + offsets[item];
+            size_t n = offsets[item + 1] - offsets[item];
+            bool valid = n >= 3;
+            for (size_t i = 1; valid && i < n; i++) {
+                valid = w[i] > w[i - 1];
+            }
+            if (residual != 0)  {
+                residual[item] = NOT_MEASURED;
+            }
+            if (!valid)  {
+                thickness[item] = NOT_MEASURED;
+                if (maxima != 0)  {
+                    maxima[item] = NOT_MEASURED;
+                }
+                failed++;
+                return;
+            }
+            Thin_film measured = film;
+            int count = library->counters[worker].countMaxima(y, n);
+            measured.setspectralRange(w[n - 1] - w[0]);
+            measured.setnumberOfMaxima(count);
+            if (maxima != 0)  {
+                maxima[item] = count;
+            }
+            thickness[item] = measured.getThickness();
+            if (fit)  {
+                Fit_result result = cachedFit(library->fitters[worker], w, y, n, measured,
+                    &films.getTables(), pos);
+                thickness[item] = result.thickness;
+                if (residual != 0)  {
+                    residual[item] = result.residual;
+                }
+            }
+        });
+    } catch (const exception& error)  {
+        return abiFail(TFC_ERROR_INTERNAL, error.what());
+    }
+    return failed.load();
 }
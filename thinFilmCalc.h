@@ -0,0 +1,127 @@
+/**
+*@description  C interface to the thinFilmCalc thickness engines, for tools
+that measure whole batches in process instead of running the executable
+once per measurement. Build the library from the same source without its
+main(), for example
+    g++ -std=c++17 -O2 -pthread -fPIC -shared -DTHINFILMCALC_LIBRARY thinFilmCalc.cpp -o libthinFilmCalc.so
+Every function takes caller-owned arrays and writes its results into
+caller-owned arrays; nothing is copied across the interface and nothing
+the library allocates is handed to the caller except the library handle.
+Functions return TFC_OK (0) or a negative TFC_ERROR_ code, and
+tfc_last_error() describes the last error of the calling thread. Errors
+never end the host process, and the library prints no warnings. The
+interface only grows: functions keep their signatures within an ABI
+version, and TFC_ABI_VERSION changes when one of them has to change.
+*/
+
+#ifndef THINFILMCALC_H
+#define THINFILMCALC_H
+
+#include <stddef.h>
+
+//the library exports the functions, its users import them
+#if defined(_WIN32) && defined(THINFILMCALC_LIBRARY)
+#define TFC_API __declspec(dllexport)
+#elif defined(_WIN32) && !defined(THINFILMCALC_SOURCE)
+#define TFC_API __declspec(dllimport)
+#elif defined(_WIN32)
+#define TFC_API
+#elif defined(__GNUC__)
+#define TFC_API __attribute__((visibility("default")))
+#else
+#define TFC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//version of the interface declared here
+#define TFC_ABI_VERSION 1
+
+#define TFC_OK 0
+//a required pointer is null or the offsets are not ascending
+#define TFC_ERROR_ARGUMENT -1
+//the material is neither in the library nor a refractive index
+#define TFC_ERROR_MATERIAL -2
+//the library could not complete the call
+#define TFC_ERROR_INTERNAL -3
+
+//a film library: the built-in catalog, optionally with a films.txt over it
+typedef struct tfc_library tfc_library;
+
+//returns the TFC_ABI_VERSION the library was built with
+TFC_API int tfc_abi_version(void);
+
+/**
+    returns the description of the last error of the calling thread, empty
+    if its last call succeeded; valid until the next call on the thread
+*/
+TFC_API const char* tfc_last_error(void);
+
+/**
+    opens a film library and loads it, after which the handle may be used
+    from several threads
+    @param films_file A films.txt to lay over the catalog, or null for the
+    built-in catalog only; a missing file is empty
+    @return the library, or null if it could not be set up
+*/
+TFC_API tfc_library* tfc_library_open(const char* films_file);
+
+//closes a library opened by tfc_library_open(); null is ignored
+TFC_API void tfc_library_close(tfc_library* library);
+
+/**
+    looks up the refractive index of a material at 632.8nm
+    @param library The library
+    @param material Material name, optionally with a variant tag
+    @param index Receives the index
+    @return TFC_OK, or TFC_ERROR_MATERIAL if the library does not hold it
+*/
+TFC_API int tfc_material_index(tfc_library* library, const char* material, double* index);
+
+/**
+    calculates thicknesses with the thin film equation
+        d = m * delta lambda / 2(n^2 - 1)^1/2
+    with the vectorized kernel of the executable's batch mode
+    @param index The refractive indices, count of them
+    @param spectral_range The spectral ranges in nm
+    @param maxima The numbers of maxima
+    @param thickness Receives the thicknesses in nm; may be one of the inputs
+    @param count The number of films
+    @return TFC_OK or TFC_ERROR_ARGUMENT
+*/
+TFC_API int tfc_thickness(const double* index, const double* spectral_range,
+    const double* maxima, double* thickness, size_t count);
+
+/**
+    measures a batch of spectra of one material on silicon. The spectra lie
+    back to back in two arrays: spectrum i is samples offsets[i] up to
+    offsets[i + 1] of wavelength and intensity, so offsets holds count + 1
+    entries. Wavelengths are in nm and ascend within a spectrum. The fringe
+    count gives the closed-form thickness, which fitting refines with the
+    transfer-matrix model like --fit. Spectra are measured in parallel.
+    @param library The library
+    @param material Material name or refractive index
+    @param wavelength The wavelengths of all spectra
+    @param intensity The intensities of all spectra
+    @param offsets The first sample of every spectrum and one past the last
+    @param count The number of spectra
+    @param fit Nonzero to fit every spectrum
+    @param maxima Receives the numbers of maxima, or null
+    @param thickness Receives the thicknesses in nm, NaN where a spectrum
+    has fewer than 3 samples or falling wavelengths
+    @param residual Receives the RMS residuals of the fits, or null; NaN
+    without fitting
+    @return the number of spectra that could not be measured, or a
+    negative TFC_ERROR_ code
+*/
+TFC_API int tfc_measure_spectra(tfc_library* library, const char* material,
+    const double* wavelength, const double* intensity, const size_t* offsets, size_t count,
+    int fit, double* maxima, double* thickness, double* residual);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif